@@ -15,9 +15,14 @@
 
 extern uint64_t ContainerSize;
 
+DEFINE_bool(ArrangementFastPath,
+            true, "move containers whose chunks all stay active or all become archived without recompressing them, "
+                  "or without reading them if the liveness tracked during the backup tells");
+
 class ArrangementFilterPipeline{
 public:
-    ArrangementFilterPipeline(): taskAmount(0), runningFlag(true), mutexLock(), condition(mutexLock){
+    ArrangementFilterPipeline(ArrangementWritePipeline *writer): taskAmount(0), runningFlag(true), mutexLock(),
+                                                                 condition(mutexLock), writePipeline(writer){
         worker = new std::thread(std::bind(&ArrangementFilterPipeline::arrangementFilterCallback, this));
     }
 
@@ -26,13 +31,17 @@ public:
         taskList.push_back(arrangementFilterTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~ArrangementFilterPipeline() {
         printf("total Read I/O:%lu, total Write I/O:%lu, Skip I/O:%lu\n", totalReadIO, totalWriteIO, skipWriteIO);
+        printf("Containers relinked:%lu, moved without rewriting:%lu, decompressed:%lu\n", relinkedContainers,
+               movedContainers, splitContainers);
         runningFlag = false;
         condition.notifyAll();
         worker->join();
+        delete writePipeline;
     }
 
 private:
@@ -60,14 +69,14 @@ private:
                 ArrangementWriteTask* arrangementWriteTask = new ArrangementWriteTask();
                 arrangementWriteTask->startFlag = true;
                 arrangementWriteTask->arrangementVersion = arrangementFilterTask->arrangementVersion;
-                GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
+                writePipeline->addTask(arrangementWriteTask);
                 delete arrangementFilterTask;
                 continue;
             }
 
             if(unlikely(arrangementFilterTask->classEndFlag)){
                 ArrangementWriteTask* arrangementWriteTask = new ArrangementWriteTask(true, arrangementFilterTask->classId);
-                GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
+                writePipeline->addTask(arrangementWriteTask);
                 delete arrangementFilterTask;
                 continue;
             }
@@ -75,45 +84,63 @@ private:
             if(unlikely(arrangementFilterTask->finalEndFlag)){
                 ArrangementWriteTask *arrangementWriteTask = new ArrangementWriteTask(true);
                 arrangementWriteTask->countdownLatch = arrangementFilterTask->countdownLatch;
-                GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
+                writePipeline->addTask(arrangementWriteTask);
+                delete arrangementFilterTask;
+                continue;
+            }
+
+            if (arrangementFilterTask->relink) {
+                ArrangementWriteTask *arrangementWriteTask = new ArrangementWriteTask();
+                arrangementWriteTask->relink = true;
+                arrangementWriteTask->isArchived = arrangementFilterTask->relinkArchived;
+                arrangementWriteTask->beforeClassId = arrangementFilterTask->classId;
+                arrangementWriteTask->arrangementVersion = arrangementFilterTask->arrangementVersion;
+                arrangementWriteTask->objectID = arrangementFilterTask->objectID;
+                arrangementWriteTask->objectIndex = arrangementFilterTask->objectIndex;
+                arrangementWriteTask->chunkCount = arrangementFilterTask->chunkCount;
+                arrangementWriteTask->sourceCategory = arrangementFilterTask->sourceCategory;
+                arrangementWriteTask->sourceCID = arrangementFilterTask->sourceCID;
+                writePipeline->addTask(arrangementWriteTask);
+                relinkedContainers++;
                 delete arrangementFilterTask;
-                printf("ArrangementFilterPipeline finish\n");
                 continue;
             }
 
+            if (arrangementFilterTask->compressed && moveWholeContainer(arrangementFilterTask)) {
+                delete arrangementFilterTask;
+                continue;
+            }
+
+            // the container goes to the writer as a whole, split into runs of chunks with the same fate
             uint64_t readoffset = 0;
             uint8_t *bufferPtr = arrangementFilterTask->readBuffer;
+            ArrangementWriteTask *arrangementWriteTask = new ArrangementWriteTask(
+                    bufferPtr, arrangementFilterTask->length, arrangementFilterTask->classId,
+                    arrangementFilterTask->arrangementVersion);
+            arrangementFilterTask->readBuffer = nullptr;
+            std::vector<ChunkRun> &runs = arrangementWriteTask->runs;
 
             uint64_t tempWriteIO = 0;
             bool actTag = false, arcTag = false;
 
             while (readoffset < arrangementFilterTask->length) {
                 blockHeader = (BlockHeader *) (bufferPtr + readoffset);
+                uint64_t recordLength = sizeof(BlockHeader) + blockHeader->length;
 
-                int r = GlobalMetadataManagerPtr->arrangementLookup(blockHeader->fp);
-
-                if (!r) {
-                    ArrangementWriteTask *arrangementWriteTask = new ArrangementWriteTask(
-                            (uint8_t *) blockHeader,
-                            blockHeader->length + sizeof(BlockHeader),
-                            arrangementFilterTask->classId,
-                            arrangementFilterTask->arrangementVersion,
-                            true);
-                    GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
+                bool archived = !GlobalMetadataManagerPtr->arrangementLookup(blockHeader->fp);
+                if (!runs.empty() && runs.back().isArchived == archived) {
+                    runs.back().length += recordLength;
+                } else {
+                    runs.push_back({readoffset, recordLength, archived});
+                }
+                if (archived) {
                     arcTag = true;
                 } else {
-                    ArrangementWriteTask *arrangementWriteTask = new ArrangementWriteTask(
-                            (uint8_t *) blockHeader,
-                            blockHeader->length + sizeof(BlockHeader),
-                            arrangementFilterTask->classId,
-                            arrangementFilterTask->arrangementVersion,
-                            false);
-                    GlobalArrangementWritePipelinePtr->addTask(arrangementWriteTask);
                     actTag = true;
                 }
                 tempWriteIO += blockHeader->length;
                 totalReadIO += blockHeader->length;
-                readoffset += sizeof(BlockHeader) + blockHeader->length;
+                readoffset += recordLength;
             }
             if (actTag && arcTag) {
                 totalWriteIO += tempWriteIO;
@@ -121,11 +148,56 @@ private:
                 skipWriteIO += tempWriteIO;
             }
             assert(readoffset == arrangementFilterTask->length);
+            writePipeline->addTask(arrangementWriteTask);
 
             delete arrangementFilterTask;
         }
     }
 
+    // Looks the chunks of a compressed container up in its directory. A container which does not
+    // need to be split is handed to the writer as it is and 1 is returned, a mixed one is
+    // decompressed in place for the per-chunk path.
+    int moveWholeContainer(ArrangementFilterTask *arrangementFilterTask) {
+        ContainerDirectory directory;
+        int r = readContainerDirectory(arrangementFilterTask->readBuffer, arrangementFilterTask->length, directory);
+        assert(r);
+
+        uint64_t activeCount = 0, chunkBytes = 0;
+        for (const auto &entry: directory.entries) {
+            activeCount += GlobalMetadataManagerPtr->arrangementLookup(entry.header.fp);
+            chunkBytes += entry.header.length;
+        }
+
+        if (activeCount == 0 || activeCount == directory.entries.size()) {
+            ArrangementWriteTask *arrangementWriteTask = new ArrangementWriteTask();
+            arrangementWriteTask->writeBuffer = arrangementFilterTask->readBuffer;
+            arrangementWriteTask->length = arrangementFilterTask->length;
+            arrangementWriteTask->beforeClassId = arrangementFilterTask->classId;
+            arrangementWriteTask->arrangementVersion = arrangementFilterTask->arrangementVersion;
+            arrangementWriteTask->isArchived = activeCount == 0;
+            arrangementWriteTask->wholeContainer = true;
+            arrangementFilterTask->readBuffer = nullptr;
+            writePipeline->addTask(arrangementWriteTask);
+
+            totalReadIO += chunkBytes;
+            skipWriteIO += chunkBytes;
+            movedContainers++;
+            return 1;
+        }
+
+        uint8_t *decompressedBuffer = (uint8_t *) malloc(directory.rawLength);
+        uint64_t decompressedSize = decompressContainer(decompressedBuffer, directory.rawLength,
+                                                        arrangementFilterTask->readBuffer,
+                                                        arrangementFilterTask->length);
+        assert(!ZSTD_isError(decompressedSize));
+        free(arrangementFilterTask->readBuffer);
+        arrangementFilterTask->readBuffer = decompressedBuffer;
+        arrangementFilterTask->length = decompressedSize;
+        arrangementFilterTask->compressed = false;
+        splitContainers++;
+        return 0;
+    }
+
     bool runningFlag;
     std::thread *worker;
     uint64_t taskAmount;
@@ -136,8 +208,11 @@ private:
     uint64_t totalReadIO = 0;
     uint64_t totalWriteIO = 0;
     uint64_t skipWriteIO = 0;
-};
+    uint64_t relinkedContainers = 0;
+    uint64_t movedContainers = 0;
+    uint64_t splitContainers = 0;
 
-static ArrangementFilterPipeline* GlobalArrangementFilterPipelinePtr;
+    ArrangementWritePipeline *writePipeline;
+};
 
 #endif //MEGA_ARRANGEMENTFILTERPIPELINE_H
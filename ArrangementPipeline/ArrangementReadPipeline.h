@@ -9,18 +9,35 @@
 #ifndef MEGA_ARRANGEMENTREADPIPELINE_H
 #define MEGA_ARRANGEMENTREADPIPELINE_H
 
+#include <atomic>
 #include "ArrangementFilterPipeline.h"
 #include "../Utility/FileOperator.h"
+#include "../Utility/SegmentFile.h"
+#include "../Utility/IOThrottle.h"
 
 extern std::string LogicFilePath;
 extern std::string ClassFilePath;
 extern std::string VersionFilePath;
 extern uint64_t ContainerSize;
 uint64_t ArrangementReadBufferLength = ContainerSize * 1.2;
+// ZSTD_FRAMEHEADERSIZE_MAX, zstd.h only exports it for static linking
+const uint64_t MaxFrameHeaderSize = 18;
 
+DEFINE_uint64(ArrangementThreads,
+              4, "number of categories arranged concurrently, each in its own read, filter and write lane");
+
+// Categories are independent during arrangement, so they are spread over lanes. Every lane has
+// a reader thread, which reads and decompresses, and its own filter and write pipelines. A lane
+// reader takes the next category from the queue when it is done with the last one.
 class ArrangementReadPipeline {
 public:
-    ArrangementReadPipeline() : taskAmount(0), runningFlag(true), mutexLock(), condition(mutexLock) {
+    ArrangementReadPipeline() : taskAmount(0), runningFlag(true), mutexLock(), condition(mutexLock),
+                                laneMutexLock(), laneCondition(laneMutexLock) {
+        laneCount = FLAGS_ArrangementThreads ? FLAGS_ArrangementThreads : 1;
+        for (uint64_t i = 0; i < laneCount; i++) {
+            filterPipelines.push_back(new ArrangementFilterPipeline(new ArrangementWritePipeline(i)));
+            laneWorkers.push_back(new std::thread(std::bind(&ArrangementReadPipeline::laneReadCallback, this, i)));
+        }
         worker = new std::thread(std::bind(&ArrangementReadPipeline::arrangementReadCallback, this));
     }
 
@@ -29,12 +46,24 @@ public:
         taskList.push_back(arrangementTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~ArrangementReadPipeline() {
         runningFlag = false;
         condition.notifyAll();
         worker->join();
+        {
+            MutexLockGuard mutexLockGuard(laneMutexLock);
+            laneCondition.notifyAll();
+        }
+        for (auto laneWorker: laneWorkers) {
+            laneWorker->join();
+            delete laneWorker;
+        }
+        for (auto filterPipeline: filterPipelines) {
+            delete filterPipeline;
+        }
     }
 
 
@@ -61,119 +90,178 @@ private:
             uint64_t arrangementVersion = arrangementTask->arrangementVersion;
 
             if (likely(arrangementVersion > 0)) {
-                ArrangementFilterTask *startTask = new ArrangementFilterTask();
-                startTask->startFlag = true;
-                startTask->arrangementVersion = arrangementVersion;
-                GlobalArrangementFilterPipelinePtr->addTask(startTask);
-
-                readClassWithAppend(1, arrangementVersion);
-                for (uint64_t i = 2; i <= arrangementVersion; i++) {
-                    readClass(i, arrangementVersion);
+                for (auto filterPipeline: filterPipelines) {
+                    ArrangementFilterTask *startTask = new ArrangementFilterTask();
+                    startTask->startFlag = true;
+                    startTask->arrangementVersion = arrangementVersion;
+                    filterPipeline->addTask(startTask);
                 }
 
-                ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(true);
-                arrangementFilterTask->countdownLatch = arrangementTask->countdownLatch;
-                GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-                printf("ArrangementReadPipeline finish, with %lu bytes loaded from %lu categories\n", readAmount,
-                       arrangementVersion);
+                // every lane ends the round with a final task once it finds the queue drained
+                CountdownLatch laneLatch(laneCount);
+                {
+                    MutexLockGuard mutexLockGuard(laneMutexLock);
+                    currentArrangementVersion = arrangementVersion;
+                    for (uint64_t i = 1; i <= arrangementVersion; i++) {
+                        categoryQueue.push_back(i);
+                    }
+                    currentLaneLatch = &laneLatch;
+                    laneRound++;
+                    laneCondition.notifyAll();
+                }
+                laneLatch.wait();
+
+                printf("ArrangementReadPipeline finish, with %lu bytes loaded from %lu categories in %lu lanes\n",
+                       (uint64_t) readAmount, arrangementVersion, laneCount);
+                GlobalIOThrottlePtr->getStatistics();
+                GlobalMetadataManagerPtr->relocate(arrangementVersion + 1);
+                GlobalMetadataManagerPtr->tableRolling();
+                arrangementTask->countdownLatch->countDown();
+                printf("ArrangementWritePipeline finish\n");
             } else {
                 printf("Do not need arrangement, skip\n");
+                GlobalMetadataManagerPtr->relocate(arrangementVersion + 1);
                 GlobalMetadataManagerPtr->tableRolling();
                 arrangementTask->countdownLatch->countDown();
             }
         }
     }
 
-    uint64_t readClass(uint64_t classId, uint64_t versionId) {
-        uint64_t cid = 0;
-        while (1) {
-            char pathbuffer[512];
-            sprintf(pathbuffer, ClassFilePath.data(), classId, versionId, cid);
-            FileOperator classFile((char *) pathbuffer, FileOpenType::TRY);
-            if (!classFile.ok()) {
-                break;
+    void laneReadCallback(uint64_t lane) {
+        pthread_setname_np(pthread_self(), "AReading Lane");
+        IOThrottle::enterIdleClass();
+        ArrangementFilterPipeline *filterPipeline = filterPipelines[lane];
+        uint64_t finishedRound = 0;
+        while (likely(runningFlag)) {
+            uint64_t category = 0, arrangementVersion;
+            CountdownLatch *laneLatch;
+            {
+                MutexLockGuard mutexLockGuard(laneMutexLock);
+                while (finishedRound == laneRound) {
+                    if (unlikely(!runningFlag)) return;
+                    laneCondition.wait();
+                }
+                if (categoryQueue.empty()) {
+                    finishedRound = laneRound;
+                } else {
+                    category = categoryQueue.front();
+                    categoryQueue.pop_front();
+                }
+                arrangementVersion = currentArrangementVersion;
+                laneLatch = currentLaneLatch;
+            }
+
+            if (!category) {
+                ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(true);
+                arrangementFilterTask->countdownLatch = laneLatch;
+                filterPipeline->addTask(arrangementFilterTask);
+            } else if (category == 1) {
+                readClassWithAppend(filterPipeline, category, arrangementVersion);
+            } else {
+                readClass(filterPipeline, category, arrangementVersion);
             }
-            uint8_t *buffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t readSize = classFile.read(buffer, ArrangementReadBufferLength);
-
-            uint8_t *decompressedBuffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t decompressedSize = ZSTD_decompress(decompressedBuffer, ArrangementReadBufferLength, buffer,
-                                                        readSize);
-            assert(!ZSTD_isError(decompressedSize));
-            free(buffer);
-
-            readAmount += readSize;
-            ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(decompressedBuffer,
-                                                                                     decompressedSize, classId,
-                                                                                     versionId);
-            GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-            remove(pathbuffer);
-            cid++;
         }
-        printf("Read %lu containers from Cat.(%lu,%lu)\n", cid + 1, classId, versionId);
+    }
+
+    // The first compressed container of a category tells the dictionary the category is compressed with.
+    void noteDictionary(uint64_t classId, const uint8_t *buffer, uint64_t readSize, bool &dictionaryNoted) {
+        if (!dictionaryNoted) {
+            uint32_t dictID = ZSTD_getDictID_fromFrame(buffer, readSize);
+            GlobalDictionaryStorePtr->setCategoryDictionary(classId, dictID);
+            dictionaryNoted = dictID != 0;
+        }
+    }
+
+    uint64_t readClass(ArrangementFilterPipeline *filterPipeline, uint64_t classId, uint64_t versionId) {
+        bool dictionaryNoted = false;
+        uint64_t count = readSegment(filterPipeline, ClassFilePath, classId, versionId, dictionaryNoted);
+        printf("Read %lu containers from Cat.(%lu,%lu)\n", count, classId, versionId);
         ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(true, classId);
-        GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
+        filterPipeline->addTask(arrangementFilterTask);
+
+        return 0;
+    }
+
+    uint64_t readClassWithAppend(ArrangementFilterPipeline *filterPipeline, uint64_t classId, uint64_t versionId) {
+        bool dictionaryNoted = false;
+        uint64_t count = readSegment(filterPipeline, ClassFilePath, classId, versionId, dictionaryNoted);
+      printf("Read %lu containers from Cat.(%lu,%lu)\n", count, classId, versionId);
 
+        count = readSegment(filterPipeline, ClassFileAppendPath, classId, versionId, dictionaryNoted);
+      printf("Read %lu containers from Cat.(%lu,%lu)_append\n", count, classId, versionId);
+        ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(true, classId);
+        filterPipeline->addTask(arrangementFilterTask);
         return 0;
     }
 
-    uint64_t readClassWithAppend(uint64_t classId, uint64_t versionId) {
-        uint64_t cid = 0;
-        while (1) {
-            char pathbuffer[512];
-            sprintf(pathbuffer, ClassFilePath.data(), classId, versionId, cid);
-            FileOperator classFile((char *) pathbuffer, FileOpenType::TRY);
-            if (!classFile.ok()) {
-                break;
+    // Reads all containers of a category sequentially, then deletes its segment files. Containers
+    // the liveness tells to be all live or all dead are relinked into their new group unread.
+    uint64_t readSegment(ArrangementFilterPipeline *filterPipeline, const std::string &pathTemplate,
+                         uint64_t classId, uint64_t versionId, bool &dictionaryNoted) {
+        uint64_t count, relinked = 0;
+        uint64_t category = pathTemplate == ClassFileAppendPath ? 0 : classId;
+        {
+            SegmentReader segment(pathTemplate, classId, versionId);
+            count = segment.count();
+            for (uint64_t cid = 0; cid < count; cid++) {
+                ContainerLiveness state = FLAGS_ArrangementFastPath
+                                          ? GlobalMetadataManagerPtr->containerLiveness(category, cid,
+                                                                                        segment.chunkCount(cid))
+                                          : ContainerLiveness::Unknown;
+                if (state == ContainerLiveness::Dead || state == ContainerLiveness::Live) {
+                    if (!dictionaryNoted) {
+                        uint8_t frameHeader[MaxFrameHeaderSize];
+                        uint64_t headerSize = std::min(MaxFrameHeaderSize, segment.length(cid));
+                        GlobalIOThrottlePtr->acquire(headerSize);
+                        segment.pread(cid, 0, frameHeader, headerSize);
+                        noteDictionary(classId, frameHeader, headerSize, dictionaryNoted);
+                    }
+                    ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask();
+                    arrangementFilterTask->relink = true;
+                    arrangementFilterTask->relinkArchived = state == ContainerLiveness::Dead;
+                    arrangementFilterTask->classId = classId;
+                    arrangementFilterTask->arrangementVersion = versionId;
+                    segment.locateObject(cid, arrangementFilterTask->objectID, arrangementFilterTask->objectIndex);
+                    arrangementFilterTask->chunkCount = segment.chunkCount(cid);
+                    arrangementFilterTask->sourceCategory = category;
+                    arrangementFilterTask->sourceCID = cid;
+                    filterPipeline->addTask(arrangementFilterTask);
+                    relinked++;
+                    continue;
+                }
+
+                uint8_t *buffer = (uint8_t *) malloc(ArrangementReadBufferLength);
+                GlobalIOThrottlePtr->acquire(segment.length(cid));
+                uint64_t readSize = segment.read(cid, buffer, ArrangementReadBufferLength);
+                noteDictionary(classId, buffer, readSize, dictionaryNoted);
+                readAmount += readSize;
+
+                // the filter decides from the directory whether the container has to be decompressed
+                if (FLAGS_ArrangementFastPath && containerDirectoryFrameLength(buffer, readSize)) {
+                    ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(buffer, readSize,
+                                                                                             classId, versionId);
+                    arrangementFilterTask->compressed = true;
+                    filterPipeline->addTask(arrangementFilterTask);
+                    continue;
+                }
+
+                uint8_t *decompressedBuffer = (uint8_t *) malloc(ArrangementReadBufferLength);
+                uint64_t decompressedSize = decompressContainer(decompressedBuffer, ArrangementReadBufferLength,
+                                                                buffer, readSize);
+                assert(!ZSTD_isError(decompressedSize));
+                free(buffer);
+
+                ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(decompressedBuffer,
+                                                                                         decompressedSize, classId,
+                                                                                         versionId);
+                filterPipeline->addTask(arrangementFilterTask);
             }
-            uint8_t *buffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t readSize = classFile.read(buffer, ArrangementReadBufferLength);
-
-            uint8_t *decompressedBuffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t decompressedSize = ZSTD_decompress(decompressedBuffer, ArrangementReadBufferLength, buffer,
-                                                        readSize);
-            assert(!ZSTD_isError(decompressedSize));
-            free(buffer);
-
-            readAmount += readSize;
-            ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(decompressedBuffer,
-                                                                                     decompressedSize, classId,
-                                                                                     versionId);
-            GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-            remove(pathbuffer);
-            cid++;
         }
-      printf("Read %lu containers from Cat.(%lu,%lu)\n", cid, classId, versionId);
-
-        cid = 0;
-        while (1) {
-            char pathbuffer[512];
-            sprintf(pathbuffer, ClassFileAppendPath.data(), classId, versionId, cid);
-            FileOperator classFile((char *) pathbuffer, FileOpenType::TRY);
-            if (!classFile.ok()) {
-                break;
-            }
-            uint8_t *buffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t readSize = classFile.read(buffer, ArrangementReadBufferLength);
-
-            uint8_t *decompressedBuffer = (uint8_t *) malloc(ArrangementReadBufferLength);
-            uint64_t decompressedSize = ZSTD_decompress(decompressedBuffer, ArrangementReadBufferLength, buffer,
-                                                        readSize);
-            assert(!ZSTD_isError(decompressedSize));
-            free(buffer);
-
-            readAmount += readSize;
-            ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(decompressedBuffer,
-                                                                                     decompressedSize, classId,
-                                                                                     versionId);
-            GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-            remove(pathbuffer);
-            cid++;
+        SegmentReader::remove(pathTemplate, classId, versionId);
+        if (relinked) {
+            printf("Relinked %lu of the %lu containers without reading them\n", relinked, count);
         }
-      printf("Read %lu containers from Cat.(%lu,%lu)_append\n", cid, classId, versionId);
-        ArrangementFilterTask *arrangementFilterTask = new ArrangementFilterTask(true, classId);
-        GlobalArrangementFilterPipelinePtr->addTask(arrangementFilterTask);
-        return 0;
+        return count;
     }
 
 
@@ -184,7 +272,17 @@ private:
     MutexLock mutexLock;
     Condition condition;
 
-    uint64_t readAmount = 0;
+    std::atomic<uint64_t> readAmount{0};
+
+    uint64_t laneCount;
+    std::vector<std::thread *> laneWorkers;
+    std::vector<ArrangementFilterPipeline *> filterPipelines;
+    std::list<uint64_t> categoryQueue;
+    uint64_t laneRound = 0;     // arrangements handed to the lanes so far
+    uint64_t currentArrangementVersion = 0;
+    CountdownLatch *currentLaneLatch = nullptr;
+    MutexLock laneMutexLock;
+    Condition laneCondition;
 };
 
 static ArrangementReadPipeline* GlobalArrangementReadPipelinePtr;
@@ -18,13 +18,23 @@
 #include <sys/time.h>
 #include "gflags/gflags.h"
 #include "../Utility/BufferedFileWriter.h"
+#include "../Utility/ContainerFormat.h"
+#include "../Utility/SegmentFile.h"
+#include "../Utility/IOThrottle.h"
 
 extern uint64_t ContainerSize;
+extern int ActiveCompressionLevel;
+extern int ArchivedCompressionLevel;
 uint64_t ArrangementFlushBufferLength = ContainerSize * 1.2;
 
+// One writer per arrangement lane. A lane writes the categories its reader picked, one after the
+// other, the tasks tell the category they belong to.
 class ArrangementWritePipeline {
 public:
-    ArrangementWritePipeline() : taskAmount(0), runningFlag(true), mutexLock(), condition(mutexLock) {
+    ArrangementWritePipeline(uint64_t lane) : taskAmount(0), runningFlag(true), mutexLock(), condition(mutexLock),
+                                              lane(lane) {
+        archivedBuffer.init();
+        activeBuffer.init();
         worker = new std::thread(std::bind(&ArrangementWritePipeline::arrangementWriteCallback, this));
     }
 
@@ -33,21 +43,24 @@ public:
         taskList.push_back(arrangementFilterTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~ArrangementWritePipeline() {
         runningFlag = false;
         condition.notifyAll();
         worker->join();
+        archivedBuffer.release();
+        activeBuffer.release();
     }
 
 private:
     void arrangementWriteCallback(){
         pthread_setname_np(pthread_self(), "AWriting Thread");
+        IOThrottle::enterIdleClass();
         ArrangementWriteTask *arrangementWriteTask;
-        char pathBuffer[256];
         uint64_t currentVersion = 0;
-        uint64_t classIter = 0;
+        uint64_t category = 0;
         while (likely(runningFlag)) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
@@ -63,113 +76,183 @@ private:
 
             if(arrangementWriteTask->startFlag){
                 currentVersion = arrangementWriteTask->arrangementVersion;
-                classIter = 0;
-
-                sprintf(pathBuffer, VersionFilePath.data(), classIter + 1, currentVersion, archiveCID);
-                archivedFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                archivedBuffer.init();
-
-                sprintf(pathBuffer, ClassFilePath.data(), classIter + 1, currentVersion + 1, activeCID);
-                activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                activeBuffer.init();
+                delete arrangementWriteTask;
+                continue;
             } else if (arrangementWriteTask->classEndFlag) {
-                classIter++;
-
+                category = arrangementWriteTask->beforeClassId;
                 delete arrangementWriteTask;
 
                 //====================================
-                size_t compressedSize = ZSTD_compress(archivedBuffer.compressBuffer, ArrangementFlushBufferLength,
-                                                      archivedBuffer.buffer, archivedBuffer.used, ZSTD_CLEVEL_DEFAULT);
-                assert(!ZSTD_isError(compressedSize));
-                archivedFileOperator->write(archivedBuffer.compressBuffer, compressedSize);
-                archivedFileOperator->fsync();
-                delete archivedFileOperator;
-                archivedFileOperator = nullptr;
-
-                compressedSize = ZSTD_compress(activeBuffer.compressBuffer, ArrangementFlushBufferLength,
-                                               activeBuffer.buffer, activeBuffer.used, ZSTD_CLEVEL_DEFAULT);
-                assert(!ZSTD_isError(compressedSize));
-                activeFileOperator->write(activeBuffer.compressBuffer, compressedSize);
-                activeFileOperator->fsync();
-                delete activeFileOperator;
-                activeFileOperator = nullptr;
+                if (archivedSegment) {
+                    flushContainer(archivedBuffer, archivedSegment, category, false);
+                    flushContainer(activeBuffer, activeSegment, category, true);
+                    delete archivedSegment;
+                    delete activeSegment;
+                }
                 //====================================
 
-                activeCID = 0;
-                archiveCID = 0;
-
-                if (classIter < currentVersion) {
-                    sprintf(pathBuffer, VersionFilePath.data(), classIter + 1, currentVersion, archiveCID);
-                    archivedFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                    archivedBuffer.clear();
-
-                    sprintf(pathBuffer, ClassFilePath.data(), classIter + 1, currentVersion + 1, activeCID);
-                    activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                    activeBuffer.clear();
-                }
+                archivedSegment = nullptr;
+                activeSegment = nullptr;
+                archivedBuffer.clear();
+                activeBuffer.clear();
                 continue;
             } else if (arrangementWriteTask->finalEndFlag) {
-                printf("ActiveChunks:%lu, ArchivedChunks:%lu\n", activeChunks, archivedChunks);
-//                activeFileOperator->fsync();
-//                delete activeFileOperator;
-//                archivedFileOperator->fsync();
-//                delete archivedFileOperator;
-
-                activeCID = 0;
-                archiveCID = 0;
+                printf("[Lane %lu] ActiveChunks:%lu, ArchivedChunks:%lu\n", lane, activeChunks, archivedChunks);
+                printf("[Lane %lu] Active level %d: %lu -> %lu bytes, Archived level %d: %lu -> %lu bytes\n", lane,
+                       ActiveCompressionLevel, tierRawBytes[0], tierCompressedBytes[0], ArchivedCompressionLevel,
+                       tierRawBytes[1], tierCompressedBytes[1]);
+                printf("[Lane %lu] Containers stored raw:%lu\n", lane, rawContainers);
+                printf("[Lane %lu] Containers moved as they are:%lu, %lu bytes, relinked unread:%lu\n", lane,
+                       movedContainers, movedBytes, relinkedContainers);
 
                 currentVersion = -1;
 
-                GlobalMetadataManagerPtr->tableRolling();
                 arrangementWriteTask->countdownLatch->countDown();
                 delete arrangementWriteTask;
-                printf("ArrangementWritePipeline finish\n");
                 continue;
-            } else if (arrangementWriteTask->isArchived) {
-                archivedBuffer.write(arrangementWriteTask->writeBuffer, arrangementWriteTask->length);
-                if (archivedBuffer.used >= ContainerSize) {
-                    size_t compressedSize = ZSTD_compress(archivedBuffer.compressBuffer, ArrangementFlushBufferLength,
-                                                          archivedBuffer.buffer, archivedBuffer.used,
-                                                          ZSTD_CLEVEL_DEFAULT);
-                    assert(!ZSTD_isError(compressedSize));
-                    archivedFileOperator->write(archivedBuffer.compressBuffer, compressedSize);
-                    archivedFileOperator->fsync();
-                    delete archivedFileOperator;
-                    archivedFileOperator = nullptr;
-
-                    archiveCID++;
-                    sprintf(pathBuffer, VersionFilePath.data(), classIter + 1, currentVersion, archiveCID);
-                    archivedFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                    archivedBuffer.clear();
+            }
+
+            category = arrangementWriteTask->beforeClassId;
+            if (!archivedSegment) {
+                archivedSegment = new SegmentWriter(VersionFilePath, category, currentVersion);
+                activeSegment = new SegmentWriter(ClassFilePath, category, currentVersion + 1);
+            }
+            if (arrangementWriteTask->relink) {
+                relinkContainer(arrangementWriteTask, category);
+                delete arrangementWriteTask;
+                continue;
+            }
+            if (arrangementWriteTask->wholeContainer) {
+                moveContainer(arrangementWriteTask, category);
+                delete arrangementWriteTask;
+                continue;
+            }
+            splitContainer(arrangementWriteTask, category);
+            delete arrangementWriteTask;
+        }
+    }
+
+    // Copies the runs of a decompressed container into the buffers of their places, as many
+    // records at once as the buffer takes before it is full. The record which fills a buffer
+    // still goes into it, so containers end where they did when chunks were copied one by one.
+    void splitContainer(ArrangementWriteTask *arrangementWriteTask, uint64_t category) {
+        for (const auto &run: arrangementWriteTask->runs) {
+            bool active = !run.isArchived;
+            int tier = active ? 0 : 1;
+            WriteBuffer &writeBuffer = active ? activeBuffer : archivedBuffer;
+            uint64_t pos = run.offset, end = run.offset + run.length;
+            while (pos < end) {
+                uint64_t start = pos, used = writeBuffer.used, count = 0;
+                while (pos < end && used < ContainerSize) {
+                    BlockHeader *bhPtr = (BlockHeader *) (arrangementWriteTask->writeBuffer + pos);
+                    uint64_t recordLength = sizeof(BlockHeader) + bhPtr->length;
+                    if (active) {
+                        pendingChunks.push_back(bhPtr->fp);
+                        if (!bhPtr->type) {
+                            pendingFeatures.push_back({bhPtr->sFeatures,
+                                                       {bhPtr->fp, (uint32_t) category, 0, bhPtr->length}});
+                        }
+                    }
+                    used += recordLength;
+                    pos += recordLength;
+                    count++;
                 }
-                archivedChunks++;
-            } else {
-                BlockHeader *bhPtr = (BlockHeader *) arrangementWriteTask->writeBuffer;
-                activeBuffer.write(arrangementWriteTask->writeBuffer, arrangementWriteTask->length);
-                //activeFileOperator->write(arrangementWriteTask->writeBuffer, arrangementWriteTask->length);
-                if (!bhPtr->type) {
-                    GlobalMetadataManagerPtr->addSimilarFeature(
-                            bhPtr->sFeatures,
-                            {bhPtr->fp, (uint32_t) classIter + 1, activeCID,
-                             arrangementWriteTask->length - sizeof(BlockHeader)});
+                writeBuffer.write(arrangementWriteTask->writeBuffer + start, pos - start);
+                bufferedChunks[tier] += count;
+                (active ? activeChunks : archivedChunks) += count;
+                if (writeBuffer.used >= ContainerSize) {
+                    flushContainer(writeBuffer, active ? activeSegment : archivedSegment, category, active);
+                    writeBuffer.clear();
                 }
-                if (activeBuffer.used >= ContainerSize) {
-                    size_t compressedSize = ZSTD_compress(activeBuffer.compressBuffer, ArrangementFlushBufferLength,
-                                                          activeBuffer.buffer, activeBuffer.used, ZSTD_CLEVEL_DEFAULT);
-                    assert(!ZSTD_isError(compressedSize));
-                    activeFileOperator->write(activeBuffer.compressBuffer, compressedSize);
-                    activeFileOperator->fsync();
-                    delete activeFileOperator;
-                    activeFileOperator = nullptr;
-
-                    activeCID++;
-                    sprintf(pathBuffer, ClassFilePath.data(), classIter + 1, currentVersion + 1, activeCID);
-                    activeFileOperator = new FileOperator(pathBuffer, FileOpenType::Write);
-                    activeBuffer.clear();
+            }
+        }
+    }
+
+    // Active containers are compressed for fast reading, archived volumes for size.
+    void flushContainer(WriteBuffer &writeBuffer, SegmentWriter *segment, uint64_t category, bool active) {
+        // a category ending right after a full container leaves nothing to write
+        if (!writeBuffer.used) {
+            return;
+        }
+        int level = active ? ActiveCompressionLevel : ArchivedCompressionLevel;
+        size_t compressedSize = containerEncoder.compress(writeBuffer.compressBuffer, ArrangementFlushBufferLength,
+                                                          writeBuffer.buffer, writeBuffer.used, level,
+                                                          GlobalDictionaryStorePtr->getCategoryDictionary(category));
+        assert(!ZSTD_isError(compressedSize));
+        int tier = active ? 0 : 1;
+        tierRawBytes[tier] += writeBuffer.used;
+        tierCompressedBytes[tier] += compressedSize;
+        if (containerEncoder.isRaw()) {
+            rawContainers++;
+        }
+        GlobalIOThrottlePtr->acquire(compressedSize);
+        uint64_t cid = segment->append(writeBuffer.compressBuffer, compressedSize, bufferedChunks[tier]);
+        bufferedChunks[tier] = 0;
+        if (active) {
+            // bases are found by the number the container got in the category
+            for (auto &feature: pendingFeatures) {
+                feature.second.cid = cid;
+                GlobalMetadataManagerPtr->addSimilarFeature(feature.first, feature.second);
+            }
+            pendingFeatures.clear();
+            for (uint64_t slot = 0; slot < pendingChunks.size(); slot++) {
+                GlobalMetadataManagerPtr->arrangementLocate(pendingChunks[slot], category, cid, slot);
+            }
+            pendingChunks.clear();
+        }
+    }
+
+    // The liveness tracked during the backup found all chunks of the container live or dead, so it
+    // joins the new group without being read. Its chunks keep their slots in it.
+    void relinkContainer(ArrangementWriteTask *arrangementWriteTask, uint64_t category) {
+        if (arrangementWriteTask->isArchived) {
+            flushContainer(archivedBuffer, archivedSegment, category, false);
+            archivedBuffer.clear();
+            archivedSegment->adopt(arrangementWriteTask->objectID, arrangementWriteTask->objectIndex,
+                                   arrangementWriteTask->chunkCount);
+            archivedChunks += arrangementWriteTask->chunkCount;
+        } else {
+            flushContainer(activeBuffer, activeSegment, category, true);
+            activeBuffer.clear();
+            uint64_t cid = activeSegment->adopt(arrangementWriteTask->objectID, arrangementWriteTask->objectIndex,
+                                                arrangementWriteTask->chunkCount);
+            GlobalMetadataManagerPtr->addRelocation(arrangementWriteTask->sourceCategory,
+                                                    arrangementWriteTask->sourceCID, category, cid);
+            activeChunks += arrangementWriteTask->chunkCount;
+        }
+        relinkedContainers++;
+    }
+
+    // A container whose chunks all go to the same place keeps its compression and dictionary. The
+    // buffer of that place is flushed first, restore relies on the chunk order within a group.
+    void moveContainer(ArrangementWriteTask *arrangementWriteTask, uint64_t category) {
+        ContainerDirectory directory;
+        int r = readContainerDirectory(arrangementWriteTask->writeBuffer, arrangementWriteTask->length, directory);
+        assert(r);
+        GlobalIOThrottlePtr->acquire(arrangementWriteTask->length);
+        if (arrangementWriteTask->isArchived) {
+            flushContainer(archivedBuffer, archivedSegment, category, false);
+            archivedBuffer.clear();
+            archivedSegment->append(arrangementWriteTask->writeBuffer, arrangementWriteTask->length,
+                                    directory.entries.size());
+            archivedChunks += directory.entries.size();
+        } else {
+            flushContainer(activeBuffer, activeSegment, category, true);
+            activeBuffer.clear();
+            uint64_t cid = activeSegment->append(arrangementWriteTask->writeBuffer, arrangementWriteTask->length,
+                                                 directory.entries.size());
+            for (uint64_t slot = 0; slot < directory.entries.size(); slot++) {
+                const BlockHeader &header = directory.entries[slot].header;
+                if (!header.type) {
+                    GlobalMetadataManagerPtr->addSimilarFeature(
+                            header.sFeatures, {header.fp, (uint32_t) category, cid, header.length});
                 }
-                activeChunks++;
+                GlobalMetadataManagerPtr->arrangementLocate(header.fp, category, cid, slot);
             }
+            activeChunks += directory.entries.size();
         }
+        movedContainers++;
+        movedBytes += arrangementWriteTask->length;
     }
 
     bool runningFlag;
@@ -179,19 +262,27 @@ private:
     MutexLock mutexLock;
     Condition condition;
 
-    FileOperator *archivedFileOperator = nullptr;
+    SegmentWriter *archivedSegment = nullptr;
 
-    FileOperator *activeFileOperator = nullptr;
+    SegmentWriter *activeSegment = nullptr;
 
-    uint64_t activeCID = 0;
-    uint64_t archiveCID = 0;
+    // features of the chunks in activeBuffer, published once the container has its number
+    std::vector<std::pair<SimilarityFeatures, BasePos>> pendingFeatures;
+    std::vector<SHA1FP> pendingChunks;      // of activeBuffer, in slot order
+    uint32_t bufferedChunks[2] = {0, 0};    // in activeBuffer and archivedBuffer
 
     uint64_t activeChunks = 0, archivedChunks = 0;
+    uint64_t tierRawBytes[2] = {0, 0};
+    uint64_t tierCompressedBytes[2] = {0, 0};
+    uint64_t rawContainers = 0;
+    uint64_t movedContainers = 0, movedBytes = 0;
+    uint64_t relinkedContainers = 0;
 
     WriteBuffer activeBuffer;
     WriteBuffer archivedBuffer;
-};
 
-static ArrangementWritePipeline* GlobalArrangementWritePipelinePtr;
+    ContainerEncoder containerEncoder;
+    uint64_t lane;
+};
 
 #endif //MEGA_ARRANGEMENTWRITEPIPELINE_H
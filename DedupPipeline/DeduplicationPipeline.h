@@ -17,6 +17,7 @@
 #include "../Utility/Likely.h"
 #include "../xdelta/xdelta3.h"
 #include "../Utility/BaseCache.h"
+#include <algorithm>
 
 struct BaseChunkPositions {
     uint64_t category: 22;
@@ -25,6 +26,15 @@ struct BaseChunkPositions {
 
 DEFINE_uint64(DeltaSelectorThreshold,
               10, "DeltaSelectorThreshold");
+DEFINE_bool(CacheAwareBaseSelection,
+            true, "choose the base among all similarity candidates by cache residency and feature matches");
+
+DEFINE_bool(AdaptiveDeltaSelector,
+            false, "choose the containers loaded for delta encoding per segment from the measured load cost");
+DEFINE_uint64(TargetThroughput,
+              200, "backup throughput in MB/s kept by the adaptive delta selector");
+
+const int SimilarityCandidates = 6;
 
 extern bool DeltaSwitch;
 struct timeval initTime, endTime;
@@ -45,6 +55,7 @@ public:
         receiveList.push_back(dedupTask);
         taskAmount++;
         condition.notifyAll();
+        return 0;
     }
 
     ~DeduplicationPipeline() {
@@ -54,11 +65,34 @@ public:
         delete worker;
     }
 
+    // The backup of a version may start while the arrangement of the last one still runs. Its
+    // first lookup waits for the latch, which counts down once the tables are rolled.
+    void setArrangementGate(CountdownLatch *latch) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        arrangementGate = latch;
+    }
+
     void getStatistics() {
       printf("[DedupDeduplicating] total : %lu, delta encoding : %lu\n", duration, deltaTime);
+      if (gateWaitTime) {
+          printf("[DedupDeduplicating] waited for arrangement : %lu us\n", gateWaitTime);
+      }
       printf("Unique:%lu, Internal:%lu, Adjacent:%lu, Delta:%lu, Reject:%lu\n", chunkCounter[0], chunkCounter[1],
              chunkCounter[2], chunkCounter[3], cappingReject);
       printf("xdeltaError:%lu\n", xdeltaError);
+      if (selectorSegments) {
+          printf("[DeltaSelector] version:%lu, mode:%s, segments:%lu, threshold min:%lu avg:%.1f max:%lu, segments without loads:%lu\n",
+                 currentVersion, FLAGS_AdaptiveDeltaSelector ? "adaptive" : "fixed", selectorSegments,
+                 selectorThresholdMin == UINT64_MAX ? 0 : selectorThresholdMin,
+                 selectorSegments > selectorClosed ? (double) selectorThresholdSum / (selectorSegments - selectorClosed) : 0,
+                 selectorThresholdMax, selectorClosed);
+      }
+      if (FLAGS_AdaptiveDeltaSelector) {
+          printf("[DeltaSelector] target:%luMB/s, load cost:%.0fus, saving per delta byte:%.3f, loads granted:%lu\n",
+                 FLAGS_TargetThroughput, selectorLoadCost, selectorSavingRatio, selectorAllowedLoads);
+      }
+      printf("[BaseSelection] selections:%lu, without container load:%lu, switched from first candidate:%lu\n",
+             baseSelections, residentSelections, baseSwitches);
 //        printf("Total Length : %lu, AfterDedup : %lu, AfterDelta: %lu, DedupRatio : %f, DeltaRatio : %f\n",
 //               totalLength, afterDedup, afterDelta, (float) totalLength / afterDedup, (float) totalLength / afterDelta);
       GlobalMetadataManagerPtr->setTotalLength(totalLength);
@@ -90,14 +124,45 @@ private:
             }
 
             if (newVersionFlag) {
+                CountdownLatch *gate;
+                {
+                    MutexLockGuard mutexLockGuard(mutexLock);
+                    gate = arrangementGate;
+                    arrangementGate = nullptr;
+                }
+                gateWaitTime = 0;
+                if (gate) {
+                    struct timeval g0, g1;
+                    gettimeofday(&g0, NULL);
+                    gate->wait();
+                    gettimeofday(&g1, NULL);
+                    gateWaitTime = (g1.tv_sec - g0.tv_sec) * 1000000 + g1.tv_usec - g0.tv_usec;
+                }
                 for (int i = 0; i < 4; i++) {
                     chunkCounter[i] = 0;
                 }
                 newVersionFlag = false;
+                selectorSegments = 0;
+                selectorThresholdSum = 0;
+                selectorThresholdMin = UINT64_MAX;
+                selectorThresholdMax = 0;
+                selectorClosed = 0;
                 gettimeofday(&initTime, NULL);
                 duration = 0;
+                // a batch backs up many versions with the same pipeline, the containers of
+                // Cat.(V,V) are numbered from 0 again
+                totalLength = 0;
+                afterDedup = 0;
+                afterDelta = 0;
+                lastCategoryLength = 0;
+                currentCID = 0;
+                currentSlot = 0;
+                containerCache.clear();
                 if(!taskList.empty()){
+                    currentVersion = taskList.begin()->fileID;
                     baseCache.setCurrentVersion(taskList.begin()->fileID);
+                    // the arrangement of the last version used the liveness tracked until now
+                    GlobalMetadataManagerPtr->startLivenessTracking(currentVersion);
                 }
             }
 
@@ -106,9 +171,17 @@ private:
                 segmentLength += dedupTask.length;
                 if (segmentLength > SegmentThreshold || dedupTask.countdownLatch) {
 
+                  gettimeofday(&segmentStart, NULL);
+                  uint64_t loadingTimeBefore = baseCache.getLoadingTime();
                   processingWaitingList(detectList);
-                  deltaSelector(detectList);
+                  deltaSelector(detectList, segmentLength);
                   doDedup(detectList);
+                  gettimeofday(&segmentEnd, NULL);
+                  uint64_t segmentTime = (segmentEnd.tv_sec - segmentStart.tv_sec) * 1000000 + segmentEnd.tv_usec -
+                                         segmentStart.tv_usec;
+                  uint64_t segmentLoadingTime = baseCache.getLoadingTime() - loadingTimeBefore;
+                  processingTime += segmentTime > segmentLoadingTime ? segmentTime - segmentLoadingTime : 0;
+                  processedBytes += segmentLength;
 
                     segmentLength = 0;
                     detectList.clear();
@@ -122,6 +195,9 @@ private:
     void processingWaitingList(std::list<DedupTask> &dl) {
         BasePos tempBasePos;
         BlockEntry tempBlockEntry;
+        std::vector<DedupTask *> similarEntries;
+        std::vector<BasePos> candidates;
+        std::unordered_map<uint64_t, uint64_t> containerDemand;
         for (auto &entry: dl) {
 
             FPTableEntry fpTableEntry;
@@ -132,6 +208,20 @@ private:
             if (lookupResult == LookupResult::Unique) {
                 LookupResult similarLookupResult = LookupResult::Dissimilar;
                 odessCalculation(entry.buffer + entry.pos, entry.length, &entry.similarityFeatures);
+                if (DeltaSwitch && FLAGS_CacheAwareBaseSelection) {
+                    uint64_t offset = candidates.size();
+                    candidates.resize(offset + SimilarityCandidates);
+                    similarLookupResult = GlobalMetadataManagerPtr->similarityLookup(entry.similarityFeatures,
+                                                                                     &candidates[offset]);
+                    if (similarLookupResult == LookupResult::Similar) {
+                        entry.lookupResult = similarLookupResult;
+                        similarEntries.push_back(&entry);
+                        countContainerDemand(&candidates[offset], containerDemand);
+                    } else {
+                        candidates.resize(offset);
+                    }
+                    continue;
+                }
                 if (DeltaSwitch) {
                     similarLookupResult = GlobalMetadataManagerPtr->similarityLookupSimple(entry.similarityFeatures,
                                                                                            &tempBasePos);
@@ -154,10 +244,84 @@ private:
                 // do nothing
             }
         }
+
+        // bases are chosen only after the whole segment is looked up, so that the demand on every
+        // container is known.
+        for (uint64_t i = 0; i < similarEntries.size(); i++) {
+            DedupTask &entry = *similarEntries[i];
+            entry.basePos = selectBase(&candidates[i * SimilarityCandidates], containerDemand);
+            entry.inCache = baseCache.getRecord(&entry.basePos, &tempBlockEntry);
+            entry.baseSelected = true;
+        }
+    }
+
+    // Every container referenced by the candidates of a chunk counts once.
+    void countContainerDemand(const BasePos *candidates, std::unordered_map<uint64_t, uint64_t> &containerDemand) {
+        for (int i = 0; i < SimilarityCandidates; i++) {
+            if (!candidates[i].valid) continue;
+            uint64_t key = BaseCache::containerKey(candidates[i].CategoryOrder, candidates[i].cid);
+            bool counted = false;
+            for (int j = 0; j < i; j++) {
+                if (candidates[j].valid &&
+                    BaseCache::containerKey(candidates[j].CategoryOrder, candidates[j].cid) == key) {
+                    counted = true;
+                    break;
+                }
+            }
+            if (!counted) {
+                containerDemand[key]++;
+            }
+        }
+    }
+
+    // Candidates are ranked by
+    //   1. no container load: the base is cached, its container is resident or it is being written,
+    //   2. feature matches: a base hit by more features is expected to give a smaller delta,
+    //   3. residency, then the demand of the segment on its container, so that loads are shared.
+    // Ties keep the order of similarityLookup, which is the choice of similarityLookupSimple.
+    BasePos selectBase(const BasePos *candidates, std::unordered_map<uint64_t, uint64_t> &containerDemand) {
+        int best = -1, first = -1;
+        uint64_t bestScore[4] = {0, 0, 0, 0};
+        for (int i = 0; i < SimilarityCandidates; i++) {
+            if (!candidates[i].valid) continue;
+            if (first == -1) first = i;
+            uint64_t matches = 0;
+            for (int j = 0; j < SimilarityCandidates; j++) {
+                if (candidates[j].valid && !memcmp(&candidates[j].sha1Fp, &candidates[i].sha1Fp, sizeof(SHA1FP))) {
+                    matches++;
+                }
+            }
+            uint64_t residency = baseCache.residency(candidates[i]);
+            if (candidates[i].CategoryOrder == currentVersion) {
+                // written by this backup, served by the container cache or the write pipeline
+                residency = 2;
+            }
+            uint64_t score[4] = {
+                    residency > 0,
+                    matches,
+                    residency,
+                    containerDemand[BaseCache::containerKey(candidates[i].CategoryOrder, candidates[i].cid)],
+            };
+            if (best == -1 || std::lexicographical_compare(bestScore, bestScore + 4, score, score + 4)) {
+                best = i;
+                memcpy(bestScore, score, sizeof(score));
+            }
+        }
+        assert(best != -1);
+        baseSelections++;
+        if (memcmp(&candidates[best].sha1Fp, &candidates[first].sha1Fp, sizeof(SHA1FP))) {
+            baseSwitches++;
+        }
+        if (bestScore[0]) {
+            residentSelections++;
+        }
+        return candidates[best];
     }
 
-    void deltaSelector(std::list<DedupTask> &dl) {
+    void deltaSelector(std::list<DedupTask> &dl, uint64_t segmentLength) {
       std::unordered_map<uint64_t, uint64_t> baseChunkPositions;
+      std::unordered_map<uint64_t, uint64_t> baseChunkBytes;
+      baseCache.clearPendingBases();
       for (auto &entry: dl) {
         if (entry.lookupResult == LookupResult::Similar && entry.inCache == 0) {
           uint64_t key;
@@ -170,12 +334,28 @@ private:
                 } else {
                     baseChunkPositions[key]++;
                 }
+                baseChunkBytes[key] += entry.length;
             }
         }
-        for (auto &entry: baseChunkPositions) {
-          if (entry.second < FLAGS_DeltaSelectorThreshold) {
-            entry.second = 0;
-          }
+        uint64_t threshold = FLAGS_DeltaSelectorThreshold;
+        if (FLAGS_AdaptiveDeltaSelector && baseCache.getLoadCalls() && processedBytes && deltaOriginalBytes) {
+            threshold = adaptiveSelection(baseChunkPositions, baseChunkBytes, segmentLength);
+        } else {
+            for (auto &entry: baseChunkPositions) {
+                if (entry.second < FLAGS_DeltaSelectorThreshold) {
+                    entry.second = 0;
+                }
+            }
+        }
+        if (!baseChunkPositions.empty()) {
+            selectorSegments++;
+            if (threshold == UINT64_MAX) {
+                selectorClosed++;
+            } else {
+                selectorThresholdSum += threshold;
+                selectorThresholdMin = std::min(selectorThresholdMin, threshold);
+                selectorThresholdMax = std::max(selectorThresholdMax, threshold);
+            }
         }
         for (auto &entry: dl) {
             if (entry.lookupResult == LookupResult::Similar && entry.inCache == 0) {
@@ -185,12 +365,56 @@ private:
                 bcp->quantizedOffset = entry.basePos.cid;
                 if (baseChunkPositions[key] == 0) {
                     entry.deltaReject = true;
+                } else {
+                    baseCache.addPendingBase(entry.basePos);
                 }
             }
         }
 
     }
 
+    // The time a segment may take at --TargetThroughput, minus the time it is expected to take
+    // without loads, is spent on container loads of the measured average latency. Loads go to the
+    // containers expected to save most, i.e. the bytes of the chunks that refer to them times the
+    // measured saving of a delta. Containers which are resident or being written cost no load and
+    // are always kept. Returns the smallest reference count of an accepted container, which is the
+    // threshold the static selector would have needed, or UINT64_MAX if no load fits.
+    uint64_t adaptiveSelection(std::unordered_map<uint64_t, uint64_t> &baseChunkPositions,
+                               std::unordered_map<uint64_t, uint64_t> &baseChunkBytes, uint64_t segmentLength) {
+        double loadCost = (double) baseCache.getLoadingTime() / baseCache.getLoadCalls();
+        double savingRatio = (double) deltaSavedBytes / deltaOriginalBytes;
+        double budget = (double) segmentLength * 1000000 / (FLAGS_TargetThroughput * 1024 * 1024);
+        double slack = budget - (double) processingTime / processedBytes * segmentLength;
+        uint64_t allowedLoads = slack > 0 ? (uint64_t) (slack / loadCost) : 0;
+
+        std::vector<std::pair<double, uint64_t>> candidates;
+        uint64_t threshold = UINT64_MAX;
+        for (auto &entry: baseChunkPositions) {
+            BaseChunkPositions *bcp = (BaseChunkPositions *) &entry.first;
+            BasePos basePos;
+            basePos.CategoryOrder = bcp->category;
+            basePos.cid = bcp->quantizedOffset;
+            if (basePos.CategoryOrder == currentVersion || baseCache.residency(basePos)) {
+                threshold = std::min(threshold, entry.second);
+                continue;
+            }
+            candidates.push_back({baseChunkBytes[entry.first] * savingRatio, entry.first});
+        }
+        std::sort(candidates.begin(), candidates.end(), std::greater<std::pair<double, uint64_t>>());
+        for (uint64_t i = 0; i < candidates.size(); i++) {
+            uint64_t &references = baseChunkPositions[candidates[i].second];
+            if (i < allowedLoads) {
+                threshold = std::min(threshold, references);
+            } else {
+                references = 0;
+            }
+        }
+        selectorAllowedLoads += allowedLoads;
+        selectorLoadCost = loadCost;
+        selectorSavingRatio = savingRatio;
+        return threshold;
+    }
+
     void doDedup(std::list<DedupTask> &dl) {
         WriteTask writeTask;
         BlockEntry tempBlockEntry;
@@ -208,6 +432,7 @@ private:
             writeTask.buffer = entry.buffer;
             writeTask.pos = entry.pos;
             writeTask.length = entry.length;
+            writeTask.inputEnd = entry.pos + entry.length;
             writeTask.sha1Fp = entry.fp;
             writeTask.deltaTag = 0;
 
@@ -218,7 +443,10 @@ private:
             if (lookupResult == LookupResult::Unique) {
                 afterDedup += entry.length;
                 LookupResult similarLookupResult = LookupResult::Dissimilar;
-                if (DeltaSwitch) {
+                if (entry.baseSelected) {
+                    similarLookupResult = LookupResult::Similar;
+                } else if (DeltaSwitch) {
+                    // chunks of this segment may have become bases in the meantime
                     similarLookupResult = GlobalMetadataManagerPtr->similarityLookupSimple(entry.similarityFeatures,
                                                                                            &entry.basePos);
                 }
@@ -254,11 +482,13 @@ private:
                         xdeltaError++;
                         goto unique;
                     } else {
+                        deltaSavedBytes += entry.length - deltaSize;
+                        deltaOriginalBytes += entry.length;
                         // add metadata
                         GlobalMetadataManagerPtr->deltaAddRecord(writeTask.sha1Fp, entry.fileID,
                                                                  entry.basePos.sha1Fp,
                                                                  entry.length - deltaSize,
-                                                                 entry.length);
+                                                                 entry.length, currentCID, currentSlot);
                         // extend base lifecycle
                         FPTableEntry tFTE = {
                                 0,
@@ -266,6 +496,7 @@ private:
                                 entry.basePos.length,
                                 entry.basePos.length
                         };
+                        tFTE.cid = entry.basePos.cid;
                         GlobalMetadataManagerPtr->extendBase(entry.basePos.sha1Fp, tFTE);
                         // update task
                         writeTask.type = (int) similarLookupResult;
@@ -276,8 +507,10 @@ private:
                         writeTask.deltaTag = 1;
                         writeTask.baseFP = entry.basePos.sha1Fp;
                         lastCategoryLength += deltaSize + sizeof(BlockHeader);
+                        currentSlot++;
                         if (lastCategoryLength >= ContainerSize) {
                             lastCategoryLength = 0;
+                            currentSlot = 0;
                             currentCID++;
                             containerCache.clear();
                         }
@@ -289,16 +522,20 @@ private:
                     chunkCounter[(int) LookupResult::Unique]++;
                     if (entry.deltaReject) cappingReject++;
                     writeTask.type = (int) LookupResult::Unique;
-                    GlobalMetadataManagerPtr->uniqueAddRecord(entry.fp, entry.fileID, entry.length);
+                    GlobalMetadataManagerPtr->uniqueAddRecord(entry.fp, entry.fileID, entry.length, currentCID,
+                                                              currentSlot);
                     GlobalMetadataManagerPtr->addSimilarFeature(entry.similarityFeatures,
                                                                 {entry.fp, (uint32_t) entry.fileID,
                                                                  currentCID, entry.length});
                     writeTask.similarityFeatures = entry.similarityFeatures;
-                    baseCache.addRecord(writeTask.sha1Fp, writeTask.buffer + writeTask.pos, writeTask.length);
+                    baseCache.addRecord(entry.fileID, currentCID, writeTask.sha1Fp, writeTask.buffer + writeTask.pos,
+                                        writeTask.length);
                     containerCache.addRecord(writeTask.sha1Fp, writeTask.buffer + writeTask.pos, writeTask.length);
                     lastCategoryLength += entry.length + sizeof(BlockHeader);
+                    currentSlot++;
                     if (lastCategoryLength >= ContainerSize) {
                         lastCategoryLength = 0;
+                        currentSlot = 0;
                         currentCID++;
                         containerCache.clear();
                     }
@@ -370,6 +607,7 @@ private:
     uint64_t afterDelta = 0;
     uint64_t lastCategoryLength = 0;
     uint64_t currentCID = 0;
+    uint64_t currentSlot = 0;   // of the next chunk in container currentCID
 
     uint64_t chunkCounter[4] = {0, 0, 0, 0};
     uint64_t xdeltaError = 0;
@@ -379,7 +617,29 @@ private:
 
     uint64_t cappingReject = 0;
 
+    uint64_t currentVersion = 0;
+    struct timeval segmentStart, segmentEnd;
+    uint64_t processingTime = 0;
+    uint64_t processedBytes = 0;
+    uint64_t deltaSavedBytes = 0;
+    uint64_t deltaOriginalBytes = 0;
+
+    uint64_t selectorSegments = 0;
+    uint64_t selectorThresholdSum = 0;
+    uint64_t selectorThresholdMin = UINT64_MAX;
+    uint64_t selectorThresholdMax = 0;
+    uint64_t selectorClosed = 0;
+    uint64_t selectorAllowedLoads = 0;
+    double selectorLoadCost = 0;
+    double selectorSavingRatio = 0;
+
+    uint64_t baseSelections = 0;
+    uint64_t residentSelections = 0;
+    uint64_t baseSwitches = 0;
+
     bool newVersionFlag = true;
+    CountdownLatch *arrangementGate = nullptr;
+    uint64_t gateWaitTime = 0;
 };
 
 static DeduplicationPipeline *GlobalDeduplicationPipelinePtr;
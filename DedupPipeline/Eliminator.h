@@ -14,19 +14,22 @@ extern std::string ClassFilePath;
 extern std::string VersionFilePath;
 extern std::string ClassFileAppendPath;
 
+#include "../Utility/SegmentFile.h"
+
 class Eliminator {
 public:
     Eliminator() {
 
     }
 
-    int run(uint64_t maxVersion) {
+    void run(uint64_t maxVersion) {
         printf("start to eliminate\n");
 
         printf("delete invalid categories\n");
       versionFileDeleter(1);
 
         printf("processing categories files\n");
+        uint64_t appendOffset = SegmentReader(ClassFilePath, 1, maxVersion).count();
         activeFileCombinationProcessor(1, 2, maxVersion);
         for (uint64_t i = 3; i <= maxVersion; i++) {
             classFileProcessor(i, maxVersion);
@@ -39,10 +42,13 @@ public:
         }
 
         printf("processing recipe files\n");
+        // the second recipe may be a delta against the first one
+        materializeRecipe(2);
         for (uint64_t i = 2; i <= maxVersion; i++) {
             recipeFilesProcessor(i);
         }
-        GlobalMetadataManagerPtr->similarityTableMerge();
+        GlobalMetadataManagerPtr->similarityTableMerge(appendOffset);
+        GlobalMetadataManagerPtr->locationMerge(appendOffset);
         printf("Similarity Feature Tables have been updated..\n");
         printf("finish, the earliest version has been eliminated..\n");
     }
@@ -61,17 +67,7 @@ private:
         // append first two archived categories in volumes.
 
         for (int i = 3; i <= versionId; i++) {
-            uint64_t cid = 0;
-            while (1) {
-                sprintf(oldPath, VersionFilePath.data(), i, versionId, cid);
-                FileOperator fileOperator(oldPath, FileOpenType::TRY);
-                if (!fileOperator.ok()) {
-                    break;
-                }
-                sprintf(newPath, VersionFilePath.data(), i - 1, versionId - 1, cid);
-                rename(oldPath, newPath);
-                cid++;
-            }
+            SegmentReader::move(VersionFilePath, i, versionId, VersionFilePath, i - 1, versionId - 1);
         }
 
         return 0;
@@ -79,95 +75,33 @@ private:
 
     int versionFileDeleter(uint64_t versionId) {
         for (int i = 1; i <= versionId; i++) {
-            uint64_t cid = 0;
-            while (1) {
-                sprintf(oldPath, VersionFilePath.data(), i, versionId, cid);
-                {
-                    FileOperator fileOperator(oldPath, FileOpenType::TRY);
-                    if (!fileOperator.ok()) {
-                        break;
-                    }
-                }
-                remove(oldPath);
-                cid++;
-            }
+            SegmentReader::remove(VersionFilePath, i, versionId);
         }
         return 0;
     }
 
     int classFileProcessor(uint64_t classId, uint64_t maxVersion) {
         // rolling back serial number of categories
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(oldPath, ClassFilePath.data(), classId, maxVersion, cid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
-            }
-            sprintf(newPath, ClassFilePath.data(), classId - 1, maxVersion - 1, cid);
-            rename(oldPath, newPath);
-            cid++;
-        }
+        SegmentReader::move(ClassFilePath, classId, maxVersion, ClassFilePath, classId - 1, maxVersion - 1);
         return 0;
     }
 
     int activeFileCombinationProcessor(uint64_t classId1, uint64_t classId2, uint64_t maxVersion) {
         // rolling back serial number of categories
-        // append first two active categories.
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(oldPath, ClassFilePath.data(), classId1, maxVersion, cid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
-            }
-            sprintf(newPath, ClassFilePath.data(), classId1, maxVersion - 1, cid);
-            rename(oldPath, newPath);
-            cid++;
-        }
-
-        cid = 0;
-        while (1) {
-            sprintf(oldPath, ClassFilePath.data(), classId2, maxVersion, cid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
-            }
-            sprintf(newPath, ClassFileAppendPath.data(), classId1, maxVersion - 1, cid);
-            rename(oldPath, newPath);
-            cid++;
-        }
+        // append first two active categories. The append group of a deletion no arrangement
+        // followed, e.g. when several versions expire after a deferred arrangement, joins category 1.
+        SegmentReader::move(ClassFilePath, classId1, maxVersion, ClassFilePath, classId1, maxVersion - 1);
+        SegmentReader::move(ClassFileAppendPath, classId1, maxVersion, ClassFilePath, classId1, maxVersion - 1);
+        SegmentReader::move(ClassFilePath, classId2, maxVersion, ClassFileAppendPath, classId1, maxVersion - 1);
 
         return 0;
     }
 
     int archivedFileCombinationProcessor(uint64_t classId1, uint64_t classId2, uint64_t version) {
         // rolling back serial number of categories
-        // append first two active categories.
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(oldPath, VersionFilePath.data(), classId1, version, cid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
-            }
-            sprintf(newPath, VersionFilePath.data(), classId1, version - 1, cid);
-            rename(oldPath, newPath);
-            cid++;
-        }
-
-        uint64_t acid = 0;
-        while (1) {
-            sprintf(oldPath, VersionFilePath.data(), classId2, version, acid);
-            FileOperator fileOperator(oldPath, FileOpenType::TRY);
-            if (!fileOperator.ok()) {
-                break;
-            }
-            sprintf(newPath, VersionFilePath.data(), classId1, version - 1, cid);
-            rename(oldPath, newPath);
-            acid++;
-            cid++;
-        }
+        // the containers of the second volume follow the containers of the first one.
+        SegmentReader::move(VersionFilePath, classId1, version, VersionFilePath, classId1, version - 1);
+        SegmentReader::move(VersionFilePath, classId2, version, VersionFilePath, classId1, version - 1);
 
         return 0;
     }
@@ -28,6 +28,7 @@ public:
         taskAmount++;
         condition.notifyAll();
 
+        return 0;
     }
 
     ~HashingPipeline() {
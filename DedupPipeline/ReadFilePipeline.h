@@ -16,6 +16,20 @@
 #include "ChunkingPipeline.h"
 
 const uint64_t ReadPipelineReadBlockSize = (uint64_t) 32 * 1024 * 1024;
+// two blocks are held by the reader and the chunker, and a segment by deduplication
+const uint64_t MinReadAheadWindow = 4 * ReadPipelineReadBlockSize / 1024 / 1024;
+
+static bool validateReadAheadWindow(const char *flagName, uint64_t value) {
+    if (value < MinReadAheadWindow) {
+        printf("--%s has to be at least %lu\n", flagName, MinReadAheadWindow);
+        return false;
+    }
+    return true;
+}
+
+DEFINE_uint64(ReadAheadWindow,
+              1024, "MB of a version read ahead of the chunks written, the memory a backup holds of its input");
+DEFINE_validator(ReadAheadWindow, &validateReadAheadWindow);
 
 class ReadFilePipeline {
 public:
@@ -28,6 +42,7 @@ public:
         taskList.push_back(storageTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~ReadFilePipeline() {
@@ -64,26 +79,44 @@ private:
             duration = 0;
 
             CountdownLatch *cd = storageTask->countdownLatch;
-            FileOperator fileOperator((char *) storageTask->path.c_str(), FileOpenType::Read);
+            FileOperator *fileOperator = new FileOperator((char *) storageTask->path.c_str(), FileOpenType::Read);
             storageTask->length = FileOperator::size((char *) storageTask->path.c_str());
-            storageTask->buffer = (uint8_t *) malloc(storageTask->length);
+            reserve(storageTask);
+            GlobalWriteFilePipelinePtr->startInput(storageTask->buffer);
             uint64_t readOffset = 0;
             uint64_t readOnce = 0;
+            uint64_t window = FLAGS_ReadAheadWindow * 1024 * 1024;
             chunkTask.fileID = storageTask->fileID;
             chunkTask.buffer = storageTask->buffer;
             chunkTask.length = storageTask->length;
 
             gettimeofday(&t0, NULL);
-            while (readOnce = fileOperator.read(storageTask->buffer + readOffset, ReadPipelineReadBlockSize)) {
+            // a block is handed on once the next one is read, the last one carries the latch even
+            // if the input ends right after a full block
+            bool pending = false;
+            while (readOffset < storageTask->length) {
+                if (readOffset + ReadPipelineReadBlockSize > window) {
+                    GlobalWriteFilePipelinePtr->waitForInput(readOffset + ReadPipelineReadBlockSize - window);
+                }
+                readOnce = fileOperator->read(storageTask->buffer + readOffset,
+                                              std::min(ReadPipelineReadBlockSize, storageTask->length - readOffset));
+                if (!readOnce) {
+                    break;
+                }
+                if (pending) {
+                    GlobalChunkingPipelinePtr->addTask(chunkTask);
+                }
                 readOffset += readOnce;
                 chunkTask.end = readOffset;
-                if (readOnce < ReadPipelineReadBlockSize) {
-                    chunkTask.countdownLatch = cd;
-                }
+                pending = true;
+            }
+            if (pending) {
+                chunkTask.countdownLatch = cd;
                 GlobalChunkingPipelinePtr->addTask(chunkTask);
-
             }
+            storageTask->length = readOffset;
             chunkTask.countdownLatch = nullptr;
+            delete fileOperator;
             cd->countDown();
             gettimeofday(&t1, NULL);
             duration += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
@@ -97,6 +130,25 @@ private:
         }
     }
 
+    // The input is read into address space of its length, but only the pages read ahead of the
+    // chunks written take memory, the writer gives back those behind. do_backup() unmaps it.
+    static void reserve(StorageTask *storageTask) {
+        storageTask->buffer = nullptr;
+        storageTask->reservedLength = storageTask->length;
+        if (!storageTask->length) {
+            return;
+        }
+        void *buffer = mmap(nullptr, storageTask->length, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (buffer == MAP_FAILED) {
+            printf("[DedupReading] can not reserve %lu bytes : %s\n", storageTask->length, strerror(errno));
+            storageTask->reservedLength = 0;
+            storageTask->length = 0;
+            return;
+        }
+        storageTask->buffer = (uint8_t *) buffer;
+    }
+
     bool runningFlag;
     std::thread *worker;
     uint64_t taskAmount;
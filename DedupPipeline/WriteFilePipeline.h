@@ -15,6 +15,7 @@
 #include "../Utility/ContainerConstructor.h"
 #include "../Utility/Likely.h"
 #include "../Utility/BufferedFileWriter.h"
+#include "../Utility/RecipeFormat.h"
 #include <zstd.h>
 
 extern std::string LogicFilePath;
@@ -25,7 +26,7 @@ DEFINE_uint64(RecipeFlushBufferSize,
 class WriteFilePipeline {
 public:
     WriteFilePipeline() : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
-                          logicFileOperator(nullptr) {
+                          recipeWriter(nullptr), inputCondition(inputLock) {
         worker = new std::thread(std::bind(&WriteFilePipeline::writeFileCallback, this));
     }
 
@@ -34,11 +35,29 @@ public:
         receiveList.push_back(writeTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
-    int getContainer(uint64_t s, uint64_t e, uint64_t c, uint8_t *buffer, uint64_t *length) {
-        if(chunkWriterManager == nullptr) return 0;
-        return chunkWriterManager->getContainer(s, e, c, buffer, length);
+    ContainerPtr getContainer(uint64_t s, uint64_t e, uint64_t c) {
+        if(chunkWriterManager == nullptr) return nullptr;
+        return chunkWriterManager->getContainer(s, e, c);
+    }
+
+    // The input of a version is given back behind the chunks written, ReadFilePipeline keeps its
+    // read-ahead within a window of them.
+    void startInput(uint8_t *buffer) {
+        MutexLockGuard mutexLockGuard(inputLock);
+        inputBuffer = buffer;
+        inputConsumed = 0;
+        inputReleased = 0;
+    }
+
+    // Waits until the chunks before offset are written.
+    void waitForInput(uint64_t offset) {
+        MutexLockGuard mutexLockGuard(inputLock);
+        while (inputConsumed < offset) {
+            inputCondition.wait();
+        }
     }
 
     ~WriteFilePipeline() {
@@ -85,9 +104,9 @@ private:
             }
 
             for (auto &writeTask: taskList) {
-                if (!logicFileOperator) {
+                if (!recipeWriter) {
                     sprintf(buffer, LogicFilePath.c_str(), writeTask.fileID);
-                    logicFileOperator = new FileOperator(buffer, FileOpenType::Write);
+                    recipeWriter = new RecipeWriter(buffer, FLAGS_RecipeDelta ? writeTask.fileID - 1 : 0);
                     printf("start write\n");
                 }
                 blockHeader = {
@@ -97,11 +116,10 @@ private:
                 };
                 switch (writeTask.type) {
                     case 0: //Unique
-                        oriBuffer = writeTask.buffer;
                         blockHeader.sFeatures = writeTask.similarityFeatures;
                         chunkWriterManager->writeClass((uint8_t *) &blockHeader, sizeof(BlockHeader),
                                                        writeTask.buffer + writeTask.pos, writeTask.length);
-                        logicFileOperator->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+                        recipeWriter->add(blockHeader);
                         //bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
                         recipeLength += blockHeader.length;
                         break;
@@ -110,7 +128,7 @@ private:
                             blockHeader.baseFP = writeTask.baseFP;
                             blockHeader.oriLength = writeTask.oriLength;
                         }
-                        logicFileOperator->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+                        recipeWriter->add(blockHeader);
 //                        bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
                         recipeLength += blockHeader.length;
                         break;
@@ -120,7 +138,7 @@ private:
                             blockHeader.oriLength = writeTask.oriLength;
                         }
                         //bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
-                        logicFileOperator->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+                        recipeWriter->add(blockHeader);
                         recipeLength += blockHeader.length;
                         break;
                     case 4: //Similar
@@ -128,7 +146,7 @@ private:
                         blockHeader.oriLength = writeTask.oriLength;
                         chunkWriterManager->writeClass((uint8_t *) &blockHeader, sizeof(BlockHeader),
                                                        writeTask.buffer, writeTask.length);
-                        logicFileOperator->write((uint8_t *) &blockHeader, sizeof(BlockHeader));
+                        recipeWriter->add(blockHeader);
                         //bufferedFileWriter->write((uint8_t * ) & blockHeader, sizeof(BlockHeader));
                         recipeLength += blockHeader.oriLength;
                         free(writeTask.buffer);
@@ -140,8 +158,8 @@ private:
 
                 if (writeTask.countdownLatch) {
                     printf("WritePipeline finish\n");
-                    delete logicFileOperator;
-                    logicFileOperator = nullptr;
+                    delete recipeWriter;
+                    recipeWriter = nullptr;
                     delete chunkWriterManager;
                     chunkWriterManager = nullptr;
                     gettimeofday(&t1, NULL);
@@ -151,11 +169,15 @@ private:
                     printf("[CheckPoint:write] InitTime:%lu, EndTime:%lu\n",
                            initTime.tv_sec * 1000000 + initTime.tv_usec, endTime.tv_sec * 1000000 + endTime.tv_usec);
 
+                    // the input is unmapped once the latch is down
+                    startInput(nullptr);
                     writeTask.countdownLatch->countDown();
-                    free(oriBuffer);
                 }
 
             }
+            if (!taskList.empty() && !taskList.back().countdownLatch) {
+                releaseInput(taskList.back().inputEnd);
+            }
             taskList.clear();
 
             gettimeofday(&t1, NULL);
@@ -163,7 +185,20 @@ private:
         }
     }
 
-    FileOperator *logicFileOperator;
+    // Only whole pages before the end of the chunks written are released.
+    void releaseInput(uint64_t end) {
+        static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+        MutexLockGuard mutexLockGuard(inputLock);
+        uint64_t pageEnd = end / pageSize * pageSize;
+        if (inputBuffer && pageEnd > inputReleased) {
+            madvise(inputBuffer + inputReleased, pageEnd - inputReleased, MADV_DONTNEED);
+            inputReleased = pageEnd;
+        }
+        inputConsumed = end;
+        inputCondition.notifyAll();
+    }
+
+    RecipeWriter *recipeWriter;
     char buffer[256];
     bool runningFlag;
     std::thread *worker;
@@ -173,8 +208,12 @@ private:
     MutexLock mutexLock;
     Condition condition;
     uint64_t duration = 0;
-    uint8_t *oriBuffer;
     ContainerConstructor *chunkWriterManager = nullptr;
+    MutexLock inputLock;
+    Condition inputCondition;
+    uint8_t *inputBuffer = nullptr;
+    uint64_t inputConsumed = 0;
+    uint64_t inputReleased = 0;
 };
 
 static WriteFilePipeline *GlobalWriteFilePipelinePtr;
@@ -0,0 +1,57 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include "gflags/gflags.h"
+#include "Utility/ControlSocket.h"
+
+// The server resolves paths in its own working directory, the target of a restore may not exist yet.
+static std::string absolutePath(const std::string &path) {
+    if (path.empty() || path[0] == '/') {
+        return path;
+    }
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        return path;
+    }
+    return std::string(cwd) + "/" + path;
+}
+
+// Sends one job to ./MeGA --task=serve and prints its reply, e.g.
+//   ./MeGAClient --SocketPath=/tmp/MeGA.sock backup /data/backup.tar
+// The exit status is 0 for an OK reply.
+int main(int argc, char **argv) {
+    gflags::SetUsageMessage("MeGAClient [--SocketPath=..] backup [path] | restore [version] [path] | delete | status | stop");
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    if (argc < 2) {
+        gflags::ShowUsageWithFlagsRestrict(argv[0], "ControlSocket");
+        return 2;
+    }
+    std::string job = argv[1];
+    // the path is the last word of backup and restore
+    int pathArgument = job == "backup" ? 2 : job == "restore" ? 3 : -1;
+    for (int i = 2; i < argc; i++) {
+        job += " ";
+        job += i == pathArgument ? absolutePath(argv[i]) : std::string(argv[i]);
+    }
+
+    ControlConnection connection = ControlConnection::connectTo(FLAGS_SocketPath);
+    if (!connection.ok()) {
+        printf("Can not connect to %s, is ./MeGA --task=serve running?\n", FLAGS_SocketPath.data());
+        return 2;
+    }
+    std::string reply;
+    if (!connection.writeLine(job) || !connection.readLine(reply)) {
+        printf("The server closed the connection\n");
+        return 2;
+    }
+    printf("%s\n", reply.data());
+    return reply.compare(0, 2, "OK") ? 1 : 0;
+}
@@ -27,6 +27,7 @@ int ReplaceThreshold = 10;
 
 extern uint64_t TotalVersion;
 extern std::string KVPath;
+extern std::string PendingIndexPath;
 
 struct TupleHasher {
     std::size_t
@@ -41,14 +42,43 @@ struct TupleEqualer {
     }
 };
 
+// A located entry knows the container (categoryOrder, cid) and the position (slot) of its chunk
+// in the active categories. Category 0 is the group appended to category 1 when the earliest
+// version was deleted, as in the similarity tables.
 struct FPTableEntry {
     uint32_t deltaTag: 1; // 0: unique 1: delta
     uint32_t categoryOrder: 31;
     uint64_t oriLength;
     uint64_t length;
     SHA1FP baseFP;
+    uint32_t cid;
+    uint32_t slot: 30;
+    uint32_t located: 1;
+    uint32_t arranged: 1;   // located in the categories the running arrangement writes
 };
 
+// The fingerprint index at KVPath starts with an IndexHeader. The version changes with the
+// layout of the tables, e.g. of FPTableEntry. Indexes written before the header have none and are
+// refused like any other mismatch, they have to be rebuilt by backing up again into a new store.
+const uint64_t IndexMagic = 0x78646e494147654dULL; // "MeGAIndx"
+const uint64_t IndexFormatVersion = 2;
+
+struct IndexHeader {
+    uint64_t magic;
+    uint64_t version;
+};
+
+enum class ContainerLiveness {
+    Unknown,
+    Dead,       // no chunk of the container is referenced by the new version
+    Live,       // all of them are
+    Mixed,
+};
+
+static uint64_t locationKey(uint64_t category, uint64_t cid) {
+    return category << 32 | cid;
+}
+
 struct FPIndex{
     uint64_t migrateSize = 0;
     uint64_t totalSize = 0;
@@ -301,31 +331,34 @@ public:
         }
     }
 
-    int uniqueAddRecord(const SHA1FP &sha1Fp, uint32_t categoryOrder, uint64_t oriLength) {
+    int uniqueAddRecord(const SHA1FP &sha1Fp, uint32_t categoryOrder, uint64_t oriLength, uint32_t cid,
+                        uint32_t slot) {
         MutexLockGuard mutexLockGuard(tableLock);
 
         auto pp = laterTable.fpTable.find(sha1Fp);
         assert(pp == laterTable.fpTable.end());
 
-        laterTable.fpTable.insert({sha1Fp, {0, categoryOrder, oriLength, oriLength}});
+        laterTable.fpTable.insert({sha1Fp, {0, categoryOrder, oriLength, oriLength, {}, cid, slot, 1, 0}});
 
         return 0;
     }
 
     int deltaAddRecord(const SHA1FP &sha1Fp, uint32_t categoryOrder, const SHA1FP &baseFP, uint64_t diffLength,
-                       uint64_t oriLength) {
+                       uint64_t oriLength, uint32_t cid, uint32_t slot) {
         MutexLockGuard mutexLockGuard(tableLock);
 
         auto pp = laterTable.fpTable.find(sha1Fp);
         assert(pp == laterTable.fpTable.end());
 
-        laterTable.fpTable.insert({sha1Fp, {1, categoryOrder, oriLength, oriLength - diffLength, baseFP}});
+        laterTable.fpTable.insert({sha1Fp, {1, categoryOrder, oriLength, oriLength - diffLength, baseFP, cid, slot, 1,
+                                            0}});
         laterTable.totalSize -= diffLength;
 
         return 0;
     }
 
     int addSimilarFeature(const SimilarityFeatures &similarityFeatures, const BasePos &basePos){
+        MutexLockGuard mutexLockGuard(tableLock);
         laterSimilarityTable.simIndex1.emplace(similarityFeatures.feature1, basePos);
         laterSimilarityTable.simIndex2.emplace(similarityFeatures.feature2, basePos);
         laterSimilarityTable.simIndex3.emplace(similarityFeatures.feature3, basePos);
@@ -338,22 +371,138 @@ public:
         auto pp = laterTable.fpTable.find(sha1Fp);
         //assert(pp == laterTable.fpTable.end());
 
-        laterTable.fpTable.insert({sha1Fp, fpTableEntry});
+        if (pp == laterTable.fpTable.end()) {
+            auto iter = laterTable.fpTable.insert({sha1Fp, fpTableEntry}).first;
+            markLive(sha1Fp, iter->second);
+        }
         return 0;
     }
 
+    // fpTableEntry.cid is the container the similarity index found the base in.
     int extendBase(const SHA1FP &sha1Fp, const FPTableEntry& fpTableEntry) {
         MutexLockGuard mutexLockGuard(tableLock);
 
         auto pp = laterTable.fpTable.find(sha1Fp);
         if(pp == laterTable.fpTable.end()) {
-            laterTable.fpTable.insert({sha1Fp, fpTableEntry});
+            auto iter = laterTable.fpTable.insert({sha1Fp, fpTableEntry}).first;
             laterTable.migrateSize += fpTableEntry.oriLength + sizeof(BlockHeader); // updated
+            if (!markLive(sha1Fp, iter->second)) {
+                uncertainContainers.insert(locationKey(fpTableEntry.categoryOrder, fpTableEntry.cid));
+            }
         }
 
         return 0;
     }
 
+    // Liveness is tracked while a version is deduplicated, for the arrangement which follows. It
+    // refers to the containers of the previous version, which the locations of the earlier table
+    // have to describe completely.
+    void startLivenessTracking(uint64_t version) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        liveness.clear();
+        uncertainContainers.clear();
+        livenessTracked = layoutVersion == version - 1 && !unlocatedEntries;
+        if (!livenessTracked) {
+            printf("[Liveness] not tracked, the index describes version %lu with %lu chunks not located\n",
+                   layoutVersion, unlocatedEntries);
+        }
+    }
+
+    ContainerLiveness containerLiveness(uint64_t category, uint64_t cid, uint32_t chunkCount) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        uint64_t key = locationKey(category, cid);
+        if (!livenessTracked || !chunkCount || uncertainContainers.count(key)) {
+            return ContainerLiveness::Unknown;
+        }
+        auto iter = liveness.find(key);
+        if (iter == liveness.end()) {
+            return ContainerLiveness::Dead;
+        }
+        if (iter->second.size() > (chunkCount + 63) / 64) {
+            return ContainerLiveness::Unknown;
+        }
+        uint64_t live = 0;
+        for (uint64_t word: iter->second) {
+            live += __builtin_popcountll(word);
+        }
+        return live == chunkCount ? ContainerLiveness::Live : ContainerLiveness::Mixed;
+    }
+
+    // The arrangement writer puts an active chunk at a new position.
+    int arrangementLocate(const SHA1FP &sha1Fp, uint32_t category, uint32_t cid, uint32_t slot) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        auto iter = laterTable.fpTable.find(sha1Fp);
+        if (iter != laterTable.fpTable.end()) {
+            iter->second.categoryOrder = category;
+            iter->second.cid = cid;
+            iter->second.slot = slot;
+            iter->second.located = 1;
+            iter->second.arranged = 1;
+        }
+        return 0;
+    }
+
+    // The arrangement writer relinked a whole live container, its chunks keep their slots.
+    int addRelocation(uint64_t fromCategory, uint64_t fromCID, uint64_t toCategory, uint64_t toCID) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        relocations[locationKey(fromCategory, fromCID)] = locationKey(toCategory, toCID);
+        return 0;
+    }
+
+    // After arrangement: moves the locations still referring to the previous version to the
+    // relinked containers and carries their similarity features over. Chunks born in this
+    // version were located by the backup and stay as they are.
+    int relocate(uint64_t version) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        unlocatedEntries = 0;
+        for (auto &item: laterTable.fpTable) {
+            FPTableEntry &entry = item.second;
+            if (entry.arranged) {
+                entry.arranged = 0;
+            } else if (entry.located && entry.categoryOrder != version) {
+                auto iter = relocations.find(locationKey(entry.categoryOrder, entry.cid));
+                if (iter != relocations.end()) {
+                    entry.categoryOrder = iter->second >> 32;
+                    entry.cid = (uint32_t) iter->second;
+                } else {
+                    entry.located = 0;
+                }
+            }
+            if (!entry.located) {
+                unlocatedEntries++;
+            }
+        }
+        relocateFeatures(earlierSimilarityTable.simIndex1, laterSimilarityTable.simIndex1);
+        relocateFeatures(earlierSimilarityTable.simIndex2, laterSimilarityTable.simIndex2);
+        relocateFeatures(earlierSimilarityTable.simIndex3, laterSimilarityTable.simIndex3);
+        printf("[Liveness] %lu containers relinked, %lu chunks not located\n", relocations.size(), unlocatedEntries);
+        relocations.clear();
+        liveness.clear();
+        uncertainContainers.clear();
+        layoutVersion = version;
+        return 0;
+    }
+
+    // Follows the renumbering of the active categories when the earliest version is deleted,
+    // see similarityTableMerge().
+    int locationMerge(uint64_t appendOffset) {
+        for (auto &item: earlierTable.fpTable) {
+            FPTableEntry &entry = item.second;
+            if (entry.categoryOrder >= 3) {
+                entry.categoryOrder--;
+            } else if (entry.categoryOrder == 2) {
+                entry.categoryOrder = 0;
+            } else if (entry.categoryOrder == 0) {
+                entry.categoryOrder = 1;
+                entry.cid += appendOffset;
+            }
+        }
+        if (layoutVersion) {
+            layoutVersion--;
+        }
+        return 0;
+    }
+
     int tableRolling() {
         MutexLockGuard mutexLockGuard(tableLock);
 
@@ -363,12 +512,18 @@ public:
         return 0;
     }
 
-    int similarityTableMerge(){
+    // Category 2 becomes the append group of category 1. An append group left by an earlier
+    // deletion, which no arrangement merged since, now follows the appendOffset containers of
+    // category 1, see Eliminator.
+    int similarityTableMerge(uint64_t appendOffset){
         for(auto& item: earlierSimilarityTable.simIndex1){
             if(item.second.CategoryOrder >= 3){
                 item.second.CategoryOrder--;
             }else if(item.second.CategoryOrder == 2){
                 item.second.CategoryOrder = 0;
+            }else if(item.second.CategoryOrder == 0){
+                item.second.CategoryOrder = 1;
+                item.second.cid += appendOffset;
             }
         }
         for(auto& item: earlierSimilarityTable.simIndex2){
@@ -376,6 +531,9 @@ public:
                 item.second.CategoryOrder--;
             }else if(item.second.CategoryOrder == 2){
                 item.second.CategoryOrder = 0;
+            }else if(item.second.CategoryOrder == 0){
+                item.second.CategoryOrder = 1;
+                item.second.cid += appendOffset;
             }
         }
         for(auto& item: earlierSimilarityTable.simIndex3){
@@ -383,11 +541,63 @@ public:
                 item.second.CategoryOrder--;
             }else if(item.second.CategoryOrder == 2){
                 item.second.CategoryOrder = 0;
+            }else if(item.second.CategoryOrder == 0){
+                item.second.CategoryOrder = 1;
+                item.second.cid += appendOffset;
             }
         }
         return 0;
     }
 
+    // Arrangement is deferred: the references of the new version, which the arrangement of the
+    // previous version looks up, are kept in a pending index. The tables roll as if it had run,
+    // so the next backup deduplicates against the new version.
+    int deferArrangement(uint64_t version) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        std::string path = pendingIndexPath(version);
+        {
+            FileOperator fileOperator((char *) path.data(), FileOpenType::Write);
+            if (!fileOperator.ok()) {
+                return -1;
+            }
+            writeTable(fileOperator, laterTable);
+            writeFeatures(fileOperator, laterSimilarityTable.simIndex1);
+            writeFeatures(fileOperator, laterSimilarityTable.simIndex2);
+            writeFeatures(fileOperator, laterSimilarityTable.simIndex3);
+            fileOperator.fdatasync();
+        }
+        printf("[Deferred] %lu references of version %lu kept for arrangement\n", laterTable.fpTable.size(),
+               version);
+        earlierTable.rolling(laterTable);
+        earlierSimilarityTable.rolling(laterSimilarityTable);
+        return 0;
+    }
+
+    // Puts back the later tables as the backup of version left them, for the deferred
+    // arrangement of version - 1.
+    int loadPendingIndex(uint64_t version) {
+        MutexLockGuard mutexLockGuard(tableLock);
+        std::string path = pendingIndexPath(version);
+        FileOperator fileOperator((char *) path.data(), FileOpenType::TRY);
+        if (!fileOperator.ok()) {
+            printf("[Deferred] the references of version %lu are missing\n", version);
+            return -1;
+        }
+        readTable(fileOperator, laterTable);
+        readFeatures(fileOperator, laterSimilarityTable.simIndex1);
+        readFeatures(fileOperator, laterSimilarityTable.simIndex2);
+        readFeatures(fileOperator, laterSimilarityTable.simIndex3);
+        // liveness only describes a backup arranged right away
+        livenessTracked = false;
+        liveness.clear();
+        uncertainContainers.clear();
+        return 0;
+    }
+
+    static void removePendingIndex(uint64_t version) {
+        remove(pendingIndexPath(version).data());
+    }
+
     // updated
     int save(){
         printf("------------------------Saving index----------------------\n");
@@ -395,6 +605,8 @@ public:
         uint64_t size;
         FileOperator fileOperator((char*)KVPath.data(), FileOpenType::Write);
 
+        IndexHeader header = {IndexMagic, IndexFormatVersion};
+        fileOperator.write((uint8_t *) &header, sizeof(IndexHeader));
         fileOperator.write((uint8_t*)&earlierTable, sizeof(uint64_t)*2);
         size = earlierTable.fpTable.size();
         fileOperator.write((uint8_t*)&size, sizeof(uint64_t));
@@ -456,12 +668,15 @@ public:
             fileOperator.write((uint8_t *) &item.second, sizeof(BasePos));
         }
         printf("later similar table3 saves %lu items\n", size);
+        fileOperator.write((uint8_t *) &layoutVersion, sizeof(uint64_t));
 
         fileOperator.fdatasync();
 
         return 0;
     }
 
+    // Fails with -1 on an index which is missing or has another layout, reading it anyway would
+    // deduplicate against garbage.
     int load(){
         printf("-----------------------Loading index-----------------------\n");
         printf("Loading index..\n");
@@ -471,9 +686,25 @@ public:
         FPTableEntry tempFPTableEntry;
         uint64_t tempFeature;
         BasePos tempBasePos;
-        FileOperator fileOperator((char*)KVPath.data(), FileOpenType::Read);
+        FileOperator fileOperator((char*)KVPath.data(), FileOpenType::TRY);
         assert(earlierTable.fpTable.size() == 0);
         assert(laterTable.fpTable.size() == 0);
+        if (!fileOperator.ok()) {
+            printf("[Index] can not open %s\n", KVPath.data());
+            return -1;
+        }
+        IndexHeader header;
+        if (fileOperator.read((uint8_t *) &header, sizeof(IndexHeader)) != sizeof(IndexHeader) ||
+            header.magic != IndexMagic) {
+            printf("[Index] %s is no fingerprint index of this MeGA, it is damaged or was written before the index had a header\n",
+                   KVPath.data());
+            return -1;
+        }
+        if (header.version != IndexFormatVersion) {
+            printf("[Index] %s has layout version %lu, this MeGA reads version %lu\n", KVPath.data(),
+                   header.version, IndexFormatVersion);
+            return -1;
+        }
 
         fileOperator.read((uint8_t*)&earlierTable, sizeof(uint64_t)*2);
         fileOperator.read((uint8_t*)&sizeE, sizeof(uint64_t));
@@ -481,6 +712,9 @@ public:
             fileOperator.read((uint8_t*)&tempFP, sizeof(SHA1FP));
             fileOperator.read((uint8_t*)&tempFPTableEntry, sizeof(FPTableEntry));
             earlierTable.fpTable.insert({tempFP, tempFPTableEntry});
+            if (!tempFPTableEntry.located) {
+                unlocatedEntries++;
+            }
         }
         printf("earlier table load %lu items\n", sizeE);
         fileOperator.read((uint8_t*)&sizeE, sizeof(uint64_t));
@@ -506,7 +740,7 @@ public:
         printf("earlier similar table3 load %lu items\n", sizeE);
 
 
-        fileOperator.read((uint8_t*)&earlierTable, sizeof(uint64_t)*2);
+        fileOperator.read((uint8_t*)&laterTable, sizeof(uint64_t)*2);
         fileOperator.read((uint8_t*)&sizeL, sizeof(uint64_t));
         for(uint64_t i = 0; i<sizeL; i++){
             fileOperator.read((uint8_t*)&tempFP, sizeof(SHA1FP));
@@ -535,6 +769,9 @@ public:
             laterSimilarityTable.simIndex3.insert({tempFeature, tempBasePos});
         }
         printf("later similar table3 load %lu items\n", sizeL);
+        if (fileOperator.read((uint8_t *) &layoutVersion, sizeof(uint64_t)) != sizeof(uint64_t)) {
+            layoutVersion = 0;
+        }
 
         return 0;
     }
@@ -598,6 +835,95 @@ public:
     }
 
 private:
+    static std::string pendingIndexPath(uint64_t version) {
+        char pathBuffer[256];
+        sprintf(pathBuffer, PendingIndexPath.data(), version);
+        return pathBuffer;
+    }
+
+    static void writeTable(FileOperator &fileOperator, FPIndex &table) {
+        uint64_t size = table.fpTable.size();
+        fileOperator.write((uint8_t *) &table, sizeof(uint64_t) * 2);
+        fileOperator.write((uint8_t *) &size, sizeof(uint64_t));
+        for (auto &item: table.fpTable) {
+            fileOperator.write((uint8_t *) &item.first, sizeof(SHA1FP));
+            fileOperator.write((uint8_t *) &item.second, sizeof(FPTableEntry));
+        }
+    }
+
+    static void readTable(FileOperator &fileOperator, FPIndex &table) {
+        uint64_t size = 0;
+        SHA1FP fp;
+        FPTableEntry entry;
+        table.fpTable.clear();
+        fileOperator.read((uint8_t *) &table, sizeof(uint64_t) * 2);
+        fileOperator.read((uint8_t *) &size, sizeof(uint64_t));
+        table.fpTable.reserve(size);
+        for (uint64_t i = 0; i < size; i++) {
+            fileOperator.read((uint8_t *) &fp, sizeof(SHA1FP));
+            fileOperator.read((uint8_t *) &entry, sizeof(FPTableEntry));
+            table.fpTable.insert({fp, entry});
+        }
+    }
+
+    static void writeFeatures(FileOperator &fileOperator, std::unordered_map<uint64_t, BasePos> &features) {
+        uint64_t size = features.size();
+        fileOperator.write((uint8_t *) &size, sizeof(uint64_t));
+        for (auto &item: features) {
+            fileOperator.write((uint8_t *) &item.first, sizeof(uint64_t));
+            fileOperator.write((uint8_t *) &item.second, sizeof(BasePos));
+        }
+    }
+
+    static void readFeatures(FileOperator &fileOperator, std::unordered_map<uint64_t, BasePos> &features) {
+        uint64_t size = 0, feature;
+        BasePos basePos;
+        features.clear();
+        fileOperator.read((uint8_t *) &size, sizeof(uint64_t));
+        for (uint64_t i = 0; i < size; i++) {
+            fileOperator.read((uint8_t *) &feature, sizeof(uint64_t));
+            fileOperator.read((uint8_t *) &basePos, sizeof(BasePos));
+            features.insert({feature, basePos});
+        }
+    }
+
+    // Sets the liveness bit of a chunk of the previous version which the new version references.
+    // An entry without location takes it from the earlier table. Returns 0 if that fails.
+    int markLive(const SHA1FP &sha1Fp, FPTableEntry &entry) {
+        if (!entry.located) {
+            auto iter = earlierTable.fpTable.find(sha1Fp);
+            if (iter == earlierTable.fpTable.end() || !iter->second.located) {
+                return 0;
+            }
+            entry.categoryOrder = iter->second.categoryOrder;
+            entry.cid = iter->second.cid;
+            entry.slot = iter->second.slot;
+            entry.located = 1;
+        }
+        if (livenessTracked) {
+            std::vector<uint64_t> &bits = liveness[locationKey(entry.categoryOrder, entry.cid)];
+            if (bits.size() <= entry.slot / 64) {
+                bits.resize(entry.slot / 64 + 1, 0);
+            }
+            bits[entry.slot / 64] |= 1ULL << (entry.slot % 64);
+        }
+        return 1;
+    }
+
+    void relocateFeatures(std::unordered_map<uint64_t, BasePos> &earlier,
+                          std::unordered_map<uint64_t, BasePos> &later) {
+        if (relocations.empty()) return;
+        for (auto &item: earlier) {
+            auto iter = relocations.find(locationKey(item.second.CategoryOrder, item.second.cid));
+            if (iter != relocations.end()) {
+                BasePos basePos = item.second;
+                basePos.CategoryOrder = iter->second >> 32;
+                basePos.cid = (uint32_t) iter->second;
+                later.emplace(item.first, basePos);
+            }
+        }
+    }
+
     FPIndex earlierTable;
     FPIndex laterTable;
     SimilarityIndex earlierSimilarityTable;
@@ -605,6 +931,14 @@ private:
 
     uint64_t totalLength = 0, afterDedup = 0, afterDelta = 0, AfterCompression = 0;
 
+    // liveness bits by locationKey(), bit i stands for slot i
+    std::unordered_map<uint64_t, std::vector<uint64_t>> liveness;
+    std::unordered_set<uint64_t> uncertainContainers;
+    std::unordered_map<uint64_t, uint64_t> relocations;
+    bool livenessTracked = false;
+    uint64_t layoutVersion = 0;     // the version whose containers the locations describe
+    uint64_t unlocatedEntries = 0;  // in the earlier table
+
     MutexLock tableLock;
 };
 
@@ -19,6 +19,7 @@ public:
         taskList.push_back(restoreTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~RestoreDecomPipeline() {
@@ -56,8 +57,8 @@ private:
 
             gettimeofday(&t0, NULL);
             uint8_t *decomBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-            size_t decompressedSize = ZSTD_decompress(decomBuffer, RestoreReadBufferLength, restoreParseTask->buffer,
-                                                      restoreParseTask->length);
+            size_t decompressedSize = decompressContainer(decomBuffer, RestoreReadBufferLength,
+                                                          restoreParseTask->buffer, restoreParseTask->length);
             assert(!ZSTD_isError(decompressedSize));
             free(restoreParseTask->buffer);
             restoreParseTask->buffer = decomBuffer;
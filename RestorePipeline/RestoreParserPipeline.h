@@ -12,6 +12,7 @@
 #include "RestoreWritePipeline.h"
 #include "../Utility/StorageTask.h"
 #include "../Utility/FileOperator.h"
+#include "../Utility/RecipeFormat.h"
 #include <thread>
 #include <assert.h>
 
@@ -26,7 +27,7 @@ class RestoreParserPipeline {
 public:
     RestoreParserPipeline(uint64_t target, const std::string &path) : taskAmount(0), runningFlag(true), mutexLock(),
                                                                       condition(mutexLock) {
-        worker = new std::thread(std::bind(&RestoreParserPipeline::restoreParserCallback, this, path));
+        worker = new std::thread(std::bind(&RestoreParserPipeline::restoreParserCallback, this, target, path));
     }
 
     int addTask(RestoreParseTask *restoreParseTask) {
@@ -34,6 +35,7 @@ public:
         taskList.push_back(restoreParseTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~RestoreParserPipeline() {
@@ -44,31 +46,30 @@ public:
     }
 
 private:
-    void restoreParserCallback(const std::string &path) {
+    void restoreParserCallback(uint64_t target, const std::string &path) {
         pthread_setname_np(pthread_self(), "RParsing");
 
-        FileOperator recipeFD((char *) path.data(), FileOpenType::Read);
-        uint64_t size = FileOperator::size(path);
-        uint8_t *recipeBuffer = (uint8_t *) malloc(size);
-        recipeFD.read(recipeBuffer, size);
-        uint64_t count = size / sizeof(BlockHeader);
-        assert(count * sizeof(BlockHeader) == size);
-        BlockHeader *blockHeader;
-        printf("Chunks:%lu\n", count);
+        // the recipe is decoded block by block, a v2 recipe tells the size up front
+        RecipeReader recipeReader(path, target);
+        printf("Chunks:%lu\n", recipeReader.getChunkCount());
+        if (recipeReader.getLogicalSize()) {
+            GlobalRestoreWritePipelinePtr->setSize(recipeReader.getLogicalSize());
+        }
+        BlockHeader blockHeader;
 
         uint64_t pos = 0;
-        for (int i=0; i<count; i++) {
-            blockHeader = (BlockHeader *) (recipeBuffer + i * sizeof(BlockHeader));
-            if(blockHeader->type) {
-                restoreMap[blockHeader->baseFP].push_back({0, 1, pos, blockHeader->length});
-                restoreMap[blockHeader->fp].push_back({1, 0, pos, 0});
-                pos += blockHeader->oriLength;
+        while (recipeReader.next(&blockHeader)) {
+            if(blockHeader.type) {
+                restoreMap[blockHeader.baseFP].push_back({0, 1, pos, blockHeader.length});
+                restoreMap[blockHeader.fp].push_back({1, 0, pos, 0});
+                pos += blockHeader.oriLength;
             }else{
-                restoreMap[blockHeader->fp].push_back({0, 0, pos, 0});
-                pos += blockHeader->length;
+                restoreMap[blockHeader.fp].push_back({0, 0, pos, 0});
+                pos += blockHeader.length;
             }
         }
         printf("total size:%lu\n", pos);
+        assert(!recipeReader.getLogicalSize() || recipeReader.getLogicalSize() == pos);
         GlobalRestoreWritePipelinePtr->setSize(pos);
 
         RestoreParseTask *restoreParseTask;
@@ -126,20 +127,20 @@ private:
                 BlockHeader *pBH = (BlockHeader *) (buffer + entry.offset);
                 uint8_t *bufferPtr = (uint8_t *) (buffer + entry.offset + sizeof(BlockHeader));
                 auto iter = restoreMap.find(pBH->fp);
-                // if we allow arrangement to fall behind, below assert must be commented.
-                assert(iter->second.size() > 0);
-                if (iter != restoreMap.end()) {
-                    for (auto item : iter->second) {
-                        totalLength += pBH->length;
-                        // item.length could be the length before delta (not the actual delta size), when delta chunk is migrated as adjacent.
-                        RestoreWriteTask *restoreWriteTask = new RestoreWriteTask(bufferPtr, item.pos,
-                                                                                  pBH->length, item.type, item.base,
-                                                                                  item.deltaLength);
-                        GlobalRestoreWritePipelinePtr->addTask(restoreWriteTask);
-                    }
-                } else {
-                    assert(0);
+                // The categories of versions whose arrangement was deferred also hold chunks the
+                // target does not reference, or another copy of one. Each chunk is used once.
+                if (iter == restoreMap.end()) {
+                    continue;
+                }
+                for (auto item : iter->second) {
+                    totalLength += pBH->length;
+                    // item.length could be the length before delta (not the actual delta size), when delta chunk is migrated as adjacent.
+                    RestoreWriteTask *restoreWriteTask = new RestoreWriteTask(bufferPtr, item.pos,
+                                                                              pBH->length, item.type, item.base,
+                                                                              item.deltaLength);
+                    GlobalRestoreWritePipelinePtr->addTask(restoreWriteTask);
                 }
+                restoreMap.erase(iter);
             }
 
             delete restoreParseTask;
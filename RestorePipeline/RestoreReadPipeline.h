@@ -11,6 +11,7 @@
 
 #include <fcntl.h>
 #include "RestoreDecomPipeline.h"
+#include "../Utility/SegmentFile.h"
 
 extern std::string ClassFileAppendPath;
 
@@ -33,6 +34,7 @@ public:
         taskList.push_back(restoreTask);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~RestoreReadPipeline() {
@@ -61,22 +63,23 @@ private:
             }
             gettimeofday(&t0, NULL);
 
-            uint64_t baseClass = 0;
-            std::list<uint64_t> categoryList, volumeList;
-            if(restoreTask->fallBehind == 0 || (restoreTask->maxVersion - restoreTask->fallBehind) >= restoreTask->targetVersion){
-                for (uint64_t i = restoreTask->targetVersion; i < restoreTask->maxVersion; i++) {
-                    volumeList.push_back(i);
-                    printf("Column # %lu is required\n", i);
-                }
-                uint64_t baseCategory = 1;
-                baseClass = baseCategory;
-                for (uint64_t i = baseCategory; i < baseCategory + restoreTask->targetVersion; i++) {
-                    categoryList.push_front(i);
-                  printf("Cat. # %lu is required\n", i);
-                }
-              printf("append Cat. # %lu is optional\n", baseCategory);
-            }else{
-                assert(0); // todo: do not consider fall behind currently
+            // Versions up to the arranged one are laid out in categories and volumes. A version
+            // whose arrangement was deferred left its new chunks in its own category, Cat.(k,k).
+            uint64_t arranged = restoreTask->maxVersion - restoreTask->fallBehind;
+            uint64_t baseClass = 1;
+            std::list<uint64_t> volumeList;
+            std::list<std::pair<uint64_t, uint64_t>> categoryList;  // category and column
+            for (uint64_t i = restoreTask->targetVersion; i < arranged; i++) {
+                volumeList.push_back(i);
+                printf("Column # %lu is required\n", i);
+            }
+            for (uint64_t i = baseClass; i < baseClass + restoreTask->targetVersion; i++) {
+                uint64_t column = i <= arranged ? arranged : i;
+                categoryList.push_front({i, column});
+                printf("Cat. # (%lu,%lu) is required\n", i, column);
+            }
+            if (arranged) {
+                printf("append Cat. # %lu is optional\n", baseClass);
             }
 
             for (auto &item : volumeList) {
@@ -84,10 +87,10 @@ private:
             }
 
             for (auto &item : categoryList) {
-                if (item == baseClass) {
-                    readFromAppendCategoryFile(baseClass, restoreTask->maxVersion);
+                if (item.first == baseClass && item.second == arranged) {
+                    readFromAppendCategoryFile(baseClass, arranged);
                 }
-                readFromCategoryFile(item, restoreTask->maxVersion);
+                readFromCategoryFile(item.first, item.second);
             }
 
 
@@ -103,124 +106,41 @@ private:
 
     int readFromVolumeFile(uint64_t versionId, uint64_t restoreVersion) {
         for (int i = restoreVersion; i >= 1; i--) {
-            uint64_t cid = 0;
-            while (1) {
-                sprintf(filePath, VersionFilePath.data(), i, versionId, cid);
-                FileOperator archivedReader(filePath, FileOpenType::TRY);
-                if (!archivedReader.ok()) {
-                    break;
-                }
-              cid++;
-              counter++;
-            }
-            uint64_t cidMax = cid - 1;
-
-            for (int j = cidMax; j >= 0; j--) {
-                sprintf(filePath, VersionFilePath.data(), i, versionId, j);
-                FileOperator archivedReader(filePath, FileOpenType::Read);
-                uint8_t *readBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-                gettimeofday(&rt0, NULL);
-                uint64_t readLength = archivedReader.read(readBuffer, RestoreReadBufferLength);
-                gettimeofday(&rt1, NULL);
-                readTime += (rt1.tv_sec - rt0.tv_sec) * 1000000 + rt1.tv_usec - rt0.tv_usec;;
-
-//                uint8_t *decompressBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-//                gettimeofday(&dt0, NULL);
-//                size_t decompressedSize = ZSTD_decompress(decompressBuffer, RestoreReadBufferLength, readBuffer,
-//                                                          readLength);
-//                gettimeofday(&dt1, NULL);
-//                decompressionTime += (dt1.tv_sec - dt0.tv_sec) * 1000000 + dt1.tv_usec - dt0.tv_usec;;
-//                assert(!ZSTD_isError(decompressedSize));
-//                free(readBuffer);
-
-                RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, readLength,
-                                                                          readLength);
-                restoreParseTask->index = versionId;
-                GlobalRestoreDecomPipelinePtr->addTask(restoreParseTask);
-            }
+            readSegment(VersionFilePath, i, versionId, versionId);
         }
-
+        return 0;
     }
 
 
     int readFromCategoryFile(uint64_t classId, uint64_t column) {
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(filePath, ClassFilePath.data(), classId, column, cid);
-            FileOperator activeReader(filePath, FileOpenType::TRY);
-            if (!activeReader.ok()) {
-                break;
-            }
-          cid++;
-          counter++;
-        }
-        uint64_t cidMax = cid - 1;
-
-        for (int j = cidMax; j >= 0; j--) {
-            sprintf(filePath, ClassFilePath.data(), classId, column, j);
-            FileOperator activeReader(filePath, FileOpenType::Read);
-            uint8_t *readBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-            gettimeofday(&rt0, NULL);
-            uint64_t readLength = activeReader.read(readBuffer, RestoreReadBufferLength);
-            gettimeofday(&rt1, NULL);
-            readTime += (rt1.tv_sec - rt0.tv_sec) * 1000000 + rt1.tv_usec - rt0.tv_usec;;
-
-//            uint8_t *decompressBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-//            gettimeofday(&dt0, NULL);
-//            size_t decompressedSize = ZSTD_decompress(decompressBuffer, RestoreReadBufferLength, readBuffer,
-//                                                      readLength);
-//            gettimeofday(&dt1, NULL);
-//            decompressionTime += (dt1.tv_sec - dt0.tv_sec) * 1000000 + dt1.tv_usec - dt0.tv_usec;;
-//            assert(!ZSTD_isError(decompressedSize));
-//            free(readBuffer);
-
-            RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, readLength, readLength);
-            restoreParseTask->index = column;
-            GlobalRestoreDecomPipelinePtr->addTask(restoreParseTask);
-        }
+        readSegment(ClassFilePath, classId, column, column);
+        return 0;
     }
 
     int readFromAppendCategoryFile(uint64_t classId, uint64_t column) {
         printf("Trying to load append file.\n");
+        readSegment(ClassFileAppendPath, classId, column, column);
+        return 0;
+    }
 
-        uint64_t cid = 0;
-        while (1) {
-            sprintf(filePath, ClassFileAppendPath.data(), classId, column, cid);
-            FileOperator activeReader(filePath, FileOpenType::TRY);
-            if (!activeReader.ok()) {
-                break;
-            }
-          cid++;
-          counter++;
-        }
-        uint64_t cidMax = cid - 1;
-
-        for (int j = cidMax; j >= 0; j--) {
-            sprintf(filePath, ClassFileAppendPath.data(), classId, column, j);
-            FileOperator activeReader(filePath, FileOpenType::Read);
+    // Containers of a segment are handed over from the last to the first.
+    void readSegment(const std::string &pathTemplate, uint64_t a, uint64_t b, uint64_t index) {
+        SegmentReader segment(pathTemplate, a, b);
+        counter += segment.count();
+        for (int64_t j = (int64_t) segment.count() - 1; j >= 0; j--) {
             uint8_t *readBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
             gettimeofday(&rt0, NULL);
-            uint64_t readLength = activeReader.read(readBuffer, RestoreReadBufferLength);
+            uint64_t readLength = segment.read(j, readBuffer, RestoreReadBufferLength);
             gettimeofday(&rt1, NULL);
             readTime += (rt1.tv_sec - rt0.tv_sec) * 1000000 + rt1.tv_usec - rt0.tv_usec;;
 
-//            uint8_t *decompressBuffer = (uint8_t *) malloc(RestoreReadBufferLength);
-//            gettimeofday(&dt0, NULL);
-//            size_t decompressedSize = ZSTD_decompress(decompressBuffer, RestoreReadBufferLength, readBuffer,
-//                                                      readLength);
-//            gettimeofday(&dt1, NULL);
-//            decompressionTime += (dt1.tv_sec - dt0.tv_sec) * 1000000 + dt1.tv_usec - dt0.tv_usec;;
-//            assert(!ZSTD_isError(decompressedSize));
-//            free(readBuffer);
-
             RestoreParseTask *restoreParseTask = new RestoreParseTask(readBuffer, readLength, readLength);
-            restoreParseTask->index = column;
+            restoreParseTask->index = index;
             GlobalRestoreDecomPipelinePtr->addTask(restoreParseTask);
         }
     }
 
 
-    char filePath[256];
     bool runningFlag;
     std::thread *worker;
     uint64_t taskAmount;
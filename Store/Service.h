@@ -0,0 +1,111 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_SERVICE_H
+#define MEGA_SERVICE_H
+
+#include "Workflow.h"
+#include "../Utility/ControlSocket.h"
+
+// The jobs of --task=serve, apart from main.cpp so that the tests can run them.
+
+// Runs one job of the control protocol, see ControlSocket.h. Every job which changes the store is
+// committed before it is answered. Returns false for stop.
+bool do_job(Manifest &manifest, const std::string &line, std::string &reply) {
+    std::vector<std::string> words = ControlConnection::split(line, 3);
+    char buffer[256];
+    if (words.empty()) {
+        reply = "ERROR empty job";
+    } else if (words[0] == "backup" && words.size() >= 2) {
+        std::string path = line.substr(words[0].size() + 1);
+        if (path[0] != '/') {
+            reply = "ERROR " + path + " is not an absolute path";
+            return true;
+        }
+        if (access(path.data(), R_OK) || !FileOperator::size(path)) {
+            reply = "ERROR can not read " + path + " or it is empty";
+            return true;
+        }
+        printf("Service Task: backup %s\n", path.data());
+        do_version(manifest, path);
+        printf("------------------------Retention----------------------\n");
+        do_retention(manifest);
+        do_commit(manifest, true);
+        sprintf(buffer, "OK version %lu", TotalVersion);
+        reply = buffer;
+    } else if (words[0] == "restore" && words.size() == 3) {
+        uint64_t version = strtoull(words[1].data(), nullptr, 10);
+        if (version < 1 || version > TotalVersion) {
+            sprintf(buffer, "ERROR version %s is not in 1 ~ %lu", words[1].data(), TotalVersion);
+            reply = buffer;
+            return true;
+        }
+        if (words[2][0] != '/') {
+            reply = "ERROR " + words[2] + " is not an absolute path";
+            return true;
+        }
+        printf("Service Task: restore %lu to %s\n", version, words[2].data());
+        uint64_t size = do_restore(version, manifest.ArrangementFallBehind, words[2]);
+        sprintf(buffer, "OK restored %lu bytes", size);
+        reply = buffer;
+    } else if (words[0] == "delete" && words.size() == 1) {
+        if (manifest.ArrangementFallBehind) {
+            sprintf(buffer, "ERROR arrangement falls %lu versions behind", manifest.ArrangementFallBehind);
+        } else if (TotalVersion <= 1) {
+            sprintf(buffer, "ERROR only %lu versions exist", TotalVersion);
+        } else {
+            do_delete();
+            do_commit(manifest, true);
+            sprintf(buffer, "OK %lu versions left", TotalVersion);
+        }
+        reply = buffer;
+    } else if (words[0] == "status" && words.size() == 1) {
+        sprintf(buffer, "OK versions:%lu behind:%lu segment files:%lu", TotalVersion, manifest.ArrangementFallBehind,
+                GlobalCatalogPtr->getObjectCount());
+        reply = buffer;
+    } else if (words[0] == "stop" && words.size() == 1) {
+        reply = "OK stopping";
+        return false;
+    } else {
+        reply = "ERROR unknown job: " + line;
+    }
+    return true;
+}
+
+// Keeps the index and the pipelines in memory and takes jobs on FLAGS_SocketPath until a stop job
+// arrives, so a small backup does not pay for loading and saving the whole index.
+int do_serve(Manifest &manifest) {
+    ControlServer server(FLAGS_SocketPath);
+    if (!server.ok()) {
+        return -1;
+    }
+    printf("Serving on %s\n", FLAGS_SocketPath.data());
+    bool running = true;
+    while (running) {
+        ControlConnection connection = server.accept();
+        std::string line, reply;
+        if (!connection.ok()) {
+            continue;
+        }
+        if (!connection.readLine(line)) {
+            printf("[Service] a client sent no job\n");
+            continue;
+        }
+        struct timeval t0, t1;
+        gettimeofday(&t0, NULL);
+        running = do_job(manifest, line, reply);
+        gettimeofday(&t1, NULL);
+        printf("[Service] %s -> %s in %lu us\n", line.data(), reply.data(),
+               (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+        fflush(stdout);
+        connection.writeLine(reply);
+    }
+    return 0;
+}
+
+#endif //MEGA_SERVICE_H
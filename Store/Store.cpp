@@ -0,0 +1,143 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#include "Workflow.h"
+#include "Store.h"
+
+// the state a Store sets up is process-wide, see Store.h
+static bool StoreOpen = false;
+
+Store::Store(const std::string &configFile) {
+    if (StoreOpen) {
+        printf("[Store] another store is open in this process\n");
+        return;
+    }
+    StoreOpen = true;
+    manifest = new Manifest();
+    open_storage(configFile, *manifest);
+    if (start_pipelines()) {
+        stop_pipelines();
+        close_storage();
+        delete manifest;
+        manifest = nullptr;
+        StoreOpen = false;
+    }
+}
+
+Store::~Store() {
+    if (!manifest) {
+        return;
+    }
+    stop_pipelines();
+    close_storage();
+    delete manifest;
+    StoreOpen = false;
+}
+
+bool Store::ok() const {
+    return manifest != nullptr;
+}
+
+// Streams are passed through a file in the working path, one block at a time.
+static const uint64_t StreamBlockSize = 1024 * 1024;
+
+static std::string streamPath(const char *name) {
+    return HomePath + "/" + name;
+}
+
+uint64_t Store::backup(std::istream &stream, uint64_t length) {
+    // an input without data would never reach the end of the pipelines
+    if (!manifest || !length) {
+        return 0;
+    }
+    // the whole stream is spooled before the backup starts, so one which ends early does not
+    // leave a truncated version behind
+    std::string path = streamPath("backupStream");
+    uint64_t readLength = 0;
+    {
+        FileOperator file((char *) path.data(), FileOpenType::Write);
+        if (!file.ok()) {
+            return 0;
+        }
+        std::vector<char> block(StreamBlockSize);
+        while (readLength < length && stream) {
+            stream.read(block.data(), std::min(StreamBlockSize, length - readLength));
+            uint64_t r = stream.gcount();
+            if (file.write((uint8_t *) block.data(), r) != r) {
+                break;
+            }
+            readLength += r;
+        }
+    }
+    if (readLength != length) {
+        printf("[Store] the stream ended after %lu of %lu bytes, nothing is backed up\n", readLength, length);
+        ::remove(path.data());
+        return 0;
+    }
+    uint64_t version = backup(path);
+    ::remove(path.data());
+    return version;
+}
+
+uint64_t Store::backup(const std::string &path) {
+    if (!manifest || !FileOperator::size(path)) {
+        return 0;
+    }
+    do_version(*manifest, path);
+    printf("------------------------Retention----------------------\n");
+    do_retention(*manifest);
+    do_commit(*manifest, true);
+    return TotalVersion;
+}
+
+uint64_t Store::restore(uint64_t version, const std::string &path) {
+    if (!manifest || version < 1 || version > TotalVersion) {
+        return 0;
+    }
+    return do_restore(version, manifest->ArrangementFallBehind, path);
+}
+
+uint64_t Store::restore(uint64_t version, std::ostream &sink) {
+    std::string path = streamPath("restoreStream");
+    uint64_t length = restore(version, path);
+    uint64_t written = 0;
+    if (length) {
+        FileOperator file((char *) path.data(), FileOpenType::Read);
+        std::vector<char> block(StreamBlockSize);
+        while (written < length && sink) {
+            uint64_t r = file.read((uint8_t *) block.data(), std::min(StreamBlockSize, length - written));
+            if (!r || !sink.write(block.data(), r)) {
+                break;
+            }
+            written += r;
+        }
+    }
+    ::remove(path.data());
+    if (written != length) {
+        printf("[Store] %lu of %lu bytes went to the sink\n", written, length);
+        return 0;
+    }
+    return length;
+}
+
+int Store::remove() {
+    if (!manifest || manifest->ArrangementFallBehind || TotalVersion <= 1) {
+        return -1;
+    }
+    do_delete();
+    do_commit(*manifest, true);
+    return 0;
+}
+
+uint64_t Store::versions() const {
+    return TotalVersion;
+}
+
+uint64_t Store::arrangementFallBehind() const {
+    return manifest ? manifest->ArrangementFallBehind : 0;
+}
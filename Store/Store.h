@@ -0,0 +1,70 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_STORE_H
+#define MEGA_STORE_H
+
+#include <string>
+#include <istream>
+#include <ostream>
+#include <cstdint>
+
+struct Manifest;
+
+// The interface of libmega, to back up into and restore from a store in process. A Store runs
+// the same workflows as ./MeGA --task=write and --task=restore, the options of ./MeGA --help
+// apply through gflags::SetCommandLineOption() before it is opened.
+//
+// A Store is a facade over the process-wide state of MeGA, i.e. the Global*Ptr pipelines, the
+// index, TotalVersion, the configured paths and the gflags such as --ApplyArrangement and
+// --delta. It sets them up when it is opened and tears them down when it is destroyed, but does
+// not own copies of its own. So only one Store can be open in a process at a time, another one
+// stays !ok() until the first is destroyed, and one whose index can not be loaded stays !ok()
+// too. Calls are not to be made concurrently.
+class Store {
+public:
+    // Opens the store described by a config file like build/config.toml.
+    explicit Store(const std::string &configFile);
+
+    ~Store();
+
+    Store(const Store &) = delete;
+
+    Store &operator=(const Store &) = delete;
+
+    bool ok() const;
+
+    // Backs up length bytes of the stream as the next version. The version is arranged, expired
+    // versions are deleted and the store is committed before it returns the number of the new
+    // version. The stream is first copied block by block to a file in the working path, a stream
+    // which ends before length bytes is not backed up and 0 is returned.
+    uint64_t backup(std::istream &stream, uint64_t length);
+
+    // Like the above for a file. The memory held of the input is bounded by --ReadAheadWindow.
+    uint64_t backup(const std::string &path);
+
+    // Restores a version, 1 ~ versions(), into a file and returns the bytes restored.
+    uint64_t restore(uint64_t version, const std::string &path);
+
+    // Restores a version into the sink. Chunks are restored out of order and deltas read their
+    // bases back, so the version is restored into a file in the working path first and then
+    // copied block by block. 0 is returned if the sink fails.
+    uint64_t restore(uint64_t version, std::ostream &sink);
+
+    // Deletes the earliest version, -1 if arrangement falls behind or only one version is left.
+    int remove();
+
+    uint64_t versions() const;
+
+    uint64_t arrangementFallBehind() const;
+
+private:
+    Manifest *manifest = nullptr;
+};
+
+#endif //MEGA_STORE_H
@@ -0,0 +1,298 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+
+#ifndef MEGA_WORKFLOW_H
+#define MEGA_WORKFLOW_H
+
+#include "../DedupPipeline/ReadFilePipeline.h"
+#include "../RestorePipeline/RestoreReadPipeline.h"
+#include "../DedupPipeline/Eliminator.h"
+#include "gflags/gflags.h"
+#include "../Utility/Config.h"
+#include "../Utility/Manifest.h"
+#include "../ArrangementPipeline/ArrangementReadPipeline.h"
+
+// The workflows of a store shared by the command line (main.cpp) and libmega (Store.cpp). Each of
+// them includes this header once and so defines the configuration below.
+
+DEFINE_bool(ApplyArrangement,
+            true, "arrange right after the backup, otherwise the arrangement is deferred to --task=arrange");
+DEFINE_bool(delta, true, "whether delta compression");
+
+std::string LogicFilePath;
+std::string ClassFilePath;
+std::string VersionFilePath;
+std::string ManifestPath;
+std::string HomePath;
+std::string ClassFileAppendPath;
+std::string DictionaryPath;
+std::string SegmentObjectPath;
+std::string CatalogPath;
+std::string PendingIndexPath;
+uint64_t TotalVersion;
+uint64_t RetentionTime;
+int ActiveCompressionLevel;
+int ArchivedCompressionLevel;
+uint64_t ArrangementBandwidth;
+uint64_t ArrangementIOPS;
+bool ArrangementIdleIO;
+std::string KVPath;
+bool DeltaSwitch;
+
+// Reads the configuration and the manifest, and opens what every task needs.
+void open_storage(const std::string &configFile, Manifest &manifest) {
+    DeltaSwitch = FLAGS_delta;
+    {
+        ConfigReader configReader(configFile);
+        ManifestReader manifestReader(&manifest);
+        TotalVersion = manifest.TotalVersion;
+    }
+    GlobalDictionaryStorePtr = new DictionaryStore();
+    GlobalIOThrottlePtr = new IOThrottle();
+    GlobalCatalogPtr = new Catalog();
+}
+
+void close_storage() {
+    delete GlobalCatalogPtr;
+    delete GlobalIOThrottlePtr;
+    delete GlobalDictionaryStorePtr;
+    GlobalCatalogPtr = nullptr;
+    GlobalIOThrottlePtr = nullptr;
+    GlobalDictionaryStorePtr = nullptr;
+}
+
+// The pipelines of backup and arrangement, and the index they work on. Fails if the index can not
+// be loaded, the pipelines are stopped by stop_pipelines() all the same.
+int start_pipelines() {
+    GlobalReadPipelinePtr = new ReadFilePipeline();
+    GlobalChunkingPipelinePtr = new ChunkingPipeline();
+    GlobalHashingPipelinePtr = new HashingPipeline();
+    GlobalDeduplicationPipelinePtr = new DeduplicationPipeline();
+    GlobalWriteFilePipelinePtr = new WriteFilePipeline();
+    GlobalMetadataManagerPtr = new MetadataManager();
+    GlobalArrangementReadPipelinePtr = new ArrangementReadPipeline();
+
+    if (TotalVersion != 0)
+        return GlobalMetadataManagerPtr->load();
+    return 0;
+}
+
+void stop_pipelines() {
+    delete GlobalArrangementReadPipelinePtr;
+    delete GlobalReadPipelinePtr;
+    delete GlobalChunkingPipelinePtr;
+    delete GlobalHashingPipelinePtr;
+    delete GlobalDeduplicationPipelinePtr;
+    delete GlobalWriteFilePipelinePtr;
+    delete GlobalMetadataManagerPtr;
+}
+
+// The input is the file at storageTask.path.
+uint64_t  do_backup(StorageTask &storageTask){
+    CountdownLatch countdownLatch(5); // there are 5 pipelines in the workflow of write.
+    storageTask.countdownLatch = &countdownLatch;
+    storageTask.fileID = TotalVersion;
+    GlobalReadPipelinePtr->addTask(&storageTask);
+    countdownLatch.wait();
+    storageTask.destruction();
+    return storageTask.length;
+}
+
+uint64_t do_restore(uint64_t version, uint64_t fallBehind, const std::string &restorePath) {
+  struct timeval t0, t1;
+
+  if (version == -1) version = TotalVersion;
+
+  char recipePath[256];
+  sprintf(recipePath, LogicFilePath.data(), version);
+  CountdownLatch countdownLatch(1);
+
+  RestoreTask restoreTask = {
+          TotalVersion,
+          version,
+          fallBehind
+  };
+
+    GlobalRestoreReadPipelinePtr = new RestoreReadPipeline();
+    GlobalRestoreDecomPipelinePtr = new RestoreDecomPipeline();
+    GlobalRestoreWritePipelinePtr = new RestoreWritePipeline(restorePath, &countdownLatch);  // order is important.
+    GlobalRestoreParserPipelinePtr = new RestoreParserPipeline(version, recipePath);  // order is important.
+
+    gettimeofday(&t0, NULL);
+    GlobalRestoreReadPipelinePtr->addTask(&restoreTask);
+    countdownLatch.wait();
+    gettimeofday(&t1, NULL);
+    uint64_t duration = (t1.tv_sec-t0.tv_sec)*1000000 + (t1.tv_usec-t0.tv_usec);
+    uint64_t totalSize = GlobalRestoreWritePipelinePtr->getTotalSize();
+    printf("Total duration : %lu, speed : %f MB/s\n", duration, (float)totalSize / duration);
+
+    delete GlobalRestoreReadPipelinePtr;
+    delete GlobalRestoreDecomPipelinePtr;
+    delete GlobalRestoreParserPipelinePtr;
+    delete GlobalRestoreWritePipelinePtr;
+
+    return totalSize;
+}
+
+void do_arrangement(uint64_t version){
+    printf("Arrangement Task: Version %lu\n", version);
+    CountdownLatch arrangementLatch(1);
+    ArrangementTask arrangementTask = {
+            version, &arrangementLatch,
+    };
+    GlobalArrangementReadPipelinePtr->addTask(&arrangementTask);
+    arrangementLatch.wait();
+}
+
+void do_delete(){
+    printf("------------------------Deleting----------------------\n");
+    printf("%lu versions exist, delete the earliest version\n", TotalVersion);
+    printf("Delete Task..\n");
+    Eliminator eliminator;
+    eliminator.run(TotalVersion);
+    TotalVersion--;
+}
+
+// Everything the manifest refers to has to be durable before the manifest commits it. The index
+// is left out while a catch-up is half way, it keeps describing the latest version.
+void do_commit(Manifest &manifest, bool saveIndex) {
+    if (saveIndex) {
+        GlobalMetadataManagerPtr->save();
+    }
+    GlobalCatalogPtr->save();
+    manifest.TotalVersion = TotalVersion;
+    ManifestWriter manifestWriter(manifest);
+}
+
+// Runs the deferred arrangements from the earliest on, each with the references the backup of
+// the following version kept. Every pass is committed, an interrupted catch-up resumes there.
+int do_catch_up(Manifest &manifest) {
+    while (manifest.ArrangementFallBehind) {
+        uint64_t version = TotalVersion - manifest.ArrangementFallBehind + 1;
+        if (GlobalMetadataManagerPtr->loadPendingIndex(version)) {
+            return -1;
+        }
+        struct timeval t0, t1;
+        gettimeofday(&t0, NULL);
+        do_arrangement(version - 1);
+        gettimeofday(&t1, NULL);
+        printf("Arrangement duration : %lu\n", (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+        manifest.ArrangementFallBehind--;
+        do_commit(manifest, manifest.ArrangementFallBehind == 0);
+        MetadataManager::removePendingIndex(version);
+    }
+    return 0;
+}
+
+// Deleting a version renumbers the categories of the arranged layout, so expired versions wait
+// until arrangement has caught up.
+void do_retention(const Manifest &manifest) {
+    if (TotalVersion <= RetentionTime) {
+        printf("Only %lu versions exist, and the retention is %lu, deletion is not required.\n", TotalVersion,
+               RetentionTime);
+    } else if (manifest.ArrangementFallBehind) {
+        printf("Deletion waits for arrangement, which falls %lu versions behind.\n",
+               manifest.ArrangementFallBehind);
+    } else {
+        while (TotalVersion > RetentionTime) {
+            do_delete();
+        }
+    }
+}
+
+// An arrangement a batch leaves running while it backs up the next version, whose deduplication
+// waits for the tables to be rolled, see DeduplicationPipeline::setArrangementGate().
+struct OverlappedArrangement {
+    CountdownLatch latch{0};
+    ArrangementTask task;
+    struct timeval startTime;
+
+    void start(uint64_t version) {
+        latch.setCount(1);
+        task = {version, &latch};
+        gettimeofday(&startTime, NULL);
+        GlobalDeduplicationPipelinePtr->setArrangementGate(&latch);
+        GlobalArrangementReadPipelinePtr->addTask(&task);
+    }
+
+    void wait() {
+        if (!task.countdownLatch) {
+            return;
+        }
+        latch.wait();
+        task.countdownLatch = nullptr;
+        struct timeval t1;
+        gettimeofday(&t1, NULL);
+        printf("Arrangement duration : %lu, overlapped with the next backup\n",
+               (t1.tv_sec - startTime.tv_sec) * 1000000 + t1.tv_usec - startTime.tv_usec);
+    }
+};
+
+// Backs up the next version and arranges it, or defers the arrangement. Retention and the commit
+// of the version are left to the caller. With overlap the arrangement is only started, the caller
+// waits for it before anything else touches the index or the layout.
+void do_version(Manifest &manifest, StorageTask &input, OverlappedArrangement *overlap = nullptr) {
+    TotalVersion++;
+    printf("-----------------------Backing up-----------------------\n");
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+
+    uint64_t taskLength = do_backup(input);
+
+    gettimeofday(&t1, NULL);
+    uint64_t singleDedup = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+    printf("[CheckPoint:main] InitTime:%lu, EndTime:%lu\n", t0.tv_sec * 1000000 + t0.tv_usec,
+           t1.tv_sec * 1000000 + t1.tv_usec);
+    printf("Backup duration:%lu us, Backup Size:%lu, Speed:%fMB/s\n", singleDedup, taskLength,
+           (float) taskLength / singleDedup);
+    GlobalReadPipelinePtr->getStatistics();
+    GlobalChunkingPipelinePtr->getStatistics();
+    GlobalHashingPipelinePtr->getStatistics();
+    GlobalDeduplicationPipelinePtr->getStatistics();
+    GlobalWriteFilePipelinePtr->getStatistics();
+    printf("BackupSize:%lu, AfterDedup:%lu, AfterDelta:%lu, AfterCompression:%lu, Total Reduction Ratio:%f\n",
+           GlobalMetadataManagerPtr->getTotalLength(),
+           GlobalMetadataManagerPtr->getAfterDedup(),
+           GlobalMetadataManagerPtr->getAfterDelta(),
+           GlobalMetadataManagerPtr->getAfterCompression(),
+           (float) (GlobalMetadataManagerPtr->getTotalLength()) /
+           (GlobalMetadataManagerPtr->getAfterCompression()));
+
+    printf("----------------------Arrangement------------------------\n");
+    if (overlap) {
+        // the backup waited for it already, unless it had nothing to deduplicate
+        overlap->wait();
+    }
+    if (FLAGS_ApplyArrangement && !manifest.ArrangementFallBehind && overlap) {
+        overlap->start(TotalVersion - 1);
+    } else if (FLAGS_ApplyArrangement && !manifest.ArrangementFallBehind) {
+        gettimeofday(&t0, NULL);
+        do_arrangement(TotalVersion - 1);
+        gettimeofday(&t1, NULL);
+        printf("Arrangement duration : %lu\n", (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+    } else {
+        GlobalMetadataManagerPtr->deferArrangement(TotalVersion);
+        manifest.ArrangementFallBehind++;
+        if (FLAGS_ApplyArrangement) {
+            // the new version is committed first, the passes of the catch-up only commit the layout
+            do_commit(manifest, true);
+            do_catch_up(manifest);
+        } else {
+            printf("Arrangement is deferred by user, %lu versions behind.\n", manifest.ArrangementFallBehind);
+        }
+    }
+}
+
+void do_version(Manifest &manifest, const std::string &path, OverlappedArrangement *overlap = nullptr) {
+    StorageTask input;
+    input.path = path;
+    do_version(manifest, input, overlap);
+}
+
+#endif //MEGA_WORKFLOW_H
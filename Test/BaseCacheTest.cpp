@@ -0,0 +1,129 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#include "TestHome.h"
+
+const uint64_t ChunkLength = 4096;
+
+// Writes the containers of Active_Cat(1,2), the bases of version 3.
+void writeBases(const std::vector<std::vector<uint64_t>> &containers) {
+    ContainerEncoder encoder;
+    SegmentWriter writer(ClassFilePath, 1, 2);
+    std::vector<uint8_t> compressed(ContainerSize);
+    for (const auto &chunks: containers) {
+        std::vector<uint8_t> records;
+        for (uint64_t id: chunks) {
+            appendRecord(records, id, ChunkLength);
+        }
+        uint64_t length = encoder.compress(compressed.data(), compressed.size(), records.data(), records.size(), 1);
+        writer.append(compressed.data(), length, chunks.size());
+    }
+}
+
+BasePos basePos(uint64_t cid, uint64_t id) {
+    BasePos pos;
+    pos.sha1Fp = testFP(id);
+    pos.CategoryOrder = 1;
+    pos.cid = cid;
+    pos.length = ChunkLength;
+    pos.valid = 1;
+    return pos;
+}
+
+void checkResident(BaseCache &cache, uint64_t cid, uint64_t id) {
+    BasePos pos = basePos(cid, id);
+    BlockEntry entry;
+    CHECK(cache.getRecord(&pos, &entry));
+    CHECK(entry.length == ChunkLength);
+    for (uint64_t i = 0; i < ChunkLength; i++) {
+        CHECK(entry.block[i] == (uint8_t) id);
+    }
+}
+
+// Chunk 2 is in two base containers. Evicting the one which indexed it first must leave it
+// resident in the other one.
+void testSharedChunk() {
+    gflags::FlagSaver flagSaver;
+    writeBases({{1, 2}, {2, 3}, {4}});
+    FLAGS_CacheSize = 1;    // the minimum of two slabs
+    BaseCache cache;
+    cache.setCurrentVersion(3);
+
+    BasePos pos = basePos(0, 1);
+    cache.loadBaseChunks(pos);
+    pos = basePos(1, 3);
+    cache.loadBaseChunks(pos);
+    checkResident(cache, 1, 3);
+
+    // evicts container 0, which indexed chunk 2 first
+    pos = basePos(2, 4);
+    cache.loadBaseChunks(pos);
+    pos = basePos(0, 1);
+    CHECK(cache.residency(pos) == 0);
+    checkResident(cache, 1, 2);
+    checkResident(cache, 1, 3);
+
+    // the batch lookup of the dedup pipeline does not load anything for a resident chunk
+    BasePos candidates[6];
+    memset(candidates, 0, sizeof(candidates));
+    candidates[0] = basePos(1, 2);
+    BlockEntry entry;
+    BasePos selected;
+    uint64_t loads = cache.getLoadCalls();
+    CHECK(cache.getRecordBatch(candidates, 1, &entry, &selected));
+    CHECK(cache.getLoadCalls() == loads);
+
+    // the hits promoted container 1, so container 2 goes
+    pos = basePos(0, 1);
+    cache.loadBaseChunks(pos);
+    pos = basePos(2, 4);
+    CHECK(cache.residency(pos) == 0);
+    checkResident(cache, 0, 1);
+    checkResident(cache, 1, 2);
+    checkResident(cache, 1, 3);
+}
+
+// With sub-blocks of one chunk each a container has more sub-blocks than fit into the low bits
+// of a container key, the compressed tier must still tell those of two containers apart.
+void testCompressedTier() {
+    std::vector<uint64_t> first, second;
+    for (uint64_t i = 0; i < 2000; i++) {
+        first.push_back(i + 1);
+        second.push_back(i + 10001);
+    }
+    gflags::FlagSaver flagSaver;
+    FLAGS_ContainerSubBlockSize = MinContainerSubBlockSize;
+    writeBases({first, second, {20001}});
+    FLAGS_CacheSize = 1;
+    FLAGS_CompressedCacheSize = 256;
+    BaseCache cache;
+    cache.setCurrentVersion(3);
+
+    // each load evicts the container loaded two steps before, the second round finds the
+    // directories and sub-blocks of containers 0 and 1 in the compressed tier
+    for (uint64_t round = 0; round < 2; round++) {
+        BasePos pos = basePos(0, 1501);
+        cache.loadBaseChunks(pos);
+        checkResident(cache, 0, 1501);
+        pos = basePos(1, 10477);
+        cache.loadBaseChunks(pos);
+        checkResident(cache, 1, 10477);
+        pos = basePos(2, 20001);
+        cache.loadBaseChunks(pos);
+    }
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    std::string home = makeTestHome();
+    testSharedChunk();
+    testCompressedTier();
+    removeTestHome(home);
+    printf("BaseCacheTest passed\n");
+    return 0;
+}
@@ -0,0 +1,145 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#include "TestHome.h"
+
+// Records of chunks between 2 KB and 16 KB. Compressible payloads are made of a few words,
+// incompressible ones of random bytes.
+std::vector<uint8_t> makeRecords(uint64_t count, bool compressible, uint64_t seed) {
+    static const char *words[] = {"mega ", "delta ", "container ", "category ", "version ", "chunk "};
+    std::vector<uint8_t> records;
+    uint64_t state = seed;
+    for (uint64_t id = 1; id <= count; id++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        uint64_t length = 2048 + (state >> 33) % 14336;
+        uint64_t pos = records.size() + sizeof(BlockHeader);
+        appendRecord(records, seed * 100000 + id, length);
+        for (uint64_t i = 0; i < length; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            records[pos + i] = compressible ? words[(state >> 40) % 6][i % 5] : (uint8_t) (state >> 56);
+        }
+    }
+    return records;
+}
+
+// Encodes the records, checks that the container decompresses as a whole and sub-block by
+// sub-block to the same bytes, and that the directory lists every record.
+void roundTrip(const std::vector<uint8_t> &records, uint32_t dictID, bool expectRaw) {
+    std::vector<uint8_t> source(records);   // compress() takes a mutable buffer
+    std::vector<uint8_t> container(records.size() * 2 + 65536);
+    ContainerEncoder encoder;
+    uint64_t length = encoder.compress(container.data(), container.size(), source.data(), source.size(), 3, dictID);
+    CHECK(encoder.isRaw() == expectRaw);
+
+    std::vector<uint8_t> decompressed(records.size());
+    size_t r = decompressContainer(decompressed.data(), decompressed.size(), container.data(), length);
+    CHECK(!ZSTD_isError(r) && r == records.size());
+    CHECK(decompressed == records);
+
+    ContainerDirectory directory;
+    CHECK(readContainerDirectory(container.data(), length, directory));
+    CHECK(directory.rawLength == records.size());
+    CHECK(directory.codec == (expectRaw ? ContainerCodecRaw : ContainerCodecZstd));
+    CHECK(directory.subBlocks.size() > 1);
+
+    uint64_t rawEnd = 0;
+    for (uint64_t i = 0; i < directory.subBlocks.size(); i++) {
+        const ContainerSubBlock &subBlock = directory.subBlocks[i];
+        CHECK(subBlock.rawOffset == rawEnd);
+        rawEnd += subBlock.rawLength;
+        std::vector<uint8_t> part(subBlock.rawLength);
+        if (expectRaw) {
+            CHECK(subBlock.compressedLength == subBlock.rawLength);
+            memcpy(part.data(), container.data() + subBlock.compressedOffset, subBlock.rawLength);
+        } else {
+            r = decompressFrames(part.data(), part.size(), container.data() + subBlock.compressedOffset,
+                                 subBlock.compressedLength);
+            CHECK(!ZSTD_isError(r) && r == subBlock.rawLength);
+        }
+        CHECK(!memcmp(part.data(), records.data() + subBlock.rawOffset, subBlock.rawLength));
+    }
+    CHECK(rawEnd == records.size());
+
+    // a sub-block is only larger than --ContainerSubBlockSize if it holds a single record
+    std::vector<uint64_t> recordsPerSubBlock(directory.subBlocks.size(), 0);
+    uint64_t pos = 0;
+    for (const auto &entry: directory.entries) {
+        recordsPerSubBlock[entry.subBlock]++;
+        const BlockHeader *header = (const BlockHeader *) (records.data() + pos);
+        CHECK(entry.rawOffset == pos);
+        CHECK(entry.header.length == header->length);
+        CHECK(TupleEqualer()(entry.header.fp, header->fp));
+        const ContainerSubBlock &subBlock = directory.subBlocks[entry.subBlock];
+        CHECK(pos >= subBlock.rawOffset && pos + sizeof(BlockHeader) + header->length <=
+                                           subBlock.rawOffset + subBlock.rawLength);
+        pos += sizeof(BlockHeader) + header->length;
+    }
+    CHECK(pos == records.size());
+    for (uint64_t i = 0; i < directory.subBlocks.size(); i++) {
+        CHECK(recordsPerSubBlock[i] == 1 || directory.subBlocks[i].rawLength <= FLAGS_ContainerSubBlockSize);
+    }
+}
+
+void testSubBlockSizes() {
+    gflags::FlagSaver flagSaver;
+    std::vector<uint8_t> records = makeRecords(600, true, 1);
+    for (uint64_t subBlockSize: {MinContainerSubBlockSize, (uint64_t) 65536, (uint64_t) 262144}) {
+        FLAGS_ContainerSubBlockSize = subBlockSize;
+        roundTrip(records, 0, false);
+    }
+}
+
+void testIncompressible() {
+    roundTrip(makeRecords(200, false, 2), 0, true);
+}
+
+void testDictionary() {
+    std::vector<uint8_t> records = makeRecords(600, true, 3);
+    uint32_t dictID = GlobalDictionaryStorePtr->train(records.data(), records.size());
+    CHECK(dictID);
+    roundTrip(records, dictID, false);
+    // a store opened later, as after a restart, loads the dictionary from its file
+    delete GlobalDictionaryStorePtr;
+    GlobalDictionaryStorePtr = new DictionaryStore();
+    std::vector<uint8_t> container(records.size() * 2);
+    ContainerEncoder encoder;
+    uint64_t length = encoder.compress(container.data(), container.size(), records.data(), records.size(), 3,
+                                       dictID);
+    delete GlobalDictionaryStorePtr;
+    GlobalDictionaryStorePtr = new DictionaryStore();
+    std::vector<uint8_t> decompressed(records.size());
+    size_t r = decompressContainer(decompressed.data(), decompressed.size(), container.data(), length);
+    CHECK(!ZSTD_isError(r) && r == records.size());
+    CHECK(decompressed == records);
+}
+
+// A v1 container is a single zstd frame without directory.
+void testVersion1() {
+    std::vector<uint8_t> records = makeRecords(100, true, 4);
+    std::vector<uint8_t> container(ZSTD_compressBound(records.size()));
+    size_t length = ZSTD_compress(container.data(), container.size(), records.data(), records.size(), 3);
+    CHECK(!ZSTD_isError(length));
+    ContainerDirectory directory;
+    CHECK(!readContainerDirectory(container.data(), length, directory));
+    std::vector<uint8_t> decompressed(records.size());
+    size_t r = decompressContainer(decompressed.data(), decompressed.size(), container.data(), length);
+    CHECK(r == records.size());
+    CHECK(decompressed == records);
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    std::string home = makeTestHome();
+    testSubBlockSizes();
+    testIncompressible();
+    testDictionary();
+    testVersion1();
+    removeTestHome(home);
+    printf("ContainerFormatTest passed\n");
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#include <thread>
+#include "TestHome.h"
+#include "../Store/Service.h"
+
+std::string ask(const std::string &job) {
+    ControlConnection connection = ControlConnection::connectTo(FLAGS_SocketPath);
+    CHECK(connection.ok());
+    std::string reply;
+    CHECK(connection.writeLine(job));
+    CHECK(connection.readLine(reply));
+    return reply;
+}
+
+bool startsWith(const std::string &s, const std::string &prefix) {
+    return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+// A version of 64 blocks of 64 KB, some of them repeated. The seed changes a few blocks.
+std::vector<uint8_t> makeVersion(uint64_t seed) {
+    std::vector<uint8_t> data(64 * 65536);
+    for (uint64_t block = 0; block < 64; block++) {
+        uint64_t state = block % 16 == 3 ? block + seed * 1000 : block % 48;
+        for (uint64_t i = 0; i < 65536; i++) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            data[block * 65536 + i] = (uint8_t) (state >> 56);
+        }
+    }
+    return data;
+}
+
+std::string writeFile(const std::string &path, const std::vector<uint8_t> &data) {
+    FileOperator file((char *) path.data(), FileOpenType::Write);
+    CHECK(file.write((uint8_t *) data.data(), data.size()) == data.size());
+    return path;
+}
+
+std::vector<uint8_t> readFile(const std::string &path) {
+    std::vector<uint8_t> data(FileOperator::size(path));
+    FileOperator file((char *) path.data(), FileOpenType::Read);
+    CHECK(file.read(data.data(), data.size()) == data.size());
+    return data;
+}
+
+void testSplit() {
+    typedef std::vector<std::string> Words;
+    CHECK(ControlConnection::split("", 3).empty());
+    CHECK(ControlConnection::split("status", 3) == Words({"status"}));
+    CHECK(ControlConnection::split("restore 2 /a b/c", 3) == Words({"restore", "2", "/a b/c"}));
+    CHECK(ControlConnection::split("backup /a b", 2) == Words({"backup", "/a b"}));
+    CHECK(ControlConnection::split("delete ", 3) == Words({"delete"}));
+}
+
+// A stale socket is replaced, a live one or a file which is no socket is left alone.
+void testSocketFile(const std::string &home) {
+    std::string path = home + "/takeover.sock";
+    writeFile(path, {'x'});
+    {
+        ControlServer server(path);
+        CHECK(!server.ok());
+    }
+    CHECK(FileOperator::size(path) == 1);
+    CHECK(!remove(path.data()));
+
+    // what a server killed without unlinking its socket leaves behind
+    sockaddr_un address;
+    CHECK(ControlConnection::fillAddress(path, address));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(!bind(fd, (sockaddr *) &address, sizeof(sockaddr_un)));
+    close(fd);
+    {
+        ControlServer server(path);
+        CHECK(server.ok());
+        ControlServer second(path);
+        CHECK(!second.ok());
+        CHECK(ControlConnection::connectTo(path).ok());
+    }
+    CHECK(access(path.data(), F_OK));
+}
+
+// Runs the jobs against a server in another thread, as MeGAClient sends them.
+void testJobs(Manifest &manifest, const std::string &home) {
+    FLAGS_SocketPath = home + "/MeGA.sock";
+    start_pipelines();
+    std::thread serving([&manifest]() { do_serve(manifest); });
+    // the socket exists once the server listens
+    while (!ControlConnection::connectTo(FLAGS_SocketPath).ok()) {
+        usleep(10000);
+    }
+
+    CHECK(ask("status") == "OK versions:0 behind:0 segment files:0");
+    CHECK(startsWith(ask("backup version1"), "ERROR"));
+    CHECK(startsWith(ask("backup " + home + "/missing"), "ERROR"));
+    CHECK(startsWith(ask("delete"), "ERROR"));
+    CHECK(startsWith(ask("restore 1 " + home + "/out"), "ERROR"));
+
+    std::vector<uint8_t> version1 = makeVersion(1), version2 = makeVersion(2);
+    CHECK(ask("backup " + writeFile(home + "/version 1", version1)) == "OK version 1");
+    CHECK(ask("backup " + writeFile(home + "/version2", version2)) == "OK version 2");
+    CHECK(startsWith(ask("status"), "OK versions:2 behind:0"));
+
+    // a client which goes away without sending a job does not stop the server
+    CHECK(ControlConnection::connectTo(FLAGS_SocketPath).ok());
+
+    CHECK(startsWith(ask("restore 3 " + home + "/out"), "ERROR"));
+    CHECK(startsWith(ask("restore 1 out"), "ERROR"));
+    CHECK(ask("restore 1 " + home + "/restored 1") == "OK restored " + std::to_string(version1.size()) + " bytes");
+    CHECK(readFile(home + "/restored 1") == version1);
+    CHECK(ask("restore 2 " + home + "/restored2") == "OK restored " + std::to_string(version2.size()) + " bytes");
+    CHECK(readFile(home + "/restored2") == version2);
+
+    CHECK(ask("delete") == "OK 1 versions left");
+    CHECK(ask("restore 1 " + home + "/restored3") == "OK restored " + std::to_string(version2.size()) + " bytes");
+    CHECK(readFile(home + "/restored3") == version2);
+    CHECK(startsWith(ask("delete"), "ERROR"));
+    CHECK(startsWith(ask("backup"), "ERROR"));
+    CHECK(startsWith(ask("compact"), "ERROR"));
+
+    CHECK(ask("stop") == "OK stopping");
+    serving.join();
+    CHECK(access(FLAGS_SocketPath.data(), F_OK));
+    stop_pipelines();
+
+    // the jobs were committed before they were answered
+    Manifest reloaded;
+    ManifestReader manifestReader(&reloaded);
+    CHECK(reloaded.TotalVersion == 1);
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    Manifest manifest;
+    std::string home = makeTestHome(manifest);
+    testSplit();
+    testSocketFile(home);
+    testJobs(manifest, home);
+    removeTestHome(home);
+    printf("ControlSocketTest passed\n");
+    return 0;
+}
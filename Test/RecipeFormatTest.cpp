@@ -0,0 +1,155 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#include "TestHome.h"
+
+// Every fifth record is a delta chunk.
+BlockHeader makeRecord(uint64_t id) {
+    BlockHeader header;
+    memset(&header, 0, sizeof(BlockHeader));
+    header.fp = testFP(id);
+    header.length = 1000 + id % 7000;
+    if (id % 5 == 0) {
+        header.type = 1;
+        header.baseFP = testFP(id + 1000000);
+        header.oriLength = header.length * 3;
+    }
+    return header;
+}
+
+void writeRecipe(uint64_t version, const std::vector<uint64_t> &ids, bool delta) {
+    RecipeWriter writer(recipePath(version), delta ? version - 1 : 0);
+    for (uint64_t id: ids) {
+        writer.add(makeRecord(id));
+    }
+}
+
+// Returns the depth of the recipe.
+uint64_t checkRecipe(uint64_t version, const std::vector<uint64_t> &ids) {
+    RecipeReader reader(recipePath(version), version);
+    CHECK(reader.getChunkCount() == ids.size());
+    uint64_t logicalSize = 0;
+    BlockHeader header;
+    for (uint64_t id: ids) {
+        CHECK(reader.next(&header));
+        BlockHeader expected = makeRecord(id);
+        CHECK(sameRecord(header, expected));
+        logicalSize += expected.type ? expected.oriLength : expected.length;
+    }
+    CHECK(!reader.next(&header));
+    CHECK(reader.getLogicalSize() == logicalSize);
+    return reader.getDepth();
+}
+
+// Each version drops some chunks of the last one, changes a few, and inserts new ones, some of
+// them in front of chunks it keeps.
+std::vector<uint64_t> nextVersion(const std::vector<uint64_t> &ids, uint64_t version) {
+    std::vector<uint64_t> next;
+    for (uint64_t i = 0; i < ids.size(); i++) {
+        if (i % 97 == version) continue;
+        if (i % 131 == version * 3) {
+            next.push_back(version * 100000 + i);
+            continue;
+        }
+        if (i % 211 == version) {
+            next.push_back(version * 200000 + i);
+        }
+        next.push_back(ids[i]);
+    }
+    // a block moved to the front
+    std::rotate(next.begin(), next.begin() + next.size() / 3, next.begin() + next.size() / 2);
+    return next;
+}
+
+void testFull() {
+    gflags::FlagSaver flagSaver;
+    FLAGS_RecipeBlockRecords = 7;
+    std::vector<uint64_t> ids = idRange(1, 1000);
+    writeRecipe(1, ids, false);
+    CHECK(checkRecipe(1, ids) == 0);
+    writeRecipe(1, {}, false);
+    CHECK(checkRecipe(1, {}) == 0);
+}
+
+// Delta recipes decode through their chain, a chain longer than --RecipeDeltaChain starts over
+// with a full recipe.
+void testDeltaChain() {
+    gflags::FlagSaver flagSaver;
+    FLAGS_RecipeBlockRecords = 64;
+    FLAGS_RecipeDeltaChain = 3;
+    std::vector<std::vector<uint64_t>> versions = {{}, idRange(1, 5000)};
+    writeRecipe(1, versions[1], false);
+    for (uint64_t version = 2; version <= 6; version++) {
+        versions.push_back(nextVersion(versions.back(), version));
+        writeRecipe(version, versions[version], true);
+    }
+    uint64_t expectedDepth[] = {0, 0, 1, 2, 3, 0, 1};
+    for (uint64_t version = 1; version <= 6; version++) {
+        CHECK(checkRecipe(version, versions[version]) == expectedDepth[version]);
+    }
+}
+
+// What Eliminator::run() does with the recipes when version 1 of 4 is deleted: version 2 is
+// materialized, the recipes are renumbered, and the delta recipes behind keep resolving.
+void testDeletion() {
+    gflags::FlagSaver flagSaver;
+    FLAGS_RecipeBlockRecords = 64;
+    std::vector<std::vector<uint64_t>> versions = {{}, idRange(1, 3000)};
+    writeRecipe(1, versions[1], false);
+    for (uint64_t version = 2; version <= 4; version++) {
+        versions.push_back(nextVersion(versions.back(), version));
+        writeRecipe(version, versions[version], true);
+    }
+    materializeRecipe(2);
+    CHECK(checkRecipe(2, versions[2]) == 0);
+    CHECK(!remove(recipePath(1).data()));
+    for (uint64_t version = 2; version <= 4; version++) {
+        CHECK(!rename(recipePath(version).data(), recipePath(version - 1).data()));
+    }
+    // the depths written before stay, they only bound the chains now
+    CHECK(checkRecipe(1, versions[2]) == 0);
+    CHECK(checkRecipe(2, versions[3]) == 2);
+    CHECK(checkRecipe(3, versions[4]) == 3);
+
+    // materializing a full recipe leaves it alone
+    materializeRecipe(1);
+    CHECK(checkRecipe(1, versions[2]) == 0);
+}
+
+// A v1 recipe is a flat array of BlockHeaders.
+void testVersion1() {
+    std::vector<uint64_t> ids = idRange(1, 100);
+    {
+        FileOperator file((char *) recipePath(1).data(), FileOpenType::Write);
+        for (uint64_t id: ids) {
+            BlockHeader header = makeRecord(id);
+            file.write((uint8_t *) &header, sizeof(BlockHeader));
+        }
+    }
+    RecipeReader reader(recipePath(1), 1);
+    CHECK(reader.getChunkCount() == ids.size());
+    CHECK(reader.getLogicalSize() == 0);
+    BlockHeader header;
+    for (uint64_t id: ids) {
+        CHECK(reader.next(&header));
+        CHECK(sameRecord(header, makeRecord(id)));
+    }
+    CHECK(!reader.next(&header));
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    std::string home = makeTestHome();
+    testFull();
+    testDeltaChain();
+    testDeletion();
+    testVersion1();
+    removeTestHome(home);
+    printf("RecipeFormatTest passed\n");
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#include "TestHome.h"
+
+const uint64_t TestContainerLength = 300 * 1024;
+
+// The bytes of a test container tell which one it is.
+std::vector<uint8_t> makeContainer(uint64_t tag) {
+    std::vector<uint8_t> container(TestContainerLength - tag % 1000);
+    for (uint64_t i = 0; i < container.size(); i++) {
+        container[i] = (uint8_t) (tag * 31 + i / 4096);
+    }
+    return container;
+}
+
+void writeGroup(const std::string &groupTemplate, uint64_t a, uint64_t b, const std::vector<uint64_t> &tags) {
+    SegmentWriter writer(groupTemplate, a, b);
+    for (uint64_t tag: tags) {
+        std::vector<uint8_t> container = makeContainer(tag);
+        CHECK(writer.append(container.data(), container.size(), (uint32_t) tag) < tags.size());
+    }
+}
+
+void checkGroup(const std::string &groupTemplate, uint64_t a, uint64_t b, const std::vector<uint64_t> &tags) {
+    SegmentReader reader(groupTemplate, a, b);
+    CHECK(reader.count() == tags.size());
+    std::vector<uint8_t> buffer(TestContainerLength);
+    for (uint64_t i = 0; i < tags.size(); i++) {
+        std::vector<uint8_t> expected = makeContainer(tags[i]);
+        CHECK(reader.length(i) == expected.size());
+        CHECK(reader.chunkCount(i) == tags[i]);
+        CHECK(reader.read(i, buffer.data(), buffer.size()) == expected.size());
+        CHECK(!memcmp(buffer.data(), expected.data(), expected.size()));
+        // a range in the middle
+        uint8_t middle[100];
+        CHECK(reader.pread(i, 5000, middle, sizeof(middle)) == sizeof(middle));
+        CHECK(!memcmp(middle, expected.data() + 5000, sizeof(middle)));
+    }
+}
+
+bool objectExists(uint64_t objectID) {
+    return access(Catalog::objectPath(objectID).data(), F_OK) == 0;
+}
+
+void reopenCatalog() {
+    CHECK(!GlobalCatalogPtr->save());
+    delete GlobalCatalogPtr;
+    GlobalCatalogPtr = new Catalog();
+}
+
+// A group spans several segment objects, its containers are readable before the writer closes it,
+// and after the catalog is saved and loaded again.
+void testObjects() {
+    gflags::FlagSaver flagSaver;
+    FLAGS_SegmentSize = 1;
+    std::vector<uint64_t> tags = idRange(1, 12);
+    {
+        SegmentWriter writer(ClassFilePath, 1, 1);
+        for (uint64_t i = 0; i < tags.size(); i++) {
+            std::vector<uint8_t> container = makeContainer(tags[i]);
+            CHECK(writer.append(container.data(), container.size(), (uint32_t) tags[i]) == i);
+            checkGroup(ClassFilePath, 1, 1, std::vector<uint64_t>(tags.begin(), tags.begin() + i + 1));
+        }
+    }
+    checkGroup(ClassFilePath, 1, 1, tags);
+    CHECK(GlobalCatalogPtr->getObjectCount() >= 4);
+    reopenCatalog();
+    checkGroup(ClassFilePath, 1, 1, tags);
+    SegmentReader::remove(ClassFilePath, 1, 1);
+    reopenCatalog();
+    CHECK(GlobalCatalogPtr->getObjectCount() == 0);
+}
+
+// The renames of Eliminator::run() when version 1 of 3 is deleted: categories 1 and 2 and the
+// append group of category 1 are joined, category 3 becomes category 2.
+void testDeletionMoves() {
+    writeGroup(ClassFilePath, 1, 3, idRange(100, 3));
+    writeGroup(ClassFileAppendPath, 1, 3, idRange(200, 2));
+    writeGroup(ClassFilePath, 2, 3, idRange(300, 4));
+    writeGroup(ClassFilePath, 3, 3, idRange(400, 2));
+    reopenCatalog();
+
+    SegmentReader::move(ClassFilePath, 1, 3, ClassFilePath, 1, 2);
+    SegmentReader::move(ClassFileAppendPath, 1, 3, ClassFilePath, 1, 2);
+    SegmentReader::move(ClassFilePath, 2, 3, ClassFileAppendPath, 1, 2);
+    SegmentReader::move(ClassFilePath, 3, 3, ClassFilePath, 2, 2);
+
+    std::vector<uint64_t> first = idRange(100, 3);
+    std::vector<uint64_t> append = idRange(200, 2);
+    first.insert(first.end(), append.begin(), append.end());
+    checkGroup(ClassFilePath, 1, 2, first);
+    checkGroup(ClassFileAppendPath, 1, 2, idRange(300, 4));
+    checkGroup(ClassFilePath, 2, 2, idRange(400, 2));
+    CHECK(SegmentReader(ClassFilePath, 1, 3).count() == 0);
+    CHECK(SegmentReader(ClassFilePath, 3, 3).count() == 0);
+
+    // nothing was released, so every object survives the save
+    uint64_t objects = GlobalCatalogPtr->getObjectCount();
+    reopenCatalog();
+    CHECK(GlobalCatalogPtr->getObjectCount() == objects);
+    checkGroup(ClassFilePath, 1, 2, first);
+    checkGroup(ClassFileAppendPath, 1, 2, idRange(300, 4));
+    checkGroup(ClassFilePath, 2, 2, idRange(400, 2));
+
+    SegmentReader::remove(ClassFilePath, 1, 2);
+    SegmentReader::remove(ClassFileAppendPath, 1, 2);
+    SegmentReader::remove(ClassFilePath, 2, 2);
+    reopenCatalog();
+}
+
+// A container adopted by another group keeps its object alive after its own group is released.
+void testAdopt() {
+    writeGroup(ClassFilePath, 1, 4, idRange(500, 3));
+    reopenCatalog();
+    uint64_t objectID, indexInObject;
+    {
+        SegmentReader source(ClassFilePath, 1, 4);
+        source.locateObject(1, objectID, indexInObject);
+        SegmentWriter writer(VersionFilePath, 1, 4);
+        std::vector<uint8_t> container = makeContainer(600);
+        writer.append(container.data(), container.size(), 600);
+        CHECK(writer.adopt(objectID, indexInObject, 501) == 1);
+    }
+    checkGroup(VersionFilePath, 1, 4, {600, 501});
+
+    SegmentReader::remove(ClassFilePath, 1, 4);
+    reopenCatalog();
+    CHECK(objectExists(objectID));
+    checkGroup(VersionFilePath, 1, 4, {600, 501});
+
+    SegmentReader::remove(VersionFilePath, 1, 4);
+    reopenCatalog();
+    CHECK(!objectExists(objectID));
+    CHECK(GlobalCatalogPtr->getObjectCount() == 0);
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    std::string home = makeTestHome();
+    testObjects();
+    testDeletionMoves();
+    testAdopt();
+    removeTestHome(home);
+    printf("SegmentFileTest passed\n");
+    return 0;
+}
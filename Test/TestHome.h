@@ -0,0 +1,81 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_TESTHOME_H
+#define MEGA_TESTHOME_H
+
+// Shared by the tests in this directory, each of them is a program which returns 0 on success.
+// They include the workflows like main.cpp does, so they get the same globals and flags.
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include "../Store/Workflow.h"
+
+// Unlike assert(), also checks in a release build.
+#define CHECK(condition)                                                                    \
+    do {                                                                                    \
+        if (!(condition)) {                                                                 \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);            \
+            exit(1);                                                                        \
+        }                                                                                   \
+    } while (0)
+
+// Opens a store in an empty scratch home like main.cpp does, with the configuration written to
+// <home>/config.toml.
+std::string makeTestHome(Manifest &manifest) {
+    char pathBuffer[] = "/tmp/MeGATestXXXXXX";
+    CHECK(mkdtemp(pathBuffer));
+    std::string path = pathBuffer;
+    CHECK(!mkdir((path + "/logicFiles").data(), 0755));
+    CHECK(!mkdir((path + "/storageFiles").data(), 0755));
+    std::string configFile = path + "/config.toml";
+    FILE *config = fopen(configFile.data(), "w");
+    CHECK(config);
+    fprintf(config, "path = \"%s\"\nretention = 100\n", path.data());
+    fclose(config);
+    open_storage(configFile, manifest);
+    return path;
+}
+
+std::string makeTestHome() {
+    static Manifest manifest;
+    return makeTestHome(manifest);
+}
+
+void removeTestHome(const std::string &path) {
+    close_storage();
+    // KVPath is next to the home, see ConfigReader
+    std::string command = "rm -rf " + path + " " + KVPath;
+    CHECK(!system(command.data()));
+}
+
+SHA1FP testFP(uint64_t id) {
+    SHA1FP fp = {id, (uint32_t) id, 0, 0};
+    return fp;
+}
+
+std::vector<uint64_t> idRange(uint64_t first, uint64_t count) {
+    std::vector<uint64_t> ids;
+    for (uint64_t i = 0; i < count; i++) {
+        ids.push_back(first + i);
+    }
+    return ids;
+}
+
+// Appends a chunk record whose payload repeats the low byte of its id.
+void appendRecord(std::vector<uint8_t> &records, uint64_t id, uint64_t length) {
+    BlockHeader header;
+    memset(&header, 0, sizeof(BlockHeader));
+    header.fp = testFP(id);
+    header.length = length;
+    uint64_t pos = records.size();
+    records.resize(pos + sizeof(BlockHeader) + length, (uint8_t) id);
+    memcpy(records.data() + pos, &header, sizeof(BlockHeader));
+}
+
+#endif //MEGA_TESTHOME_H
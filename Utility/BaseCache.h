@@ -10,10 +10,29 @@
 #define MEGA_BASECACHE_H
 
 #include <unordered_map>
+#include <unordered_set>
 #include <map>
+#include <list>
+#include <vector>
+#include <memory>
+#include "ContainerFormat.h"
+#include "SegmentFile.h"
+
+static bool validateCacheProtectedRatio(const char *flag, uint64_t value) {
+    if (value > 100) {
+        printf("--%s is a percentage\n", flag);
+        return false;
+    }
+    return true;
+}
 
 DEFINE_uint64(CacheSize,
-              128, "Cache Size");
+              128, "Base cache memory budget, in containers");
+DEFINE_uint64(CacheProtectedRatio,
+              80, "Percentage of base cache slabs that the protected segment may hold");
+DEFINE_validator(CacheProtectedRatio, &validateCacheProtectedRatio);
+DEFINE_uint64(CompressedCacheSize,
+              0, "Memory budget of the compressed base cache tier, in MB (0 disables it)");
 
 extern std::string ClassFileAppendPath;
 extern uint64_t ContainerSize;
@@ -62,25 +81,190 @@ private:
     std::unordered_map<SHA1FP, BlockEntry, TupleHasher, TupleEqualer> cacheMap;
 };
 
-uint64_t threshold = FLAGS_CacheSize * ContainerSize;
+// A whole decompressed container held in one slab of PreloadSize bytes.
+struct CacheSlot {
+    uint8_t *slab = nullptr;
+    uint64_t used = 0;
+    uint64_t score = 0;
+    bool isProtected = false;
+    std::list<uint64_t>::iterator lruIter;
+    std::vector<SHA1FP> fps;
+
+    // v2 containers are loaded sub-block by sub-block
+    bool partial = false;
+    std::shared_ptr<SegmentReader> segment;
+    uint64_t index = 0;
+    ContainerDirectory directory;
+    std::vector<bool> loadedSubBlocks;
+
+    // a container of the running backup which is not written yet lends its buffer as slab
+    ContainerPtr container;
+};
+
+struct ChunkLocation {
+    uint64_t key;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// An entry of the compressed tier is a whole container, the directory frame of a v2 container or
+// one of its sub-blocks.
+struct CompressedKey {
+    uint64_t container;     // BaseCache::containerKey()
+    uint64_t part;          // the sub-block, or one of the parts below
+
+    bool operator==(const CompressedKey &other) const {
+        return container == other.container && part == other.part;
+    }
+};
+
+const uint64_t WholeContainerPart = UINT64_MAX;
+const uint64_t DirectoryPart = UINT64_MAX - 1;
+
+struct CompressedKeyHasher {
+    std::size_t operator()(const CompressedKey &key) const {
+        return std::hash<uint64_t>()(key.container ^ (key.part * 0x9e3779b97f4a7c15ULL));
+    }
+};
+
+// Second cache tier holding containers in their compressed on-disk form. A hit costs a
+// decompression but no I/O, and the tier holds several times more containers than the
+// decompressed tier in the same memory.
+class CompressedContainerCache {
+public:
+    void init(uint64_t cap) {
+        capacity = cap;
+    }
+
+    bool enabled() const {
+        return capacity != 0;
+    }
+
+    int get(const CompressedKey &key, uint8_t **buffer, uint64_t *length) {
+        lookups++;
+        auto iter = entryMap.find(key);
+        if (iter == entryMap.end()) {
+            return 0;
+        }
+        hits++;
+        lruList.splice(lruList.begin(), lruList, iter->second.lruIter);
+        *buffer = iter->second.buffer;
+        *length = iter->second.length;
+        return 1;
+    }
+
+    void add(const CompressedKey &key, uint8_t *buffer, uint64_t length) {
+        if (length > capacity || entryMap.find(key) != entryMap.end()) {
+            return;
+        }
+        while (used + length > capacity) {
+            evict();
+        }
+        uint8_t *copy = (uint8_t *) malloc(length);
+        memcpy(copy, buffer, length);
+        lruList.push_front(key);
+        entryMap[key] = {copy, length, lruList.begin()};
+        used += length;
+    }
+
+    // called when the decompressed copy leaves the first tier
+    void refresh(const CompressedKey &key) {
+        auto iter = entryMap.find(key);
+        if (iter != entryMap.end()) {
+            lruList.splice(lruList.begin(), lruList, iter->second.lruIter);
+        }
+    }
+
+    void clear() {
+        for (const auto &entry: entryMap) {
+            free(entry.second.buffer);
+        }
+        entryMap.clear();
+        lruList.clear();
+        used = 0;
+    }
 
+    void statistics() {
+        printf("[CompressedCache] budget:%lu, used:%lu, entries:%lu, hit rate:%f(%lu/%lu), evicted:%lu\n",
+               capacity, used, entryMap.size(), (float) hits / lookups, hits, lookups, evicted);
+    }
+
+    ~CompressedContainerCache() {
+        for (const auto &entry: entryMap) {
+            free(entry.second.buffer);
+        }
+    }
+
+private:
+    struct Entry {
+        uint8_t *buffer;
+        uint64_t length;
+        std::list<CompressedKey>::iterator lruIter;
+    };
+
+    void evict() {
+        CompressedKey key = lruList.back();
+        auto iter = entryMap.find(key);
+        used -= iter->second.length;
+        free(iter->second.buffer);
+        entryMap.erase(iter);
+        lruList.pop_back();
+        evicted++;
+    }
+
+    std::unordered_map<CompressedKey, Entry, CompressedKeyHasher> entryMap;
+    std::list<CompressedKey> lruList;
+    uint64_t capacity = 0;
+    uint64_t used = 0;
+    uint64_t lookups = 0, hits = 0, evicted = 0;
+};
+
+// Containers are cached and evicted as a whole with a segmented LRU:
+// a loaded container enters the probation segment and is promoted to the protected
+// segment after more than UpdateScore hits, so a one-off scan over many containers
+// only cycles through probation and can not flush the hot bases.
 class BaseCache {
 public:
-    BaseCache() : totalSize(0), index(0), cacheMap(65536), write(0), read(0) {
-      preloadBuffer = (uint8_t *) malloc(PreloadSize);
+    BaseCache() : chunkMap(65536), write(0), read(0) {
+      // FLAGS_CacheSize is only valid after the command line has been parsed, which
+      // happens before any pipeline is constructed.
+      budget = FLAGS_CacheSize * ContainerSize;
+      maxSlabs = budget / PreloadSize;
+      if (maxSlabs < 2) maxSlabs = 2;
+      maxProtected = maxSlabs * FLAGS_CacheProtectedRatio / 100;
+      if (maxProtected >= maxSlabs) maxProtected = maxSlabs - 1;
+      compressedCache.init(FLAGS_CompressedCacheSize * 1024 * 1024);
       decompressBuffer = (uint8_t *) malloc(PreloadSize);
     }
 
+    // Arrangement renumbers the containers of every category, and a deletion the categories, so
+    // nothing cached for the last backup can be found by its key any more.
     void setCurrentVersion(uint64_t version) {
+      if (!slotMap.empty() || !segments.empty()) {
+        std::vector<uint64_t> keys;
+        for (const auto &slot: slotMap) {
+          keys.push_back(slot.first);
+        }
+        for (uint64_t key: keys) {
+          evict(key);
+        }
+        segments.clear();
+        pendingBases.clear();
+        compressedCache.clear();
+      }
       currentVersion = version;
     }
 
     ~BaseCache() {
         statistics();
-        free(preloadBuffer);
         free(decompressBuffer);
-        for (const auto &blockEntry: cacheMap) {
-            free(blockEntry.second.block);
+        for (const auto &slot: slotMap) {
+            if (!slot.second.container) {
+                free(slot.second.slab);
+            }
+        }
+        for (auto slab: freeSlabs) {
+            free(slab);
         }
     }
 
@@ -90,95 +274,144 @@ public:
                (float) loadingTime / (access - success));
         printf("hit rate: %f(%lu/%lu)\n", float(success) / access, success, access);
         printf("cache write:%lu, cache read:%lu, prefetching size : %lu\n", write, read, prefetching);
-        printf("total size:%lu, items:%lu\n", totalSize, items);
+        printf("budget:%lu, slabs:%lu(max %lu), resident size:%lu, items:%lu\n", budget, allocatedSlabs, maxSlabs,
+               residentSize, chunkMap.size());
+        printf("probation:%lu, protected:%lu, loaded:%lu, evicted:%lu, promoted:%lu\n", probationList.size(),
+               protectedList.size(), loadedContainers, evictedContainers, promotedContainers);
         printf("self hit:%lu ReadBeforeWrite:%lu\n", selfHit, ReadBeforeWrite);
+        if (compressedCache.enabled()) {
+            compressedCache.statistics();
+        }
+        printf("disk loads:%lu, partial container loads:%lu, sub-blocks decompressed:%lu, raw sub-blocks read:%lu\n",
+               diskLoads, partialLoads, subBlocksRead, rawSubBlocksRead);
     }
 
-    void loadBaseChunks(const BasePos& basePos) {
-        gettimeofday(&t0, NULL);
-        char pathBuffer[256];
-
-        int r = 0;
-        uint64_t decompressSize;
-        uint64_t readSize = 0;
-
-        if (basePos.CategoryOrder == currentVersion) {
-            sprintf(pathBuffer, ClassFilePath.data(), basePos.CategoryOrder, currentVersion, basePos.cid);
-            r = GlobalWriteFilePipelinePtr->getContainer(basePos.CategoryOrder, currentVersion, basePos.cid,
-                                                         preloadBuffer, &readSize);
-            selfHit++;
-        } else if (basePos.CategoryOrder) {
-            sprintf(pathBuffer, ClassFilePath.data(), basePos.CategoryOrder, currentVersion - 1, basePos.cid);
-        } else {
-            sprintf(pathBuffer, ClassFileAppendPath.data(), 1, currentVersion - 1, basePos.cid);
-        }
+    // 32 bits of category and 32 bits of cid.
+    static uint64_t containerKey(uint64_t categoryOrder, uint64_t cid) {
+        return (categoryOrder << 32) | cid;
+    }
 
-        if (r == 0) {
-            FileOperator basefile(pathBuffer, FileOpenType::Read);
-            decompressSize = basefile.read(decompressBuffer, PreloadSize);
-            basefile.releaseBufferedData();
+    // A segment registers the bases it is going to need, so that a partial load of a
+    // v2 container fetches the sub-blocks of all of them at once.
+    void addPendingBase(const BasePos &basePos) {
+        pendingBases[containerKey(basePos.CategoryOrder, basePos.cid)].insert(basePos.sha1Fp);
+    }
 
-            prefetching += decompressSize;
-            readSize = ZSTD_decompress(preloadBuffer, PreloadSize, decompressBuffer, decompressSize);
-            assert(!ZSTD_isError(readSize));
-        } else {
-            ReadBeforeWrite++;
-        }
+    void clearPendingBases() {
+        pendingBases.clear();
+    }
 
-        assert(basePos.length <= readSize);
+    uint64_t getLoadingTime() const {
+        return loadingTime;
+    }
 
-        BlockHeader *headPtr;
+    uint64_t getLoadCalls() const {
+        return loadCalls;
+    }
 
-        uint64_t preLoadPos = 0;
-        uint64_t leftLength = readSize;
+    // Tells how cheap a base is to fetch without touching the cache state:
+    // 2 if the chunk is resident, 1 if its container has a slot (only sub-blocks are missing), 0 otherwise.
+    int residency(const BasePos &basePos) {
+        if (chunkMap.find(basePos.sha1Fp) != chunkMap.end()) {
+            return 2;
+        }
+        if (slotMap.find(containerKey(basePos.CategoryOrder, basePos.cid)) != slotMap.end()) {
+            return 1;
+        }
+        return 0;
+    }
 
-        while (leftLength > sizeof(BlockHeader)) {// todo: min chunksize configured to 2048
-            headPtr = (BlockHeader *) (preloadBuffer + preLoadPos);
-            if (headPtr->length + sizeof(BlockHeader) > leftLength) {
-                break;
-            } else if (!headPtr->type) {
-                addRecord(headPtr->fp, preloadBuffer + preLoadPos + sizeof(BlockHeader),
-                          headPtr->length);
+    void loadBaseChunks(const BasePos& basePos) {
+        gettimeofday(&t0, NULL);
+        loadCalls++;
+
+        uint64_t key = containerKey(basePos.CategoryOrder, basePos.cid);
+        auto iterSlot = slotMap.find(key);
+        if (iterSlot != slotMap.end()) {
+            if (iterSlot->second.partial) {
+                loadSubBlocks(iterSlot->second, key, basePos.sha1Fp);
+            }
+        } else {
+            CacheSlot &slot = allocSlot(key);
+
+            int r = 0;
+            uint64_t readSize = 0;
+
+            if (basePos.CategoryOrder == currentVersion) {
+                ContainerPtr container = GlobalWriteFilePipelinePtr->getContainer(basePos.CategoryOrder,
+                                                                                  currentVersion, basePos.cid);
+                if (container) {
+                    freeSlabs.push_back(slot.slab);
+                    slot.slab = container->buffer;
+                    slot.container = container;
+                    readSize = container->length;
+                    r = 1;
+                }
+                selfHit++;
+            }
+            if (!r) {
+                slot.segment = getSegment(basePos.CategoryOrder, basePos.cid);
+                slot.index = basePos.cid;
             }
 
-            preLoadPos += headPtr->length + sizeof(BlockHeader);
-            if (preLoadPos >= readSize) break;
-            leftLength = readSize - preLoadPos;
+            if (r) {
+                ReadBeforeWrite++;
+                indexContainer(slot, key, readSize);
+            } else if (loadDirectory(slot, key)) {
+                slot.partial = true;
+                partialLoads++;
+                loadSubBlocks(slot, key, basePos.sha1Fp);
+            } else {
+                uint8_t *compressed = nullptr;
+                uint64_t decompressSize;
+                if (compressedCache.enabled() && compressedCache.get({key, WholeContainerPart}, &compressed, &decompressSize)) {
+                    readSize = decompressContainer(slot.slab, PreloadSize, compressed, decompressSize);
+                    assert(!ZSTD_isError(readSize));
+                } else {
+                    decompressSize = slot.segment->read(slot.index, decompressBuffer, PreloadSize);
+
+                    prefetching += decompressSize;
+                    diskLoads++;
+                    readSize = decompressContainer(slot.slab, PreloadSize, decompressBuffer, decompressSize);
+                    assert(!ZSTD_isError(readSize));
+                    if (compressedCache.enabled()) {
+                        compressedCache.add({key, WholeContainerPart}, decompressBuffer, decompressSize);
+                    }
+                }
+                assert(basePos.length <= readSize);
+                indexContainer(slot, key, readSize);
+            }
+            loadedContainers++;
+            insertProbation(slot, key);
         }
-        assert(preLoadPos == readSize);
         gettimeofday(&t1, NULL);
         loadingTime += (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
     }
 
-    void addRecord(const SHA1FP &sha1Fp, uint8_t *buffer, uint64_t length) {
+    // Chunks of the container currently being written are appended to an open slot,
+    // which is pinned until the writer moves on to the next container.
+    void addRecord(uint64_t categoryOrder, uint64_t cid, const SHA1FP &sha1Fp, uint8_t *buffer, uint64_t length) {
         {
-            //MutexLockGuard cacheLockGuard(cacheLock);
-            auto iter = cacheMap.find(sha1Fp);
-            if (iter == cacheMap.end()) {
-                uint8_t *cacheBuffer = (uint8_t *) malloc(length);
-                memcpy(cacheBuffer, buffer, length);
-                cacheMap[sha1Fp] = {
-                        cacheBuffer, length, index,
-                };
-                items++;
-                write += length;
-                {
-                    //MutexLockGuard lruLockGuard(lruLock);
-                    lruList[index] = sha1Fp;
-                    index++;
-                    totalSize += length;
-                  while (totalSize > threshold) {
-                    auto iterLru = lruList.begin();
-                    assert(iterLru != lruList.end());
-                    auto iterCache = cacheMap.find(iterLru->second);
-                    assert(iterCache != cacheMap.end());
-                    totalSize -= iterCache->second.length;
-                    free(iterCache->second.block);
-                    cacheMap.erase(iterCache);
-                    lruList.erase(iterLru);
-                    items--;
-                  }
+            uint64_t key = containerKey(categoryOrder, cid);
+            if (!hasOpenSlot || key != openKey) {
+                sealOpenSlot();
+                auto iterSlot = slotMap.find(key);
+                if (iterSlot != slotMap.end()) {
+                    evict(key);
                 }
+                allocSlot(key);
+                openKey = key;
+                hasOpenSlot = true;
+            }
+            auto iter = chunkMap.find(sha1Fp);
+            if (iter == chunkMap.end()) {
+                CacheSlot &slot = slotMap[openKey];
+                assert(slot.used + length <= PreloadSize);
+                memcpy(slot.slab + slot.used, buffer, length);
+                indexChunk(slot, openKey, sha1Fp, slot.used, length);
+                slot.used += length;
+                residentSize += length;
+                write += length;
             } else {
                 // it should not happen
                 freshLastVisit(iter);
@@ -188,19 +421,18 @@ public:
 
     int getRecordBatch(BasePos *chunks, int count, BlockEntry *cacheBlock, BasePos *selectedBase) {
         {
-            //MutexLockGuard cacheLockGuard(cacheLock);
             access++;
             int vadID = -1;
             for (int i = 0; i < 6; i++) {
                 if (chunks[i].valid) {
                     *selectedBase = chunks[i];
                     vadID = i;
-                    auto iterCache = cacheMap.find(chunks[i].sha1Fp);
-                    if (iterCache == cacheMap.end()) {
+                    auto iterCache = chunkMap.find(chunks[i].sha1Fp);
+                    if (iterCache == chunkMap.end()) {
                         //
                     } else {
                         success++;
-                        *cacheBlock = iterCache->second;
+                        fillBlockEntry(iterCache->second, cacheBlock);
                         read += cacheBlock->length;
                         {
                             freshLastVisit(iterCache);
@@ -210,12 +442,12 @@ public:
                 }
             }
             loadBaseChunks(chunks[vadID]);
-            auto iterCache = cacheMap.find(chunks[vadID].sha1Fp);
-            if (iterCache == cacheMap.end()) {
+            auto iterCache = chunkMap.find(chunks[vadID].sha1Fp);
+            if (iterCache == chunkMap.end()) {
                 printf("id:%d, co:%u\n", vadID, chunks[vadID].CategoryOrder);
             }
-            assert(iterCache != cacheMap.end());
-            *cacheBlock = iterCache->second;
+            assert(iterCache != chunkMap.end());
+            fillBlockEntry(iterCache->second, cacheBlock);
             {
                 freshLastVisit(iterCache);
             }
@@ -225,10 +457,9 @@ public:
 
     int getRecord(const BasePos *basePos, BlockEntry *cacheBlock) {
         {
-            //MutexLockGuard cacheLockGuard(cacheLock);
-            auto iterCache = cacheMap.find(basePos->sha1Fp);
-            if (iterCache != cacheMap.end()) {
-                *cacheBlock = iterCache->second;
+            auto iterCache = chunkMap.find(basePos->sha1Fp);
+            if (iterCache != chunkMap.end()) {
+                fillBlockEntry(iterCache->second, cacheBlock);
                 read += cacheBlock->length;
                 {
                     freshLastVisit(iterCache);
@@ -241,12 +472,11 @@ public:
 
     int getRecordWithoutFresh(const BasePos *basePos, BlockEntry *cacheBlock) {
         {
-            //MutexLockGuard cacheLockGuard(cacheLock);
             access++;
-            auto iterCache = cacheMap.find(basePos->sha1Fp);
-            if (iterCache != cacheMap.end()) {
+            auto iterCache = chunkMap.find(basePos->sha1Fp);
+            if (iterCache != chunkMap.end()) {
                 success++;
-                *cacheBlock = iterCache->second;
+                fillBlockEntry(iterCache->second, cacheBlock);
                 read += cacheBlock->length;
                 return 1;
             }
@@ -256,10 +486,9 @@ public:
 
     int getRecordNoFS(const BasePos *basePos, BlockEntry *cacheBlock) {
         {
-            //MutexLockGuard cacheLockGuard(cacheLock);
-            auto iterCache = cacheMap.find(basePos->sha1Fp);
-            if (iterCache != cacheMap.end()) {
-                *cacheBlock = iterCache->second;
+            auto iterCache = chunkMap.find(basePos->sha1Fp);
+            if (iterCache != chunkMap.end()) {
+                fillBlockEntry(iterCache->second, cacheBlock);
                 read += cacheBlock->length;
                 return 1;
             }
@@ -268,41 +497,346 @@ public:
     }
 
 private:
-    void freshLastVisit(
-            std::unordered_map<SHA1FP, BlockEntry, TupleHasher, TupleEqualer>::iterator iter) {
-        //MutexLockGuard lruLockGuard(lruLock);
-        iter->second.score++;
-        if (iter->second.score > UpdateScore) {
-            iter->second.score = 0;
-            auto iterl = lruList.find(iter->second.lastVisit);
-            lruList[index] = iterl->second;
-            lruList.erase(iterl);
-            iter->second.lastVisit = index;
-            index++;
+    typedef std::unordered_map<SHA1FP, ChunkLocation, TupleHasher, TupleEqualer> ChunkMap;
+
+    // Bases come from Cat.(co, currentVersion - 1), its append group for co == 0, or the category
+    // being written. A reader is reopened when it does not know the container yet.
+    std::shared_ptr<SegmentReader> getSegment(uint64_t categoryOrder, uint64_t cid) {
+        std::pair<uint64_t, uint64_t> group = {categoryOrder, currentVersion};
+        auto iter = segments.find(group);
+        if (iter == segments.end() || iter->second->count() <= cid) {
+            std::shared_ptr<SegmentReader> segment;
+            if (categoryOrder == currentVersion) {
+                segment = std::make_shared<SegmentReader>(ClassFilePath, categoryOrder, currentVersion);
+            } else if (categoryOrder) {
+                segment = std::make_shared<SegmentReader>(ClassFilePath, categoryOrder, currentVersion - 1);
+            } else {
+                segment = std::make_shared<SegmentReader>(ClassFileAppendPath, 1, currentVersion - 1);
+            }
+            assert(cid < segment->count());
+            segments[group] = segment;
+            return segment;
+        }
+        return iter->second;
+    }
+
+    void fillBlockEntry(const ChunkLocation &location, BlockEntry *cacheBlock) {
+        cacheBlock->block = slotMap[location.key].slab + location.offset;
+        cacheBlock->length = location.length;
+    }
+
+    void indexContainer(CacheSlot &slot, uint64_t key, uint64_t readSize) {
+        BlockHeader *headPtr;
+
+        uint64_t preLoadPos = 0;
+        uint64_t leftLength = readSize;
+
+        while (leftLength > sizeof(BlockHeader)) {// todo: min chunksize configured to 2048
+            headPtr = (BlockHeader *) (slot.slab + preLoadPos);
+            if (headPtr->length + sizeof(BlockHeader) > leftLength) {
+                break;
+            } else if (!headPtr->type) {
+                indexChunk(slot, key, headPtr->fp, preLoadPos + sizeof(BlockHeader), headPtr->length);
+            }
+
+            preLoadPos += headPtr->length + sizeof(BlockHeader);
+            if (preLoadPos >= readSize) break;
+            leftLength = readSize - preLoadPos;
+        }
+        assert(preLoadPos == readSize);
+        slot.used = readSize;
+        residentSize += readSize;
+        write += readSize;
+    }
+
+    // Returns 0 for a v1 container, which has to be loaded as a whole.
+    int loadDirectory(CacheSlot &slot, uint64_t key) {
+        uint8_t *frame = nullptr;
+        uint64_t frameLength = 0;
+        if (compressedCache.enabled() && compressedCache.get({key, DirectoryPart}, &frame, &frameLength)) {
+            slot.directory.parseFrame(frame, frameLength);
+        } else {
+            uint64_t containerLength = slot.segment->length(slot.index);
+            ContainerTrailer trailer;
+            if (containerLength >= sizeof(ContainerTrailer)) {
+                slot.segment->pread(slot.index, containerLength - sizeof(ContainerTrailer), (uint8_t *) &trailer,
+                                    sizeof(ContainerTrailer));
+            }
+            frameLength = containerDirectoryFrameLength(trailer, containerLength);
+            if (!frameLength) {
+                return 0;
+            }
+            slot.segment->pread(slot.index, containerLength - frameLength, decompressBuffer, frameLength);
+            prefetching += frameLength;
+            int r = slot.directory.parseFrame(decompressBuffer, frameLength);
+            assert(r);
+            if (compressedCache.enabled()) {
+                compressedCache.add({key, DirectoryPart}, decompressBuffer, frameLength);
+            }
+        }
+        slot.loadedSubBlocks.assign(slot.directory.subBlocks.size(), false);
+        return 1;
+    }
+
+    // Reads and decompresses only the sub-blocks holding the requested base and the
+    // pending bases of the same container.
+    void loadSubBlocks(CacheSlot &slot, uint64_t key, const SHA1FP &sha1Fp) {
+        TupleEqualer equaler;
+        uint64_t count = slot.directory.subBlocks.size();
+        std::vector<bool> wanted(count, false);
+        auto iterPending = pendingBases.find(key);
+        for (const auto &entry: slot.directory.entries) {
+            if (slot.loadedSubBlocks[entry.subBlock] || entry.header.type) continue;
+            if (equaler(entry.header.fp, sha1Fp) ||
+                (iterPending != pendingBases.end() && iterPending->second.count(entry.header.fp))) {
+                wanted[entry.subBlock] = true;
+            }
         }
 
+        if (compressedCache.enabled()) {
+            for (uint64_t i = 0; i < count; i++) {
+                uint8_t *compressed = nullptr;
+                uint64_t compressedLength = 0;
+                if (wanted[i] && compressedCache.get({key, i}, &compressed, &compressedLength)) {
+                    decompressSubBlock(slot, i, compressed, compressedLength);
+                    markSubBlockLoaded(slot, key, i);
+                    wanted[i] = false;
+                }
+            }
+        }
+
+        uint64_t i = 0;
+        while (i < count) {
+            if (!wanted[i]) {
+                i++;
+                continue;
+            }
+            // adjacent sub-blocks are fetched with a single read
+            uint64_t j = i;
+            while (j < count && wanted[j]) j++;
+            const ContainerSubBlock &first = slot.directory.subBlocks[i];
+            const ContainerSubBlock &last = slot.directory.subBlocks[j - 1];
+            uint64_t readLength = last.compressedOffset + last.compressedLength - first.compressedOffset;
+            if (slot.directory.codec == ContainerCodecRaw) {
+                // raw sub-blocks are read straight into the slab
+                slot.segment->pread(slot.index, first.compressedOffset, slot.slab + first.rawOffset, readLength);
+                prefetching += readLength;
+                diskLoads++;
+                for (uint64_t k = i; k < j; k++) {
+                    rawSubBlocksRead++;
+                    markSubBlockLoaded(slot, key, k);
+                }
+                i = j;
+                continue;
+            }
+            slot.segment->pread(slot.index, first.compressedOffset, decompressBuffer, readLength);
+            prefetching += readLength;
+            diskLoads++;
+            for (uint64_t k = i; k < j; k++) {
+                const ContainerSubBlock &subBlock = slot.directory.subBlocks[k];
+                uint8_t *compressed = decompressBuffer + subBlock.compressedOffset - first.compressedOffset;
+                decompressSubBlock(slot, k, compressed, subBlock.compressedLength);
+                markSubBlockLoaded(slot, key, k);
+                if (compressedCache.enabled()) {
+                    compressedCache.add({key, k}, compressed, subBlock.compressedLength);
+                }
+            }
+            i = j;
+        }
+    }
+
+    void decompressSubBlock(CacheSlot &slot, uint64_t index, const uint8_t *compressed, uint64_t compressedLength) {
+        const ContainerSubBlock &subBlock = slot.directory.subBlocks[index];
+        size_t r = decompressFrames(slot.slab + subBlock.rawOffset, subBlock.rawLength, compressed, compressedLength);
+        assert(!ZSTD_isError(r) && r == subBlock.rawLength);
+        subBlocksRead++;
+    }
+
+    void markSubBlockLoaded(CacheSlot &slot, uint64_t key, uint64_t index) {
+        slot.loadedSubBlocks[index] = true;
+        for (const auto &entry: slot.directory.entries) {
+            if (entry.subBlock == index && !entry.header.type) {
+                indexChunk(slot, key, entry.header.fp, entry.rawOffset + sizeof(BlockHeader), entry.header.length);
+            }
+        }
+        uint64_t rawLength = slot.directory.subBlocks[index].rawLength;
+        slot.used += rawLength;
+        residentSize += rawLength;
+        write += rawLength;
+    }
+
+    // A chunk held by several resident containers is served from the one which indexed it first,
+    // the others are kept as spare locations to take over when that one is evicted.
+    void indexChunk(CacheSlot &slot, uint64_t key, const SHA1FP &sha1Fp, uint64_t offset, uint64_t length) {
+        auto result = chunkMap.insert({sha1Fp, {key, offset, length}});
+        if (!result.second) {
+            if (result.first->second.key == key) {
+                return;
+            }
+            spareLocations[sha1Fp].push_back({key, offset, length});
+        }
+        slot.fps.push_back(sha1Fp);
+    }
+
+    void unindexChunk(uint64_t key, const SHA1FP &sha1Fp) {
+        auto iterChunk = chunkMap.find(sha1Fp);
+        if (iterChunk == chunkMap.end()) {
+            return;
+        }
+        auto iterSpare = spareLocations.find(sha1Fp);
+        if (iterSpare == spareLocations.end()) {
+            if (iterChunk->second.key == key) {
+                chunkMap.erase(iterChunk);
+            }
+            return;
+        }
+        std::vector<ChunkLocation> &spares = iterSpare->second;
+        if (iterChunk->second.key == key) {
+            iterChunk->second = spares.back();
+            spares.pop_back();
+        } else {
+            for (auto iter = spares.begin(); iter != spares.end(); iter++) {
+                if (iter->key == key) {
+                    spares.erase(iter);
+                    break;
+                }
+            }
+        }
+        if (spares.empty()) {
+            spareLocations.erase(iterSpare);
+        }
+    }
+
+    void freshLastVisit(ChunkMap::iterator iter) {
+        auto iterSlot = slotMap.find(iter->second.key);
+        assert(iterSlot != slotMap.end());
+        CacheSlot &slot = iterSlot->second;
+        if (hasOpenSlot && iter->second.key == openKey) {
+            return;
+        }
+        if (slot.isProtected) {
+            protectedList.splice(protectedList.begin(), protectedList, slot.lruIter);
+            return;
+        }
+        slot.score++;
+        if (slot.score > UpdateScore) {
+            probationList.erase(slot.lruIter);
+            protectedList.push_front(iter->second.key);
+            slot.lruIter = protectedList.begin();
+            slot.isProtected = true;
+            promotedContainers++;
+            while (protectedList.size() > maxProtected) {
+                uint64_t demoteKey = protectedList.back();
+                protectedList.pop_back();
+                insertProbation(slotMap[demoteKey], demoteKey);
+            }
+        } else {
+            probationList.splice(probationList.begin(), probationList, slot.lruIter);
+        }
+    }
+
+    void insertProbation(CacheSlot &slot, uint64_t key) {
+        probationList.push_front(key);
+        slot.lruIter = probationList.begin();
+        slot.isProtected = false;
+        slot.score = 0;
+    }
+
+    void sealOpenSlot() {
+        if (hasOpenSlot) {
+            insertProbation(slotMap[openKey], openKey);
+            hasOpenSlot = false;
+        }
+    }
+
+    CacheSlot &allocSlot(uint64_t key) {
+        while (allocatedSlabs >= maxSlabs && freeSlabs.empty()) {
+            if (!probationList.empty()) {
+                evict(probationList.back());
+            } else if (!protectedList.empty()) {
+                evict(protectedList.back());
+            } else {
+                break;
+            }
+        }
+        uint8_t *slab;
+        if (!freeSlabs.empty()) {
+            slab = freeSlabs.back();
+            freeSlabs.pop_back();
+        } else {
+            slab = (uint8_t *) malloc(PreloadSize);
+            allocatedSlabs++;
+        }
+        CacheSlot &slot = slotMap[key];
+        slot.slab = slab;
+        slot.used = 0;
+        slot.partial = false;
+        slot.segment.reset();
+        slot.container.reset();
+        slot.fps.clear();
+        return slot;
+    }
+
+    void evict(uint64_t key) {
+        auto iterSlot = slotMap.find(key);
+        assert(iterSlot != slotMap.end());
+        CacheSlot &slot = iterSlot->second;
+        for (const auto &fp: slot.fps) {
+            unindexChunk(key, fp);
+        }
+        if (hasOpenSlot && key == openKey) {
+            hasOpenSlot = false;
+        } else if (slot.isProtected) {
+            protectedList.erase(slot.lruIter);
+        } else {
+            probationList.erase(slot.lruIter);
+        }
+        residentSize -= slot.used;
+        compressedCache.refresh({key, WholeContainerPart});
+        if (!slot.container) {
+            freeSlabs.push_back(slot.slab);
+        }
+        slotMap.erase(iterSlot);
+        evictedContainers++;
     }
 
     struct timeval t0, t1;
-    uint64_t index;
-    uint64_t totalSize;
-    std::unordered_map<SHA1FP, BlockEntry, TupleHasher, TupleEqualer> cacheMap;
-    std::map<uint64_t, SHA1FP> lruList;
-    //MutexLock cacheLock;
-    //MutexLock lruLock;
+    ChunkMap chunkMap;
+    std::unordered_map<SHA1FP, std::vector<ChunkLocation>, TupleHasher, TupleEqualer> spareLocations;
+    std::unordered_map<uint64_t, CacheSlot> slotMap;
+    std::list<uint64_t> probationList;
+    std::list<uint64_t> protectedList;
+    std::vector<uint8_t *> freeSlabs;
+    std::unordered_map<uint64_t, std::unordered_set<SHA1FP, TupleHasher, TupleEqualer>> pendingBases;
+    std::map<std::pair<uint64_t, uint64_t>, std::shared_ptr<SegmentReader>> segments;
+
+    uint64_t budget = 0;
+    uint64_t maxSlabs = 0;
+    uint64_t maxProtected = 0;
+    uint64_t allocatedSlabs = 0;
+    uint64_t residentSize = 0;
+
+    bool hasOpenSlot = false;
+    uint64_t openKey = 0;
+
     uint64_t write, read;
     uint64_t access = 0, success = 0;
     uint64_t loadingTime = 0;
-    uint64_t items = 0;
+    uint64_t loadCalls = 0;
+    uint64_t rawSubBlocksRead = 0;
     uint64_t currentVersion = 0;
     uint64_t selfHit = 0;
 
-    uint8_t *preloadBuffer = nullptr;
     uint8_t *decompressBuffer = nullptr;
 
     uint64_t prefetching = 0;
 
     uint64_t ReadBeforeWrite = 0;
+    uint64_t loadedContainers = 0, evictedContainers = 0, promotedContainers = 0;
+    uint64_t diskLoads = 0;
+    uint64_t partialLoads = 0, subBlocksRead = 0;
+
+    CompressedContainerCache compressedCache;
 };
 
 #endif //MEGA_BASECACHE_H
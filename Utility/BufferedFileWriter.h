@@ -52,6 +52,7 @@ private:
             fileOperator->fdatasync();
             counter = 0;
         }
+        return 0;
     }
 
     uint64_t bufferSize;
@@ -0,0 +1,231 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CATALOG_H
+#define MEGA_CATALOG_H
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <sys/time.h>
+#include "Lock.h"
+#include "FileOperator.h"
+#include "IOThrottle.h"
+
+extern std::string CatalogPath;
+extern std::string SegmentObjectPath;
+extern std::string HomePath;
+
+// The catalog maps the logical groups of containers, i.e. categories and volumes named like
+// "Active_Cat(2,5)", to the segment objects holding them, storageFiles/Segment<objectID>.
+// Object ids are never reused. Renaming a group when a version is deleted, or appending one
+// group to another, only changes the catalog. A part is a range of the containers of an object,
+// so several groups may share an object, e.g. when arrangement relinks a container instead of
+// copying it. Released objects are unlinked once no group refers to them any more and the
+// catalog saying so is durable.
+//
+// Every group also keeps the number of chunks in each of its containers, 0 if unknown.
+//
+// File layout: [CatalogHeader] then per group
+//   [name length][name][part count][CatalogPart..][container count][chunk count (uint32_t)..]
+
+const uint64_t CatalogMagic = 0x32676f6c61746143ULL; // "Catalog2"
+
+struct CatalogPart {
+    uint64_t objectID;
+    uint64_t first;     // first container of the range in the object
+    uint64_t count;     // containers in the range
+};
+
+struct CatalogGroup {
+    std::vector<CatalogPart> parts;
+    std::vector<uint32_t> chunkCounts;
+};
+
+struct CatalogHeader {
+    uint64_t magic;
+    uint64_t nextObjectID;
+    uint64_t groupCount;
+};
+
+class Catalog {
+public:
+    Catalog() {
+        load();
+    }
+
+    static std::string objectPath(uint64_t objectID) {
+        char pathBuffer[256];
+        sprintf(pathBuffer, SegmentObjectPath.data(), objectID);
+        return pathBuffer;
+    }
+
+    uint64_t allocateObject() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        return nextObjectID++;
+    }
+
+    // Registers a group once its writer is done, see SegmentWriter::close().
+    void setGroup(const std::string &group, const CatalogGroup &content) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        groups[group] = content;
+    }
+
+    CatalogGroup getGroup(const std::string &group) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = groups.find(group);
+        return iter == groups.end() ? CatalogGroup() : iter->second;
+    }
+
+    // Drops a group, its objects are unlinked by the next save().
+    void release(const std::string &group) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = groups.find(group);
+        if (iter == groups.end()) return;
+        for (const auto &part: iter->second.parts) {
+            expiredObjects.push_back(part.objectID);
+        }
+        groups.erase(iter);
+    }
+
+    // Appends the containers of group from to group to, which is created if needed.
+    void move(const std::string &from, const std::string &to) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = groups.find(from);
+        if (iter == groups.end()) return;
+        CatalogGroup source = std::move(iter->second);
+        groups.erase(iter);
+        CatalogGroup &target = groups[to];
+        target.parts.insert(target.parts.end(), source.parts.begin(), source.parts.end());
+        target.chunkCounts.insert(target.chunkCounts.end(), source.chunkCounts.begin(), source.chunkCounts.end());
+    }
+
+    // Sealed objects whose data has not been forced to disk yet, see FLAGS_GroupCommit.
+    void addUnsyncedObject(uint64_t objectID) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        unsyncedObjects.push_back(objectID);
+    }
+
+    // Persists the catalog by replacing the old one, then unlinks the released objects. The
+    // objects it lists and their directory entries are made durable first.
+    int save() {
+        syncObjects();
+        MutexLockGuard mutexLockGuard(mutexLock);
+        std::string tempPath = CatalogPath + ".tmp";
+        {
+            FileOperator catalogFile((char *) tempPath.data(), FileOpenType::Write);
+            if (!catalogFile.ok()) {
+                return -1;
+            }
+            CatalogHeader header = {CatalogMagic, nextObjectID, groups.size()};
+            catalogFile.write((uint8_t *) &header, sizeof(CatalogHeader));
+            for (const auto &group: groups) {
+                uint64_t nameLength = group.first.size();
+                uint64_t partCount = group.second.parts.size();
+                uint64_t containerCount = group.second.chunkCounts.size();
+                catalogFile.write((uint8_t *) &nameLength, sizeof(uint64_t));
+                catalogFile.write((uint8_t *) group.first.data(), nameLength);
+                catalogFile.write((uint8_t *) &partCount, sizeof(uint64_t));
+                catalogFile.write((uint8_t *) group.second.parts.data(), partCount * sizeof(CatalogPart));
+                catalogFile.write((uint8_t *) &containerCount, sizeof(uint64_t));
+                catalogFile.write((uint8_t *) group.second.chunkCounts.data(), containerCount * sizeof(uint32_t));
+            }
+            catalogFile.fsync();
+        }
+        rename(tempPath.data(), CatalogPath.data());
+        FileOperator::syncDirectory(HomePath);
+
+        // an object still shared with another group is expired again when that one is released
+        std::set<uint64_t> referenced = referencedObjects();
+        for (uint64_t objectID: expiredObjects) {
+            if (!referenced.count(objectID)) {
+                GlobalIOThrottlePtr->acquire(0);
+                remove(objectPath(objectID).data());
+            }
+        }
+        expiredObjects.clear();
+        return 0;
+    }
+
+    uint64_t getObjectCount() {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        return referencedObjects().size();
+    }
+
+private:
+    std::set<uint64_t> referencedObjects() {
+        std::set<uint64_t> objects;
+        for (const auto &group: groups) {
+            for (const auto &part: group.second.parts) {
+                objects.insert(part.objectID);
+            }
+        }
+        return objects;
+    }
+
+    // The group commit barrier: one flush per object written since the last save, most of the
+    // data is already on disk through the writeback the writers started.
+    void syncObjects() {
+        std::vector<uint64_t> objects;
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            objects.swap(unsyncedObjects);
+        }
+        struct timeval t0, t1;
+        gettimeofday(&t0, NULL);
+        for (uint64_t objectID: objects) {
+            std::string path = objectPath(objectID);
+            FileOperator objectFile((char *) path.data(), FileOpenType::TRY);
+            if (objectFile.ok()) {
+                objectFile.fdatasync();
+            }
+        }
+        FileOperator::syncDirectory(HomePath + "/storageFiles");
+        gettimeofday(&t1, NULL);
+        uint64_t duration = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
+        printf("[GroupCommit] %lu segment files synced in %lu us\n", objects.size(), duration);
+    }
+
+    void load() {
+        FileOperator catalogFile((char *) CatalogPath.data(), FileOpenType::TRY);
+        if (!catalogFile.ok()) {
+            return;
+        }
+        CatalogHeader header;
+        if (catalogFile.read((uint8_t *) &header, sizeof(CatalogHeader)) != sizeof(CatalogHeader) ||
+            header.magic != CatalogMagic) {
+            printf("[Catalog] %s is damaged\n", CatalogPath.data());
+            return;
+        }
+        nextObjectID = header.nextObjectID;
+        for (uint64_t i = 0; i < header.groupCount; i++) {
+            uint64_t nameLength, partCount, containerCount;
+            catalogFile.read((uint8_t *) &nameLength, sizeof(uint64_t));
+            std::string name(nameLength, '\0');
+            catalogFile.read((uint8_t *) &name[0], nameLength);
+            CatalogGroup &group = groups[name];
+            catalogFile.read((uint8_t *) &partCount, sizeof(uint64_t));
+            group.parts.resize(partCount);
+            catalogFile.read((uint8_t *) group.parts.data(), partCount * sizeof(CatalogPart));
+            catalogFile.read((uint8_t *) &containerCount, sizeof(uint64_t));
+            group.chunkCounts.resize(containerCount);
+            catalogFile.read((uint8_t *) group.chunkCounts.data(), containerCount * sizeof(uint32_t));
+        }
+    }
+
+    MutexLock mutexLock;
+    uint64_t nextObjectID = 0;
+    std::map<std::string, CatalogGroup> groups;
+    std::vector<uint64_t> expiredObjects;
+    std::vector<uint64_t> unsyncedObjects;
+};
+
+static Catalog *GlobalCatalogPtr;
+
+#endif //MEGA_CATALOG_H
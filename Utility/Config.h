@@ -11,6 +11,7 @@
 
 #include <string>
 #include <iostream>
+#include <zstd.h>
 #include "toml.hpp"
 
 extern std::string LogicFilePath;
@@ -20,7 +21,16 @@ extern std::string ManifestPath;
 extern std::string KVPath;
 extern std::string HomePath;
 extern std::string ClassFileAppendPath;
+extern std::string DictionaryPath;
+extern std::string SegmentObjectPath;
+extern std::string CatalogPath;
+extern std::string PendingIndexPath;
 extern uint64_t RetentionTime;
+extern int ActiveCompressionLevel;
+extern int ArchivedCompressionLevel;
+extern uint64_t ArrangementBandwidth;
+extern uint64_t ArrangementIOPS;
+extern bool ArrangementIdleIO;
 
 uint64_t ContainerSize = 16 * 1024 * 1024;
 
@@ -30,18 +40,39 @@ public:
       auto data = toml::parse(p);
       std::string path = toml::find<std::string>(data, "path");
       LogicFilePath = path + "/logicFiles/Recipe%lu";
-      ClassFilePath = path + "/storageFiles/Active_Cat(%lu,%lu)Container%lu";
-      VersionFilePath = path + "/storageFiles/Archived_Cat(%lu,%lu)Container%lu";
+      // names of the container groups, the catalog maps them to segment objects
+      ClassFilePath = "Active_Cat(%lu,%lu)";
+      VersionFilePath = "Archived_Cat(%lu,%lu)";
       ManifestPath = path + "/manifest";
       KVPath = path + "kvstore";
       HomePath = path;
-      ClassFileAppendPath = path + "/storageFiles/Active_Cat(%lu,%lu)Append_Container%lu";
+      ClassFileAppendPath = "Active_Cat(%lu,%lu)Append";
+      SegmentObjectPath = path + "/storageFiles/Segment%lu";
+      CatalogPath = path + "/catalog";
+      PendingIndexPath = path + "/pendingIndex%lu";
+      DictionaryPath = path + "/storageFiles/Dictionary%u";
       int64_t rt = toml::find<int64_t>(data, "retention");
       RetentionTime = rt;
+      // active containers are read by every backup and arrangement, archived volumes only by old restores
+      ActiveCompressionLevel = clampLevel(toml::find_or<int64_t>(data, "active_compression_level", 1));
+      ArchivedCompressionLevel = clampLevel(toml::find_or<int64_t>(data, "archived_compression_level", 3));
+      // background I/O of arrangement and deletion, see IOThrottle.h
+      ArrangementBandwidth = toml::find_or<int64_t>(data, "arrangement_bandwidth", 0);
+      ArrangementIOPS = toml::find_or<int64_t>(data, "arrangement_iops", 0);
+      ArrangementIdleIO = toml::find_or<bool>(data, "arrangement_idle_io", false);
       printf("-----------------------Configure-----------------------\n");
       printf("MeGA storage path:%s, RetentionTime:%lu\n", path.data(), rt);
+      printf("Compression level, active:%d, archived:%d\n", ActiveCompressionLevel, ArchivedCompressionLevel);
+      printf("Arrangement I/O limit, bandwidth:%lu MB/s, iops:%lu (0 for none), idle class:%d\n",
+             ArrangementBandwidth, ArrangementIOPS, ArrangementIdleIO);
     }
 private:
+    // negative levels are zstd's fast modes
+    static int clampLevel(int64_t level) {
+      if (level < ZSTD_minCLevel()) return ZSTD_minCLevel();
+      if (level > ZSTD_maxCLevel()) return ZSTD_maxCLevel();
+      return (int) level;
+    }
 };
 
 #endif //MEGA_CONFIG_H
@@ -10,16 +10,25 @@
 #define MEGA_CONTAINERCONSTRUCTOR_H
 
 #include "Likely.h"
+#include "ContainerFormat.h"
+#include "SegmentFile.h"
 #include <zstd.h>
 #include <atomic>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include "gflags/gflags.h"
+
+DEFINE_uint64(CompressionThreads,
+              4, "number of threads compressing the containers of a backup");
 
 extern std::string ClassFilePath;
 extern std::string VersionFilePath;
 extern uint64_t ContainerSize;
+extern int ActiveCompressionLevel;
 uint64_t BufferCapacity = ContainerSize * 1.2;
 
-struct timeval ct0, ct1;
-
 struct WriteBuffer {
     uint64_t totalLength;
     uint64_t used;
@@ -38,18 +47,27 @@ struct WriteBuffer {
         used += len;
     }
 
+    // Only the first used bytes of a buffer are ever read, stale bytes behind them do no harm.
     void clear() {
-        memset(buffer, 0, BufferCapacity);
-        memset(compressBuffer, 0, BufferCapacity);
         used = 0;
     }
 
+    // Hands the filled buffer over to its new owner and starts an empty one.
+    uint8_t *detach() {
+        uint8_t *filled = buffer;
+        buffer = (uint8_t *) malloc(BufferCapacity);
+        used = 0;
+        return filled;
+    }
+
     void release() {
         free(buffer);
         free(compressBuffer);
     }
 };
 
+// The records of a container are immutable once it is handed off. The compressors, the writer
+// and the base cache share the buffer through ContainerPtr, the last reference frees it.
 struct Container {
     Container(uint64_t s, uint64_t e, uint64_t c, uint8_t *b, uint64_t l) {
         lcs = s;
@@ -59,108 +77,71 @@ struct Container {
         length = l;
     }
 
+    ~Container() {
+        free(buffer);
+        free(compressed);
+    }
+
     uint64_t lcs, lce, cid;
     uint8_t *buffer;
     uint64_t length;
-    uint8_t *compressed;
-    uint64_t compressedLength;
-    bool written = false;
+    uint8_t *compressed = nullptr;
+    uint64_t compressedLength = 0;
+    uint32_t dictID = 0;
+    uint32_t chunkCount = 0;
 };
 
-class OfflineReleaser {
-public:
-    OfflineReleaser() : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock) {
-        worker = new std::thread(std::bind(&OfflineReleaser::ReleaserCallback, this));
-    }
+typedef std::shared_ptr<Container> ContainerPtr;
 
-    int addTask(Container *con) {
+// Containers of the running backup which are not written yet, by CID.
+class InFlightContainers {
+public:
+    void add(const ContainerPtr &container) {
         MutexLockGuard mutexLockGuard(mutexLock);
-        taskList.push_back(con);
-        taskAmount++;
+        containers[container->cid] = container;
     }
 
-    int notify() {
-        condition.notify();
-    }
-
-    int getContainer(uint64_t c, uint8_t *buffer, uint64_t *length) {
+    ContainerPtr get(uint64_t cid) {
         MutexLockGuard mutexLockGuard(mutexLock);
-        uint64_t last;
-        for (auto item: taskList) {
-            if (item->cid == c) {
-                memcpy(buffer, item->buffer, item->length);
-                *length = item->length;
-                return 1;
-            }
-            last = item->cid;
-        }
-        return 0;
+        auto iter = containers.find(cid);
+        return iter == containers.end() ? nullptr : iter->second;
     }
 
-    ~OfflineReleaser() {
-        addTask(NULL);
-        notify();
-        worker->join();
+    void remove(uint64_t cid) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        containers.erase(cid);
     }
 
 private:
-    void ReleaserCallback() {
-        pthread_setname_np(pthread_self(), "Releaser");
-        Container *task;
-        while (likely(runningFlag)) {
-            {
-                MutexLockGuard mutexLockGuard(mutexLock);
-                auto iter = taskList.begin();
-                while (iter == taskList.end() || (*iter != NULL && (*iter)->written == false )) {
-                    condition.wait();
-                    iter = taskList.begin();
-                }
-                taskAmount--;
-                task = taskList.front();
-                taskList.pop_front();
-            }
-
-            if (task == NULL) {
-                break;
-            }
-
-            free(task->buffer);
-            free(task->compressed);
-            delete task;
-        }
-    }
-
-    std::thread *worker;
-    bool runningFlag;
-    uint64_t taskAmount;
-    std::list<Container *> taskList;
     MutexLock mutexLock;
-    Condition condition;
+    std::unordered_map<uint64_t, ContainerPtr> containers;
 };
 
 class OfflineWriter {
 public:
-    OfflineWriter(OfflineReleaser *offRls) : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
-                                             offlineReleaser(offRls) {
+    OfflineWriter(InFlightContainers *inFlight) : runningFlag(true), taskAmount(0), mutexLock(),
+                                                  condition(mutexLock), inFlightContainers(inFlight) {
         worker = new std::thread(std::bind(&OfflineWriter::fileFlusherCallback, this));
     }
 
-    int addTask(Container *con) {
+    int addTask(const ContainerPtr &con) {
         MutexLockGuard mutexLockGuard(mutexLock);
         taskList.push_back(con);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~OfflineWriter() {
-        addTask(NULL);
+        addTask(nullptr);
         worker->join();
+        delete segment;
     }
 
 private:
     void fileFlusherCallback() {
         pthread_setname_np(pthread_self(), "Flusher");
-        Container *task;
+        ContainerPtr task;
         while (likely(runningFlag)) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
@@ -174,65 +155,104 @@ private:
                 taskList.pop_front();
             }
 
-            if (task == NULL) {
+            if (!task) {
+                assert(reorderList.empty());
                 break;
             }
 
-            sprintf(pathBuffer, ClassFilePath.data(), task->lcs, task->lce, task->cid);
-            FileOperator *writer = new FileOperator(pathBuffer, FileOpenType::Write);
-            writer->write(task->compressed, task->compressedLength);
-            writer->fsync();
-            writer->releaseBufferedData();
-            delete writer;
-
-            task->written = true;
-            offlineReleaser->notify();
+            // compressors finish out of order, containers are written in CID order
+            reorderList[task->cid] = task;
+            for (auto iter = reorderList.begin(); iter != reorderList.end() && iter->first == nextCID;
+                 iter = reorderList.erase(iter)) {
+                writeContainer(iter->second);
+                nextCID++;
+            }
+        }
+    }
 
+    void writeContainer(const ContainerPtr &task) {
+        if (!segment) {
+            segment = new SegmentWriter(ClassFilePath, task->lcs, task->lce);
         }
+        uint64_t index = segment->append(task->compressed, task->compressedLength, task->chunkCount);
+        assert(index == task->cid);
+
+        // readable from the segment from now on, the base cache may still hold the records
+        free(task->compressed);
+        task->compressed = nullptr;
+        inFlightContainers->remove(task->cid);
     }
 
     std::thread *worker;
-    char pathBuffer[256];
     bool runningFlag;
     uint64_t taskAmount;
-    std::list<Container *> taskList;
+    std::list<ContainerPtr> taskList;
     MutexLock mutexLock;
     Condition condition;
-    OfflineReleaser *offlineReleaser;
+    InFlightContainers *inFlightContainers;
+    std::map<uint64_t, ContainerPtr> reorderList;
+    uint64_t nextCID = 0;
+    SegmentWriter *segment = nullptr;
 };
 
 class OfflineCompressor {
 public:
-    OfflineCompressor(OfflineReleaser *offlineReleaser) : runningFlag(true), taskAmount(0), mutexLock(),
-                                                          condition(mutexLock),
-                                                          offlineWriter(offlineReleaser) {
+    OfflineCompressor(InFlightContainers *inFlight) : runningFlag(true), taskAmount(0), mutexLock(),
+                                                      condition(mutexLock),
+                                                      offlineWriter(inFlight) {
         sizeBeforeCompression = 0;
       sizeAfterCompression = 0;
-      worker = new std::thread(std::bind(&OfflineCompressor::compressCallback, this));
+      workerCount = FLAGS_CompressionThreads ? FLAGS_CompressionThreads : 1;
+      busyTime.assign(workerCount, 0);
+      containerCount.assign(workerCount, 0);
+      gettimeofday(&startTime, NULL);
+      for (uint64_t i = 0; i < workerCount; i++) {
+          workers.push_back(new std::thread(std::bind(&OfflineCompressor::compressCallback, this, i)));
+      }
     }
 
-    int addTask(Container *con) {
+    int addTask(const ContainerPtr &con) {
         MutexLockGuard mutexLockGuard(mutexLock);
         taskList.push_back(con);
         taskAmount++;
         condition.notify();
+        return 0;
     }
 
     ~OfflineCompressor() {
-      printf("[ContainerConstructor] Compression Time : %lu\n", compressionTime);
+      for (uint64_t i = 0; i < workerCount; i++) {
+          addTask(nullptr);
+      }
+      for (auto worker: workers) {
+          worker->join();
+          delete worker;
+      }
+      struct timeval endTime;
+      gettimeofday(&endTime, NULL);
+      uint64_t wallTime = (endTime.tv_sec - startTime.tv_sec) * 1000000 + endTime.tv_usec - startTime.tv_usec;
+      uint64_t compressionTime = 0;
+      for (uint64_t i = 0; i < workerCount; i++) {
+          compressionTime += busyTime[i];
+      }
+      printf("[ContainerConstructor] Compression Time : %lu, threads : %lu, level : %d, stored raw : %lu\n",
+             compressionTime, workerCount, ActiveCompressionLevel, (uint64_t) rawContainers);
+      for (uint64_t i = 0; i < workerCount; i++) {
+          printf("[ContainerConstructor] worker %lu : containers %lu, busy %lu us, utilization %f\n", i,
+                 containerCount[i], busyTime[i], wallTime ? (float) busyTime[i] / wallTime : 0);
+      }
 //        printf("BeforeCompression:%lu, AfterCompression:%lu, CompressionReduce:%lu, CompressionRatio:%f\n",
 //               (uint64_t) sizeBeforeCompression, (uint64_t) sizeAfterCompression,
 //               sizeBeforeCompression - sizeAfterCompression,
 //               (float) sizeBeforeCompression / sizeAfterCompression);
       GlobalMetadataManagerPtr->setAfterCompression(sizeAfterCompression);
-      addTask(NULL);
-      worker->join();
     }
 
 private:
-    void compressCallback() {
+    void compressCallback(uint64_t workerID) {
         pthread_setname_np(pthread_self(), "Cmp");
-        Container *task;
+        ContainerEncoder containerEncoder;
+        ContainerPtr task;
+        struct timeval ct0, ct1;
         while (likely(runningFlag)) {
             {
                 MutexLockGuard mutexLockGuard(mutexLock);
@@ -246,16 +266,20 @@ private:
                 taskList.pop_front();
             }
 
-            if (task == NULL) {
+            if (!task) {
                 break;
             }
 
             uint8_t *compressBuffer = (uint8_t *) malloc(BufferCapacity);
             gettimeofday(&ct0, NULL);
-            size_t compressedSize = ZSTD_compress(compressBuffer, BufferCapacity, task->buffer,
-                                                  task->length, 1);
+            size_t compressedSize = containerEncoder.compress(compressBuffer, BufferCapacity, task->buffer,
+                                                              task->length, ActiveCompressionLevel, task->dictID);
             gettimeofday(&ct1, NULL);
-            compressionTime += (ct1.tv_sec - ct0.tv_sec) * 1000000 + ct1.tv_usec - ct0.tv_usec;
+            busyTime[workerID] += (ct1.tv_sec - ct0.tv_sec) * 1000000 + ct1.tv_usec - ct0.tv_usec;
+            containerCount[workerID]++;
+            if (containerEncoder.isRaw()) {
+                rawContainers++;
+            }
             assert(!ZSTD_isError(compressedSize));
 
             sizeBeforeCompression += task->length;
@@ -268,17 +292,22 @@ private:
         }
     }
 
-    std::thread *worker;
+    std::vector<std::thread *> workers;
+    uint64_t workerCount;
     bool runningFlag;
     uint64_t taskAmount;
-    std::list<Container *> taskList;
+    std::list<ContainerPtr> taskList;
     MutexLock mutexLock;
     Condition condition;
 
     std::atomic<uint64_t> sizeBeforeCompression;
     std::atomic<uint64_t> sizeAfterCompression;
+    std::atomic<uint64_t> rawContainers{0};
 
-    uint64_t compressionTime = 0;
+    // indexed by worker, each worker only touches its own entry
+    std::vector<uint64_t> busyTime;
+    std::vector<uint64_t> containerCount;
+    struct timeval startTime;
 
     OfflineWriter offlineWriter;
 };
@@ -286,23 +315,25 @@ private:
 class ContainerConstructor {
 public:
     ContainerConstructor(uint64_t cv) : runningFlag(true), taskAmount(0), mutexLock(), condition(mutexLock),
-                                        offlineCompressor(&offlineReleaser) {
+                                        offlineCompressor(&inFlightContainers) {
         currentVersion = cv;
 
         writeBuffer.init();
     }
 
-    int getContainer(uint64_t s, uint64_t e, uint64_t c, uint8_t *buffer, uint64_t *length) {
+    // Returns the container if it is not written yet, nullptr otherwise.
+    ContainerPtr getContainer(uint64_t s, uint64_t e, uint64_t c) {
         if (s == currentVersion && e == currentVersion) {
-            return offlineReleaser.getContainer(c, buffer, length);
+            return inFlightContainers.get(c);
         } else {
-            return 0;
+            return nullptr;
         }
     }
 
     int writeClass(uint8_t *header, uint64_t headerLen, uint8_t *buffer, uint64_t bufferLen) {
         writeBuffer.write(header, headerLen);
         writeBuffer.write(buffer, bufferLen);
+        chunkCount++;
 
         if (writeBuffer.used >= writeBuffer.totalLength) {
             flush();
@@ -319,22 +350,69 @@ public:
 private:
 
     int flush() {
-        Container *con = new Container(currentVersion, currentVersion, containerCounter,
-                                       (uint8_t *) malloc(writeBuffer.used), writeBuffer.used);
-        memcpy(con->buffer, writeBuffer.buffer, writeBuffer.used);
+        if (FLAGS_ContainerDictionary && containerCounter == 0) {
+            trainDictionary();
+        }
+        uint64_t length = writeBuffer.used;
+        ContainerPtr con = std::make_shared<Container>(currentVersion, currentVersion, containerCounter,
+                                                       writeBuffer.detach(), length);
+        con->dictID = dictID;
+        con->chunkCount = chunkCount;
+        inFlightContainers.add(con);
         offlineCompressor.addTask(con);
-        offlineReleaser.addTask(con);
+        return 0;
+    }
+
+    // The first container of the version trains the dictionary of the new category. It is then
+    // compressed with and without the dictionary to report the ratio gain and decompression cost.
+    void trainDictionary() {
+        struct timeval t0, t1, t2, t3;
+        gettimeofday(&t0, NULL);
+        dictID = GlobalDictionaryStorePtr->train(writeBuffer.buffer, writeBuffer.used);
+        gettimeofday(&t1, NULL);
+        if (!dictID) {
+            printf("[Dictionary] Cat.(%lu) is compressed without dictionary\n", currentVersion);
+            return;
+        }
+
+        ContainerEncoder encoder;
+        uint8_t *decompressed = (uint8_t *) malloc(BufferCapacity);
+        uint64_t plainSize = encoder.compress(writeBuffer.compressBuffer, BufferCapacity, writeBuffer.buffer,
+                                              writeBuffer.used, ActiveCompressionLevel);
+        gettimeofday(&t2, NULL);
+        decompressContainer(decompressed, BufferCapacity, writeBuffer.compressBuffer, plainSize);
+        gettimeofday(&t3, NULL);
+        uint64_t plainTime = (t3.tv_sec - t2.tv_sec) * 1000000 + t3.tv_usec - t2.tv_usec;
+
+        uint64_t dictionarySize = encoder.compress(writeBuffer.compressBuffer, BufferCapacity, writeBuffer.buffer,
+                                                   writeBuffer.used, ActiveCompressionLevel, dictID);
+        gettimeofday(&t2, NULL);
+        size_t r = decompressContainer(decompressed, BufferCapacity, writeBuffer.compressBuffer, dictionarySize);
+        gettimeofday(&t3, NULL);
+        assert(r == writeBuffer.used && !memcmp(decompressed, writeBuffer.buffer, r));
+        uint64_t dictionaryTime = (t3.tv_sec - t2.tv_sec) * 1000000 + t3.tv_usec - t2.tv_usec;
+        free(decompressed);
+
+        printf("[Dictionary] Cat.(%lu) dictID:%u, training time:%lu us\n", currentVersion, dictID,
+               (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+        printf("[Dictionary] first container %lu bytes, compressed %lu -> %lu bytes (gain %f), decompression %lu -> %lu us\n",
+               writeBuffer.used, plainSize, dictionarySize, (float) plainSize / dictionarySize, plainTime,
+               dictionaryTime);
     }
 
     int prepareNew() {
         containerCounter++;
+        chunkCount = 0;
         writeBuffer.clear();
+        return 0;
     }
 
     WriteBuffer writeBuffer;
     uint64_t currentVersion;
 
     uint64_t containerCounter = 0;
+    uint32_t chunkCount = 0;    // in the container being filled
+    uint32_t dictID = 0;
 
     bool runningFlag;
     uint64_t taskAmount;
@@ -342,7 +420,7 @@ private:
     MutexLock mutexLock;
     Condition condition;
 
-    OfflineReleaser offlineReleaser;
+    InFlightContainers inFlightContainers;
     OfflineCompressor offlineCompressor;
 
 };
@@ -0,0 +1,148 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CONTAINERDICTIONARY_H
+#define MEGA_CONTAINERDICTIONARY_H
+
+#include <zstd.h>
+#include <zdict.h>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include "gflags/gflags.h"
+#include "Lock.h"
+#include "StorageTask.h"
+#include "FileOperator.h"
+
+DEFINE_bool(ContainerDictionary,
+            false, "train a zstd dictionary per category and compress the containers of the category with it");
+DEFINE_uint64(DictionarySize,
+              112640, "maximum size of a trained container dictionary");
+
+extern std::string DictionaryPath;
+
+const uint64_t MinDictionarySize = 4096;
+
+// Dictionaries are trained from the first container of a backup, i.e. of a new category, and stored
+// as storageFiles/Dictionary<dictID>. zstd records the dictID in every frame header, so a reader
+// finds the dictionary of a container from its first frame, no matter how often the category was
+// renamed since. Arrangement keeps compressing a category with the dictionary it was born with.
+class DictionaryStore {
+public:
+    ~DictionaryStore() {
+        for (auto &item: cdicts) {
+            ZSTD_freeCDict(item.second);
+        }
+        for (auto &item: ddicts) {
+            ZSTD_freeDDict(item.second);
+        }
+    }
+
+    // Trains a dictionary from the records of a container and persists it. Returns its dictID,
+    // or 0 if the container is too small or training fails. Small categories get a dictionary of
+    // 1/16 of their size.
+    uint32_t train(const uint8_t *records, uint64_t length) {
+        uint64_t capacity = std::min(FLAGS_DictionarySize, length / 16);
+        if (capacity < MinDictionarySize) {
+            return 0;
+        }
+        std::vector<size_t> sampleSizes;
+        uint64_t pos = 0;
+        while (pos < length) {
+            const BlockHeader *blockHeader = (const BlockHeader *) (records + pos);
+            sampleSizes.push_back(sizeof(BlockHeader) + blockHeader->length);
+            pos += sizeof(BlockHeader) + blockHeader->length;
+        }
+        std::vector<uint8_t> dictionary(capacity);
+        size_t dictionarySize = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(), records,
+                                                      sampleSizes.data(), sampleSizes.size());
+        if (ZDICT_isError(dictionarySize)) {
+            printf("[Dictionary] training failed : %s\n", ZDICT_getErrorName(dictionarySize));
+            return 0;
+        }
+        dictionary.resize(dictionarySize);
+        uint32_t dictID = ZDICT_getDictID(dictionary.data(), dictionarySize);
+
+        char pathBuffer[256];
+        sprintf(pathBuffer, DictionaryPath.data(), dictID);
+        FileOperator dictionaryFile(pathBuffer, FileOpenType::Write);
+        dictionaryFile.write(dictionary.data(), dictionarySize);
+        dictionaryFile.fsync();
+
+        MutexLockGuard mutexLockGuard(mutexLock);
+        dictionaries[dictID] = std::move(dictionary);
+        return dictID;
+    }
+
+    const ZSTD_CDict *getCDict(uint32_t dictID, int level) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = cdicts.find({dictID, level});
+        if (iter != cdicts.end()) {
+            return iter->second;
+        }
+        const std::vector<uint8_t> *dictionary = loadDictionary(dictID);
+        assert(dictionary);
+        ZSTD_CDict *cdict = ZSTD_createCDict(dictionary->data(), dictionary->size(), level);
+        cdicts[{dictID, level}] = cdict;
+        return cdict;
+    }
+
+    const ZSTD_DDict *getDDict(uint32_t dictID) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = ddicts.find(dictID);
+        if (iter != ddicts.end()) {
+            return iter->second;
+        }
+        const std::vector<uint8_t> *dictionary = loadDictionary(dictID);
+        assert(dictionary);
+        ZSTD_DDict *ddict = ZSTD_createDDict(dictionary->data(), dictionary->size());
+        ddicts[dictID] = ddict;
+        return ddict;
+    }
+
+    // The arrangement reader notes the dictionary of every category it reads, the writer uses it.
+    void setCategoryDictionary(uint64_t category, uint32_t dictID) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        categoryDictionaries[category] = dictID;
+    }
+
+    uint32_t getCategoryDictionary(uint64_t category) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        auto iter = categoryDictionaries.find(category);
+        return iter == categoryDictionaries.end() ? 0 : iter->second;
+    }
+
+private:
+    const std::vector<uint8_t> *loadDictionary(uint32_t dictID) {
+        auto iter = dictionaries.find(dictID);
+        if (iter != dictionaries.end()) {
+            return &iter->second;
+        }
+        char pathBuffer[256];
+        sprintf(pathBuffer, DictionaryPath.data(), dictID);
+        FileOperator dictionaryFile(pathBuffer, FileOpenType::TRY);
+        if (!dictionaryFile.ok()) {
+            printf("[Dictionary] can not open %s\n", pathBuffer);
+            return nullptr;
+        }
+        std::vector<uint8_t> &dictionary = dictionaries[dictID];
+        dictionary.resize(dictionaryFile.getSize());
+        dictionaryFile.read(dictionary.data(), dictionary.size());
+        return &dictionary;
+    }
+
+    MutexLock mutexLock;
+    std::map<uint32_t, std::vector<uint8_t>> dictionaries;
+    std::map<std::pair<uint32_t, int>, ZSTD_CDict *> cdicts;
+    std::map<uint32_t, ZSTD_DDict *> ddicts;
+    std::map<uint64_t, uint32_t> categoryDictionaries;
+};
+
+static DictionaryStore *GlobalDictionaryStorePtr;
+
+#endif //MEGA_CONTAINERDICTIONARY_H
@@ -0,0 +1,302 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CONTAINERFORMAT_H
+#define MEGA_CONTAINERFORMAT_H
+
+#include <zstd.h>
+#include <vector>
+#include <cassert>
+#include <cmath>
+#include <algorithm>
+#include "gflags/gflags.h"
+#include "StorageTask.h"
+#include "FileOperator.h"
+#include "ContainerDictionary.h"
+
+// Smaller sub-blocks would mostly hold a single chunk, a frame and a directory entry each.
+const uint64_t MinContainerSubBlockSize = 4096;
+
+static bool validateContainerSubBlockSize(const char *flag, uint64_t value) {
+    if (value < MinContainerSubBlockSize) {
+        printf("--%s has to be at least %lu\n", flag, MinContainerSubBlockSize);
+        return false;
+    }
+    return true;
+}
+
+DEFINE_uint64(ContainerSubBlockSize,
+              262144, "raw size of the independently decompressible sub-blocks of a container");
+DEFINE_validator(ContainerSubBlockSize, &validateContainerSubBlockSize);
+DEFINE_double(IncompressibleEntropy,
+              7.9, "sampled entropy (bits per byte) from which a container is stored uncompressed, above 8 disables");
+
+// Container format v2:
+//
+//   [zstd frame: sub-block 0] ... [zstd frame: sub-block n-1] [skippable frame: directory]
+//
+// Every sub-block holds whole BlockHeader+payload records. The directory frame holds the
+// zstd-compressed sub-block table and chunk directory, followed by a fixed-size trailer, so
+// a reader finds it from the end of the file. ZSTD_decompress() skips skippable frames, so a
+// v2 container decompresses as a whole exactly like a v1 container (a single zstd frame).
+
+const uint32_t ContainerFormatVersion = 2;
+const uint64_t ContainerTrailerMagic = 0x0032764147654dULL; // "MeGAv2"
+const uint32_t ZstdSkippableMagic = 0x184D2A50;
+const uint64_t ZstdSkippableHeaderSize = 8;
+
+// ContainerTrailer::flags: codec in bits 0-7, signed compression level in bits 8-15.
+// A raw container holds the records uncompressed, its sub-blocks have equal compressed and raw ranges.
+const uint32_t ContainerCodecZstd = 0;
+const uint32_t ContainerCodecRaw = 1;
+
+const uint64_t EntropySampleCount = 32;
+const uint64_t EntropySampleLength = 1024;
+
+inline uint32_t containerCodecFlags(uint32_t codec, int level) {
+    return codec | ((uint32_t) (uint8_t) (int8_t) level << 8);
+}
+
+struct ContainerSubBlock {
+    uint64_t compressedOffset;
+    uint64_t compressedLength;
+    uint64_t rawOffset;
+    uint64_t rawLength;
+};
+
+struct ContainerDirectoryEntry {
+    BlockHeader header;
+    uint32_t subBlock;
+    uint32_t rawOffset; // offset of the BlockHeader in the decompressed container
+};
+
+struct ContainerTrailer {
+    uint64_t subBlockCount;
+    uint64_t chunkCount;
+    uint64_t rawLength;
+    uint64_t tableLength;
+    uint32_t version;
+    uint32_t flags;
+    uint64_t magic;
+};
+
+struct ContainerDirectory {
+    std::vector<ContainerSubBlock> subBlocks;
+    std::vector<ContainerDirectoryEntry> entries;
+    uint64_t rawLength = 0;
+    uint32_t codec = ContainerCodecZstd;
+    int level = 0;
+
+    // frame points to the whole directory frame, including the skippable frame header.
+    int parseFrame(const uint8_t *frame, uint64_t frameLength) {
+        if (frameLength < ZstdSkippableHeaderSize + sizeof(ContainerTrailer)) {
+            return 0;
+        }
+        const ContainerTrailer *trailer = (const ContainerTrailer *) (frame + frameLength - sizeof(ContainerTrailer));
+        if (trailer->magic != ContainerTrailerMagic || trailer->version != ContainerFormatVersion) {
+            return 0;
+        }
+        uint64_t tableRawLength = trailer->subBlockCount * sizeof(ContainerSubBlock) +
+                                  trailer->chunkCount * sizeof(ContainerDirectoryEntry);
+        std::vector<uint8_t> table(tableRawLength);
+        size_t r = ZSTD_decompress(table.data(), tableRawLength, frame + ZstdSkippableHeaderSize,
+                                   trailer->tableLength);
+        assert(!ZSTD_isError(r) && r == tableRawLength);
+        subBlocks.resize(trailer->subBlockCount);
+        entries.resize(trailer->chunkCount);
+        memcpy(subBlocks.data(), table.data(), trailer->subBlockCount * sizeof(ContainerSubBlock));
+        memcpy(entries.data(), table.data() + trailer->subBlockCount * sizeof(ContainerSubBlock),
+               trailer->chunkCount * sizeof(ContainerDirectoryEntry));
+        rawLength = trailer->rawLength;
+        codec = trailer->flags & 0xff;
+        level = (int8_t) ((trailer->flags >> 8) & 0xff);
+        return 1;
+    }
+};
+
+// Returns the length of the directory frame at the end of a container, or 0 for a v1
+// container without directory. trailer holds the last bytes of the container.
+uint64_t containerDirectoryFrameLength(const ContainerTrailer &trailer, uint64_t containerLength) {
+    if (containerLength < ZstdSkippableHeaderSize + sizeof(ContainerTrailer)) {
+        return 0;
+    }
+    if (trailer.magic != ContainerTrailerMagic || trailer.version != ContainerFormatVersion) {
+        return 0;
+    }
+    return ZstdSkippableHeaderSize + trailer.tableLength + sizeof(ContainerTrailer);
+}
+
+// Same for a container held in memory as a whole.
+uint64_t containerDirectoryFrameLength(const uint8_t *container, uint64_t length) {
+    if (length < sizeof(ContainerTrailer)) {
+        return 0;
+    }
+    return containerDirectoryFrameLength(*(const ContainerTrailer *) (container + length - sizeof(ContainerTrailer)),
+                                         length);
+}
+
+// Parses the directory of a container held in memory, returns 0 for a v1 container.
+int readContainerDirectory(const uint8_t *container, uint64_t length, ContainerDirectory &directory) {
+    uint64_t frameLength = containerDirectoryFrameLength(container, length);
+    if (!frameLength || frameLength > length) {
+        return 0;
+    }
+    return directory.parseFrame(container + length - frameLength, frameLength);
+}
+
+struct DecompressionContext {
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+
+    ~DecompressionContext() {
+        ZSTD_freeDCtx(dctx);
+    }
+};
+
+// Decompresses one or more zstd frames, e.g. a v1 container or a sub-block, into dst.
+size_t decompressFrames(uint8_t *dst, uint64_t capacity, const uint8_t *src, uint64_t length) {
+    uint32_t dictID = ZSTD_getDictID_fromFrame(src, length);
+    if (!dictID) {
+        return ZSTD_decompress(dst, capacity, src, length);
+    }
+    static thread_local DecompressionContext context;
+    return ZSTD_decompress_usingDDict(context.dctx, dst, capacity, src, length,
+                                      GlobalDictionaryStorePtr->getDDict(dictID));
+}
+
+// Decompresses a whole container file, v1 or v2, into dst. Raw containers are only copied.
+size_t decompressContainer(uint8_t *dst, uint64_t capacity, const uint8_t *src, uint64_t length) {
+    if (length >= ZstdSkippableHeaderSize + sizeof(ContainerTrailer)) {
+        const ContainerTrailer *trailer = (const ContainerTrailer *) (src + length - sizeof(ContainerTrailer));
+        if (trailer->magic == ContainerTrailerMagic && trailer->version == ContainerFormatVersion &&
+            (trailer->flags & 0xff) == ContainerCodecRaw) {
+            assert(trailer->rawLength <= capacity);
+            memcpy(dst, src, trailer->rawLength);
+            return trailer->rawLength;
+        }
+    }
+    return decompressFrames(dst, capacity, src, length);
+}
+
+// Shannon entropy in bits per byte of evenly spaced samples of buf.
+double sampleEntropy(const uint8_t *buf, uint64_t length) {
+    uint64_t histogram[256] = {0};
+    uint64_t total = 0;
+    uint64_t stride = length / EntropySampleCount;
+    for (uint64_t i = 0; i < EntropySampleCount; i++) {
+        uint64_t start = i * stride;
+        uint64_t end = std::min(start + EntropySampleLength, length);
+        for (uint64_t j = start; j < end; j++) {
+            histogram[buf[j]]++;
+        }
+        total += end - start;
+    }
+    if (!total) {
+        return 0;
+    }
+    double entropy = 0;
+    for (int i = 0; i < 256; i++) {
+        if (histogram[i]) {
+            double p = (double) histogram[i] / total;
+            entropy -= p * log2(p);
+        }
+    }
+    return entropy;
+}
+
+class ContainerEncoder {
+public:
+    ContainerEncoder() {
+        cctx = ZSTD_createCCtx();
+    }
+
+    ~ContainerEncoder() {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    // dictID selects a dictionary of GlobalDictionaryStorePtr for the sub-blocks, 0 for none.
+    size_t compress(uint8_t *dst, uint64_t capacity, uint8_t *src, uint64_t length, int level,
+                    uint32_t dictID = 0) {
+        raw = sampleEntropy(src, length) >= FLAGS_IncompressibleEntropy;
+        cdict = (dictID && !raw) ? GlobalDictionaryStorePtr->getCDict(dictID, level) : nullptr;
+        subBlocks.clear();
+        entries.clear();
+        outPos = 0;
+
+        uint64_t pos = 0, blockStart = 0;
+        while (pos < length) {
+            BlockHeader *blockHeader = (BlockHeader *) (src + pos);
+            uint64_t recordLength = sizeof(BlockHeader) + blockHeader->length;
+            if (pos > blockStart && pos + recordLength - blockStart > FLAGS_ContainerSubBlockSize) {
+                compressSubBlock(dst, capacity, src, blockStart, pos, level);
+                blockStart = pos;
+            }
+            entries.push_back({*blockHeader, (uint32_t) subBlocks.size(), (uint32_t) pos});
+            pos += recordLength;
+        }
+        assert(pos == length);
+        if (pos > blockStart) {
+            compressSubBlock(dst, capacity, src, blockStart, pos, level);
+        }
+
+        std::vector<uint8_t> table(subBlocks.size() * sizeof(ContainerSubBlock) +
+                                   entries.size() * sizeof(ContainerDirectoryEntry));
+        memcpy(table.data(), subBlocks.data(), subBlocks.size() * sizeof(ContainerSubBlock));
+        memcpy(table.data() + subBlocks.size() * sizeof(ContainerSubBlock), entries.data(),
+               entries.size() * sizeof(ContainerDirectoryEntry));
+
+        uint64_t frameStart = outPos;
+        size_t tableLength = ZSTD_compressCCtx(cctx, dst + frameStart + ZstdSkippableHeaderSize,
+                                               capacity - frameStart - ZstdSkippableHeaderSize - sizeof(ContainerTrailer),
+                                               table.data(), table.size(), 1);
+        assert(!ZSTD_isError(tableLength));
+
+        ContainerTrailer trailer = {
+                subBlocks.size(), entries.size(), length, tableLength, ContainerFormatVersion,
+                raw ? containerCodecFlags(ContainerCodecRaw, 0) : containerCodecFlags(ContainerCodecZstd, level),
+                ContainerTrailerMagic,
+        };
+        uint32_t frameHeader[2] = {ZstdSkippableMagic, (uint32_t) (tableLength + sizeof(ContainerTrailer))};
+        memcpy(dst + frameStart, frameHeader, ZstdSkippableHeaderSize);
+        memcpy(dst + frameStart + ZstdSkippableHeaderSize + tableLength, &trailer, sizeof(ContainerTrailer));
+        outPos = frameStart + ZstdSkippableHeaderSize + tableLength + sizeof(ContainerTrailer);
+        return outPos;
+    }
+
+    // whether the last container was stored uncompressed
+    bool isRaw() const {
+        return raw;
+    }
+
+private:
+    void compressSubBlock(uint8_t *dst, uint64_t capacity, uint8_t *src, uint64_t start, uint64_t end, int level) {
+        size_t compressedSize;
+        if (raw) {
+            assert(outPos + end - start <= capacity);
+            memcpy(dst + outPos, src + start, end - start);
+            compressedSize = end - start;
+        } else if (cdict) {
+            compressedSize = ZSTD_compress_usingCDict(cctx, dst + outPos, capacity - outPos, src + start, end - start,
+                                                      cdict);
+        } else {
+            compressedSize = ZSTD_compressCCtx(cctx, dst + outPos, capacity - outPos, src + start, end - start,
+                                               level);
+        }
+        assert(!ZSTD_isError(compressedSize));
+        subBlocks.push_back({outPos, compressedSize, start, end - start});
+        outPos += compressedSize;
+    }
+
+    ZSTD_CCtx *cctx;
+    const ZSTD_CDict *cdict = nullptr;
+    bool raw = false;
+    std::vector<ContainerSubBlock> subBlocks;
+    std::vector<ContainerDirectoryEntry> entries;
+    uint64_t outPos = 0;
+};
+
+#endif //MEGA_CONTAINERFORMAT_H
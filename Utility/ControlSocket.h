@@ -0,0 +1,203 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_CONTROLSOCKET_H
+#define MEGA_CONTROLSOCKET_H
+
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "gflags/gflags.h"
+
+DEFINE_string(SocketPath,
+              "/tmp/MeGA.sock", "UNIX domain socket on which --task=serve takes jobs and MeGAClient sends them");
+
+// The protocol of --task=serve: a client connects, sends one job as a line of words separated by
+// single spaces and gets one line back, "OK <result>" or "ERROR <reason>". The last word of a job
+// may contain spaces, e.g. a path. Paths are absolute, the server does not know the working
+// directory of the client. Jobs run one at a time in the order they are accepted.
+//
+//   backup <path>              -> OK version <n>, its number once the expired versions are gone
+//   restore <version> <path>   -> OK restored <bytes> bytes
+//   delete                     -> OK <n> versions left
+//   status                     -> OK versions:<n> behind:<n> segment files:<n>
+//   stop                       -> OK stopping
+
+const uint64_t ControlLineLimit = 4096;
+const uint64_t ControlReadTimeout = 10;    // seconds a client has to send its job
+
+class ControlConnection {
+public:
+    explicit ControlConnection(int fd) : fd(fd) {
+    }
+
+    ControlConnection(ControlConnection &&other) noexcept : fd(other.fd) {
+        other.fd = -1;
+    }
+
+    ControlConnection(const ControlConnection &) = delete;
+
+    ControlConnection &operator=(const ControlConnection &) = delete;
+
+    ~ControlConnection() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool ok() const {
+        return fd >= 0;
+    }
+
+    // Reads up to the next newline, which is not returned.
+    bool readLine(std::string &line) {
+        line.clear();
+        char c;
+        while (line.size() < ControlLineLimit) {
+            ssize_t r = recv(fd, &c, 1, 0);
+            if (r <= 0) {
+                return false;
+            }
+            if (c == '\n') {
+                return true;
+            }
+            line.push_back(c);
+        }
+        return false;
+    }
+
+    // A client which went away does not take the server down with SIGPIPE.
+    bool writeLine(const std::string &line) {
+        std::string data = line + "\n";
+        uint64_t written = 0;
+        while (written < data.size()) {
+            ssize_t r = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+            if (r <= 0) {
+                return false;
+            }
+            written += r;
+        }
+        return true;
+    }
+
+    // Splits a job into at most limit words, the last one takes the rest of the line.
+    static std::vector<std::string> split(const std::string &line, uint64_t limit) {
+        std::vector<std::string> words;
+        uint64_t pos = 0;
+        while (pos <= line.size() && words.size() + 1 < limit) {
+            uint64_t end = line.find(' ', pos);
+            if (end == std::string::npos) {
+                break;
+            }
+            words.push_back(line.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        if (pos < line.size()) {
+            words.push_back(line.substr(pos));
+        }
+        return words;
+    }
+
+    static ControlConnection connectTo(const std::string &path) {
+        sockaddr_un address;
+        if (!fillAddress(path, address)) {
+            return ControlConnection(-1);
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, (sockaddr *) &address, sizeof(sockaddr_un))) {
+            close(fd);
+            fd = -1;
+        }
+        return ControlConnection(fd);
+    }
+
+    static bool fillAddress(const std::string &path, sockaddr_un &address) {
+        memset(&address, 0, sizeof(sockaddr_un));
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) {
+            printf("[Control] socket path %s is too long\n", path.data());
+            return false;
+        }
+        strcpy(address.sun_path, path.data());
+        return true;
+    }
+
+private:
+    int fd;
+};
+
+class ControlServer {
+public:
+    // A socket left behind by a server which did not stop cleanly is replaced. One a server still
+    // answers on, or a file which is no socket, is left alone and the server does not start.
+    explicit ControlServer(const std::string &path) : path(path) {
+        sockaddr_un address;
+        if (!ControlConnection::fillAddress(path, address)) {
+            return;
+        }
+        struct stat statBuffer;
+        if (!lstat(path.data(), &statBuffer)) {
+            if (!S_ISSOCK(statBuffer.st_mode)) {
+                printf("[Control] %s exists and is not a socket\n", path.data());
+                return;
+            }
+            if (ControlConnection::connectTo(path).ok()) {
+                printf("[Control] another server is running on %s\n", path.data());
+                return;
+            }
+            unlink(path.data());
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            printf("[Control] socket failed : %s\n", strerror(errno));
+            return;
+        }
+        if (bind(fd, (sockaddr *) &address, sizeof(sockaddr_un)) || listen(fd, 16)) {
+            printf("[Control] can not listen on %s : %s\n", path.data(), strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    ~ControlServer() {
+        if (fd >= 0) {
+            close(fd);
+            unlink(path.data());
+        }
+    }
+
+    bool ok() const {
+        return fd >= 0;
+    }
+
+    // Jobs are taken one at a time, so a client which does not send its job in time is dropped
+    // instead of holding up the others.
+    ControlConnection accept() {
+        int client;
+        do {
+            client = ::accept(fd, nullptr, nullptr);
+        } while (client < 0 && errno == EINTR);
+        if (client >= 0) {
+            struct timeval timeout = {(time_t) ControlReadTimeout, 0};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        }
+        return ControlConnection(client);
+    }
+
+private:
+    std::string path;
+    int fd = -1;
+};
+
+#endif //MEGA_CONTROLSOCKET_H
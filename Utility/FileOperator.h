@@ -104,13 +104,24 @@ public:
     }
 
     int fdatasync() {
-//        fflush(file);
+        fflush(file);
         return ::fdatasync(fileno(file));
     }
 
     int fsync() {
-//        fflush(file);
-        return ::fdatasync(fileno(file));
+        fflush(file);
+        return ::fsync(fileno(file));
+    }
+
+    // Makes created, renamed or removed entries of a directory durable.
+    static int syncDirectory(const std::string &path) {
+        int fd = open(path.data(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            return -1;
+        }
+        int r = ::fsync(fd);
+        close(fd);
+        return r;
     }
 
     int getFd() {
@@ -122,7 +133,7 @@ public:
     }
 
     int releaseBufferedData() {
-        posix_fadvise(file->_fileno, 0, 0, POSIX_FADV_DONTNEED);
+        return posix_fadvise(file->_fileno, 0, 0, POSIX_FADV_DONTNEED);
     }
 
     uint64_t getSize() {
@@ -0,0 +1,122 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_IOTHROTTLE_H
+#define MEGA_IOTHROTTLE_H
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include "Lock.h"
+
+extern uint64_t ArrangementBandwidth;
+extern uint64_t ArrangementIOPS;
+extern bool ArrangementIdleIO;
+
+// ioprio_set(2) has no glibc wrapper, see linux/ioprio.h
+const int IOPrioWhoProcess = 1;
+const int IOPrioClassIdle = 3;
+const int IOPrioClassShift = 13;
+
+// Refilled at rate tokens per second, holding at most one second of them. A taker may run into
+// debt and sleeps it off, so a large request is not starved by a stream of small ones.
+class TokenBucket {
+public:
+    void setRate(double r, double now) {
+        rate = r;
+        tokens = r;
+        last = now;
+    }
+
+    // Returns the microseconds the taker has to wait.
+    uint64_t take(double amount, double now) {
+        if (rate <= 0) {
+            return 0;
+        }
+        tokens = std::min(rate, tokens + (now - last) * rate);
+        last = now;
+        tokens -= amount;
+        return tokens >= 0 ? 0 : (uint64_t) (-tokens / rate * 1000000);
+    }
+
+private:
+    double rate = 0;
+    double tokens = 0;
+    double last = 0;
+};
+
+// Arrangement and deletion run in the background of backups and restores on the same disks.
+// Their reads, writes and unlinks take from a bucket of bytes and one of requests, configured by
+// arrangement_bandwidth (MB/s) and arrangement_iops in the toml, 0 for no limit. With
+// arrangement_idle_io their threads are put into the idle I/O class, whose requests the
+// scheduler only serves when no other process waits for the disk.
+class IOThrottle {
+public:
+    IOThrottle() {
+        double now = seconds();
+        bandwidth.setRate(ArrangementBandwidth * 1024.0 * 1024.0, now);
+        iops.setRate(ArrangementIOPS, now);
+        limited = ArrangementBandwidth || ArrangementIOPS;
+    }
+
+    void getStatistics() {
+        if (limited) {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            printf("[IOThrottle] %lu requests, %lu bytes, waited %lu us\n", requests, bytes, waitTime);
+        }
+    }
+
+    // Called before a request of length bytes, an unlink counts as a request of 0 bytes.
+    void acquire(uint64_t length) {
+        if (!limited) {
+            return;
+        }
+        uint64_t wait;
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            double now = seconds();
+            wait = std::max(bandwidth.take(length, now), iops.take(1, now));
+            requests++;
+            bytes += length;
+            waitTime += wait;
+        }
+        if (wait) {
+            usleep(wait);
+        }
+    }
+
+    // Applies to the calling thread only.
+    static void enterIdleClass() {
+        if (!ArrangementIdleIO) {
+            return;
+        }
+        if (syscall(SYS_ioprio_set, IOPrioWhoProcess, 0, IOPrioClassIdle << IOPrioClassShift)) {
+            printf("[IOThrottle] ioprio_set failed : %s\n", strerror(errno));
+        }
+    }
+
+private:
+    static double seconds() {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return tv.tv_sec + tv.tv_usec / 1000000.0;
+    }
+
+    TokenBucket bandwidth;
+    TokenBucket iops;
+    bool limited;
+    uint64_t requests = 0, bytes = 0, waitTime = 0;
+    MutexLock mutexLock;
+};
+
+static IOThrottle *GlobalIOThrottlePtr;
+
+#endif //MEGA_IOTHROTTLE_H
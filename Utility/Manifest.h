@@ -25,6 +25,7 @@ public:
         FileOperator fileOperator((char *) ManifestPath.data(), FileOpenType::Write);
         assert(fileOperator.ok());
         fileOperator.write((uint8_t *) &manifest, sizeof(Manifest));
+        fileOperator.fsync();
     }
 private:
 };
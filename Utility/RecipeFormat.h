@@ -0,0 +1,377 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_RECIPEFORMAT_H
+#define MEGA_RECIPEFORMAT_H
+
+#include <zstd.h>
+#include <vector>
+#include <unordered_map>
+#include "gflags/gflags.h"
+#include "StorageTask.h"
+#include "FileOperator.h"
+
+DEFINE_uint64(RecipeBlockRecords,
+              4096, "chunk records per compressed block of a recipe");
+DEFINE_bool(RecipeDelta,
+            false, "store a recipe as runs copied from the recipe of the previous version plus literal records");
+DEFINE_uint64(RecipeDeltaChain,
+              16, "maximum number of delta recipes restore has to decode before a full one");
+
+extern std::string LogicFilePath;
+
+// Recipe v2:
+//
+//   [RecipeFileHeader] [RecipeBlockHeader][zstd frame: records] ...
+//
+// A record keeps only what restore needs: the fingerprint, the length and the delta flag as
+// one varint, and for delta chunks the base fingerprint and the original length. Similarity
+// features stay in the containers. A v1 recipe is a flat array of BlockHeaders.
+//
+// A delta recipe has RecipeDeltaMagic and a RecipeDeltaHeader after the file header. Its blocks
+// hold operations instead of records: a varint (n << 1 | 1) followed by a zigzag varint copies
+// n records of the previous version's recipe, starting at the end of the last copy plus the
+// given distance; a varint 0 is followed by a literal record. Only the previous recipe is
+// referenced, so recipes keep resolving when the eliminator renumbers them.
+
+const uint64_t RecipeMagic = 0x3276657069636552ULL; // "Recipev2"
+const uint64_t RecipeDeltaMagic = 0x6c44657069636552ULL; // "RecipeDl"
+const uint64_t RecipeFingerprintSize = 20;
+
+struct RecipeFileHeader {
+    uint64_t magic;
+    uint64_t chunkCount;
+    uint64_t logicalSize;
+};
+
+struct RecipeDeltaHeader {
+    uint64_t depth;     // delta recipes down to the next full one, including this one
+};
+
+static std::string recipePath(uint64_t version) {
+    char pathBuffer[256];
+    sprintf(pathBuffer, LogicFilePath.data(), version);
+    return pathBuffer;
+}
+
+static bool sameRecord(const BlockHeader &a, const BlockHeader &b) {
+    TupleEqualer equaler;
+    if (!equaler(a.fp, b.fp) || a.type != b.type || a.length != b.length) {
+        return false;
+    }
+    return !a.type || (equaler(a.baseFP, b.baseFP) && a.oriLength == b.oriLength);
+}
+
+struct RecipeBlockHeader {
+    uint32_t recordCount;
+    uint32_t rawLength;
+    uint32_t compressedLength;
+};
+
+// Decodes a recipe block by block, v1 recipes record by record. A delta recipe first decodes
+// the recipe of the previous version, which may be a delta recipe itself.
+class RecipeReader {
+public:
+    RecipeReader(const std::string &path, uint64_t version) : file((char *) path.data(), FileOpenType::Read),
+                                                               version(version) {
+        RecipeFileHeader fileHeader;
+        uint64_t fileSize = FileOperator::size(path);
+        if (fileSize >= sizeof(RecipeFileHeader) &&
+            file.read((uint8_t *) &fileHeader, sizeof(RecipeFileHeader)) == sizeof(RecipeFileHeader) &&
+            (fileHeader.magic == RecipeMagic || fileHeader.magic == RecipeDeltaMagic)) {
+            chunkCount = fileHeader.chunkCount;
+            logicalSize = fileHeader.logicalSize;
+            if (fileHeader.magic == RecipeDeltaMagic) {
+                RecipeDeltaHeader deltaHeader;
+                file.read((uint8_t *) &deltaHeader, sizeof(RecipeDeltaHeader));
+                depth = deltaHeader.depth;
+            }
+        } else {
+            v1 = true;
+            chunkCount = fileSize / sizeof(BlockHeader);
+            assert(chunkCount * sizeof(BlockHeader) == fileSize);
+            file.seek(0);
+        }
+    }
+
+    uint64_t getChunkCount() const {
+        return chunkCount;
+    }
+
+    // 0 for v1 recipes, the size is known only after all records are read.
+    uint64_t getLogicalSize() const {
+        return logicalSize;
+    }
+
+    // 0 for a full recipe.
+    uint64_t getDepth() const {
+        return depth;
+    }
+
+    // Returns 0 after the last record. Only fp, type, length, and for delta chunks baseFP and
+    // oriLength are filled.
+    int next(BlockHeader *blockHeader) {
+        if (readCount >= chunkCount) {
+            return 0;
+        }
+        readCount++;
+        if (v1) {
+            return file.read((uint8_t *) blockHeader, sizeof(BlockHeader)) == sizeof(BlockHeader);
+        }
+        if (depth && !baseLoaded) {
+            loadBase();
+        }
+        while (!copyLeft) {
+            if (pos >= block.size()) {
+                readBlock();
+            }
+            if (!depth) {
+                getRecord(blockHeader);
+                return 1;
+            }
+            uint64_t operation = getVarint();
+            if (!(operation & 1)) {
+                getRecord(blockHeader);
+                return 1;
+            }
+            copyLeft = operation >> 1;
+            uint64_t distance = getVarint();
+            copyPos += (distance >> 1) ^ -(int64_t) (distance & 1);
+        }
+        assert(copyPos < base.size());
+        *blockHeader = base[copyPos++];
+        copyLeft--;
+        return 1;
+    }
+
+private:
+    void loadBase() {
+        RecipeReader baseReader(recipePath(version - 1), version - 1);
+        base.resize(baseReader.getChunkCount());
+        for (auto &record: base) {
+            baseReader.next(&record);
+        }
+        baseLoaded = true;
+    }
+
+    void readBlock() {
+        RecipeBlockHeader blockHeader;
+        size_t r = file.read((uint8_t *) &blockHeader, sizeof(RecipeBlockHeader));
+        assert(r == sizeof(RecipeBlockHeader));
+        compressed.resize(blockHeader.compressedLength);
+        block.resize(blockHeader.rawLength);
+        file.read(compressed.data(), blockHeader.compressedLength);
+        r = ZSTD_decompress(block.data(), block.size(), compressed.data(), compressed.size());
+        assert(!ZSTD_isError(r) && r == blockHeader.rawLength);
+        pos = 0;
+    }
+
+    void getRecord(BlockHeader *blockHeader) {
+        getFingerprint(&blockHeader->fp);
+        uint64_t lengthAndType = getVarint();
+        blockHeader->type = lengthAndType & 1;
+        blockHeader->length = lengthAndType >> 1;
+        if (blockHeader->type) {
+            getFingerprint(&blockHeader->baseFP);
+            blockHeader->oriLength = getVarint();
+        } else {
+            blockHeader->oriLength = 0;
+        }
+    }
+
+    void getFingerprint(SHA1FP *fp) {
+        memset(fp, 0, sizeof(SHA1FP));
+        uint8_t *p = (uint8_t *) fp;
+        memcpy(p, block.data() + pos, sizeof(uint64_t));
+        memcpy(p + sizeof(uint64_t), block.data() + pos + sizeof(uint64_t), 3 * sizeof(uint32_t));
+        pos += RecipeFingerprintSize;
+    }
+
+    uint64_t getVarint() {
+        uint64_t value = 0;
+        int shift = 0;
+        while (block[pos] & 0x80) {
+            value |= (uint64_t) (block[pos++] & 0x7f) << shift;
+            shift += 7;
+        }
+        value |= (uint64_t) block[pos++] << shift;
+        return value;
+    }
+
+    FileOperator file;
+    uint64_t version;
+    bool v1 = false;
+    uint64_t depth = 0;
+    uint64_t chunkCount = 0;
+    uint64_t logicalSize = 0;
+    uint64_t readCount = 0;
+    std::vector<uint8_t> block;
+    std::vector<uint8_t> compressed;
+    uint64_t pos = 0;
+
+    bool baseLoaded = false;
+    std::vector<BlockHeader> base;
+    uint64_t copyPos = 0, copyLeft = 0;
+};
+
+class RecipeWriter {
+public:
+    // With baseVersion > 0 the recipe is written as delta against the recipe of that version,
+    // unless the chain of delta recipes would become longer than --RecipeDeltaChain.
+    RecipeWriter(const std::string &path, uint64_t baseVersion) : file((char *) path.data(), FileOpenType::Write) {
+        if (baseVersion) {
+            loadBase(baseVersion);
+        }
+        RecipeFileHeader fileHeader = {depth ? RecipeDeltaMagic : RecipeMagic, 0, 0};
+        file.write((uint8_t *) &fileHeader, sizeof(RecipeFileHeader));
+        fileLength = sizeof(RecipeFileHeader);
+        if (depth) {
+            RecipeDeltaHeader deltaHeader = {depth};
+            file.write((uint8_t *) &deltaHeader, sizeof(RecipeDeltaHeader));
+            fileLength += sizeof(RecipeDeltaHeader);
+        }
+    }
+
+    ~RecipeWriter() {
+        flushRun();
+        flushBlock();
+        RecipeFileHeader fileHeader = {depth ? RecipeDeltaMagic : RecipeMagic, chunkCount, logicalSize};
+        file.seek(0);
+        file.write((uint8_t *) &fileHeader, sizeof(RecipeFileHeader));
+        printf("[Recipe] %lu chunks, %lu bytes, %lu bytes as flat headers\n", chunkCount, fileLength,
+               chunkCount * sizeof(BlockHeader));
+        if (depth) {
+            printf("[Recipe] delta depth %lu, %lu chunks copied in %lu runs, %lu literal\n", depth, copiedChunks,
+                   copyRuns, chunkCount - copiedChunks);
+        }
+    }
+
+    void add(const BlockHeader &blockHeader) {
+        logicalSize += blockHeader.type ? blockHeader.oriLength : blockHeader.length;
+        chunkCount++;
+        if (depth) {
+            if (runLength && runStart + runLength < base.size() && sameRecord(base[runStart + runLength], blockHeader)) {
+                runLength++;
+                return;
+            }
+            flushRun();
+            auto iter = baseIndex.find(blockHeader.fp);
+            if (iter != baseIndex.end() && sameRecord(base[iter->second], blockHeader)) {
+                runStart = iter->second;
+                runLength = 1;
+                return;
+            }
+            putVarint(0);
+        }
+        putRecord(blockHeader);
+        finishOperation();
+    }
+
+private:
+    void loadBase(uint64_t baseVersion) {
+        RecipeReader baseReader(recipePath(baseVersion), baseVersion);
+        if (baseReader.getDepth() + 1 > FLAGS_RecipeDeltaChain) {
+            return;
+        }
+        depth = baseReader.getDepth() + 1;
+        base.resize(baseReader.getChunkCount());
+        for (uint64_t i = 0; i < base.size(); i++) {
+            baseReader.next(&base[i]);
+            baseIndex.emplace(base[i].fp, i);
+        }
+    }
+
+    void flushRun() {
+        if (!runLength) return;
+        int64_t distance = (int64_t) runStart - (int64_t) copyEnd;
+        putVarint((runLength << 1) | 1);
+        putVarint(((uint64_t) distance << 1) ^ (uint64_t) (distance >> 63));
+        copyEnd = runStart + runLength;
+        copiedChunks += runLength;
+        copyRuns++;
+        runLength = 0;
+        finishOperation();
+    }
+
+    void finishOperation() {
+        if (++blockRecords >= FLAGS_RecipeBlockRecords) {
+            flushBlock();
+        }
+    }
+
+    void putRecord(const BlockHeader &blockHeader) {
+        putFingerprint(blockHeader.fp);
+        putVarint(((uint64_t) blockHeader.length << 1) | blockHeader.type);
+        if (blockHeader.type) {
+            putFingerprint(blockHeader.baseFP);
+            putVarint(blockHeader.oriLength);
+        }
+    }
+
+    void putFingerprint(const SHA1FP &fp) {
+        const uint8_t *p = (const uint8_t *) &fp;
+        block.insert(block.end(), p, p + sizeof(uint64_t));
+        block.insert(block.end(), p + sizeof(uint64_t), p + sizeof(uint64_t) + 3 * sizeof(uint32_t));
+    }
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            block.push_back((uint8_t) (value | 0x80));
+            value >>= 7;
+        }
+        block.push_back((uint8_t) value);
+    }
+
+    void flushBlock() {
+        if (!blockRecords) return;
+        compressed.resize(ZSTD_compressBound(block.size()));
+        size_t compressedLength = ZSTD_compress(compressed.data(), compressed.size(), block.data(), block.size(), 3);
+        assert(!ZSTD_isError(compressedLength));
+        RecipeBlockHeader blockHeader = {(uint32_t) blockRecords, (uint32_t) block.size(),
+                                         (uint32_t) compressedLength};
+        file.write((uint8_t *) &blockHeader, sizeof(RecipeBlockHeader));
+        file.write(compressed.data(), compressedLength);
+        fileLength += sizeof(RecipeBlockHeader) + compressedLength;
+        block.clear();
+        blockRecords = 0;
+    }
+
+    FileOperator file;
+    std::vector<uint8_t> block;
+    std::vector<uint8_t> compressed;
+    uint64_t blockRecords = 0;  // records or, in a delta recipe, operations
+    uint64_t chunkCount = 0;
+    uint64_t logicalSize = 0;
+    uint64_t fileLength = 0;
+
+    uint64_t depth = 0;
+    std::vector<BlockHeader> base;
+    std::unordered_map<SHA1FP, uint64_t, TupleHasher, TupleEqualer> baseIndex;
+    uint64_t runStart = 0, runLength = 0, copyEnd = 0;
+    uint64_t copiedChunks = 0, copyRuns = 0;
+};
+
+// Rewrites a delta recipe as a full one, before the recipe it refers to is deleted.
+static void materializeRecipe(uint64_t version) {
+    std::string path = recipePath(version);
+    std::string tempPath = path + ".tmp";
+    {
+        RecipeReader recipeReader(path, version);
+        if (!recipeReader.getDepth()) {
+            return;
+        }
+        RecipeWriter recipeWriter(tempPath, 0);
+        BlockHeader blockHeader;
+        while (recipeReader.next(&blockHeader)) {
+            recipeWriter.add(blockHeader);
+        }
+    }
+    rename(tempPath.data(), path.data());
+}
+
+#endif //MEGA_RECIPEFORMAT_H
@@ -0,0 +1,315 @@
+/*
+ * Author   : Xiangyu Zou
+ * Date     : 04/23/2021
+ * Time     : 15:39
+ * Project  : MeGA
+ This source code is licensed under the GPLv2
+ */
+
+#ifndef MEGA_SEGMENTFILE_H
+#define MEGA_SEGMENTFILE_H
+
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include "gflags/gflags.h"
+#include "Lock.h"
+#include "FileOperator.h"
+#include "Catalog.h"
+
+DEFINE_uint64(SegmentSize,
+              4096, "MB of containers appended to one segment object before the next object of the group is started");
+DEFINE_bool(GroupCommit,
+            true, "flush sealed segment objects together before the catalog is saved instead of one by one");
+DEFINE_uint64(WritebackInterval,
+              64, "MB appended to a segment object between two asynchronous writeback requests");
+
+// The containers of a category or volume (a group) are appended to a few large segment objects,
+// which the catalog lists in order for the group name, see Catalog.h:
+//
+//   [container 0] ... [container n-1] [offset table: n x SegmentEntry] [SegmentFooter]
+//
+// The table is written when an object is sealed. The containers of a group are numbered across
+// the ranges of objects the catalog lists, so merging two groups is appending the range list of
+// the second.
+
+const uint64_t SegmentFooterMagic = 0x746e656d676553ULL; // "Segment"
+
+struct SegmentEntry {
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct SegmentFooter {
+    uint64_t count;
+    uint64_t tableOffset;
+    uint64_t magic;
+};
+
+class SegmentWriter;
+
+// Segments which are still being written, so that their containers can be read before sealing.
+static std::map<std::string, SegmentWriter *> OpenSegments;
+static MutexLock OpenSegmentsLock;
+
+// Group names are the path templates of Config.h formatted with category and version.
+static std::string segmentGroupName(const std::string &groupTemplate, uint64_t a, uint64_t b) {
+    char nameBuffer[256];
+    sprintf(nameBuffer, groupTemplate.data(), a, b);
+    return nameBuffer;
+}
+
+class SegmentWriter {
+public:
+    // A group written again, e.g. after an interrupted run, replaces the old one.
+    SegmentWriter(const std::string &groupTemplate, uint64_t a, uint64_t b) : mutexLock() {
+        groupName = segmentGroupName(groupTemplate, a, b);
+        GlobalCatalogPtr->release(groupName);
+        MutexLockGuard mutexLockGuard(OpenSegmentsLock);
+        OpenSegments[groupName] = this;
+    }
+
+    ~SegmentWriter() {
+        close();
+    }
+
+    // Appends the next container of the group and returns its number. The number of chunks in the
+    // container goes to the catalog, 0 if the caller does not know it.
+    uint64_t append(uint8_t *buffer, uint64_t length, uint32_t chunkCount = 0) {
+        if (file && partLength + length > FLAGS_SegmentSize * 1024 * 1024) {
+            sealPart();
+        }
+        if (!file) {
+            openPart();
+        }
+        file->write(buffer, length);
+        // readers of an open segment use their own descriptor
+        fflush(file->getFP());
+        uint64_t index;
+        {
+            MutexLockGuard mutexLockGuard(mutexLock);
+            std::vector<SegmentEntry> &table = objectTables[objectID];
+            addRange(objectID, table.size());
+            table.push_back({partLength, length});
+            content.chunkCounts.push_back(chunkCount);
+            partLength += length;
+            index = containerCount++;
+        }
+        if (partLength - writebackOffset >= FLAGS_WritebackInterval * 1024 * 1024) {
+            startWriteback();
+        }
+        return index;
+    }
+
+    // Appends a container of a sealed object of another group without copying it, the object is
+    // shared from then on. Returns the number of the container in this group.
+    uint64_t adopt(uint64_t sourceObjectID, uint64_t indexInObject, uint32_t chunkCount) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        addRange(sourceObjectID, indexInObject);
+        content.chunkCounts.push_back(chunkCount);
+        return containerCount++;
+    }
+
+    // Seals the open object and hands the group over to the catalog.
+    void close() {
+        if (closed) return;
+        if (file) {
+            sealPart();
+        }
+        GlobalCatalogPtr->setGroup(groupName, content);
+        MutexLockGuard mutexLockGuard(OpenSegmentsLock);
+        OpenSegments.erase(groupName);
+        closed = true;
+    }
+
+    void snapshot(CatalogGroup &group, std::map<uint64_t, std::vector<SegmentEntry>> &tables) {
+        MutexLockGuard mutexLockGuard(mutexLock);
+        group = content;
+        tables = objectTables;
+    }
+
+private:
+    // consecutive containers of one object share a part
+    void addRange(uint64_t rangeObjectID, uint64_t indexInObject) {
+        if (!content.parts.empty()) {
+            CatalogPart &last = content.parts.back();
+            if (last.objectID == rangeObjectID && last.first + last.count == indexInObject) {
+                last.count++;
+                return;
+            }
+        }
+        content.parts.push_back({rangeObjectID, indexInObject, 1});
+    }
+
+    void openPart() {
+        objectID = GlobalCatalogPtr->allocateObject();
+        std::string path = Catalog::objectPath(objectID);
+        file = new FileOperator((char *) path.data(), FileOpenType::Write);
+        partLength = 0;
+        writebackOffset = 0;
+    }
+
+    void sealPart() {
+        std::vector<SegmentEntry> &table = objectTables[objectID];
+        SegmentFooter footer = {table.size(), partLength, SegmentFooterMagic};
+        file->write((uint8_t *) table.data(), table.size() * sizeof(SegmentEntry));
+        file->write((uint8_t *) &footer, sizeof(SegmentFooter));
+        if (FLAGS_GroupCommit) {
+            startWriteback();
+            GlobalCatalogPtr->addUnsyncedObject(objectID);
+        } else {
+            file->fdatasync();
+        }
+        delete file;
+        file = nullptr;
+    }
+
+    // Starts writing back what was appended since the last call without waiting for it, the
+    // flush before the catalog is saved then finds little left to do.
+    void startWriteback() {
+        fflush(file->getFP());
+        uint64_t end = FileOperator::size(Catalog::objectPath(objectID));
+        sync_file_range(file->getFd(), writebackOffset, end - writebackOffset, SYNC_FILE_RANGE_WRITE);
+        writebackOffset = end;
+    }
+
+    std::string groupName;
+    FileOperator *file = nullptr;
+    uint64_t objectID = 0;      // the object being written
+    uint64_t partLength = 0;
+    uint64_t writebackOffset = 0;
+    uint64_t containerCount = 0;
+    CatalogGroup content;
+    std::map<uint64_t, std::vector<SegmentEntry>> objectTables;     // of the objects written here
+    bool closed = false;
+    MutexLock mutexLock;
+};
+
+class SegmentReader {
+public:
+    // The containers are enumerated from the catalog, offset tables are read on first access.
+    SegmentReader(const std::string &groupTemplate, uint64_t a, uint64_t b) {
+        std::string groupName = segmentGroupName(groupTemplate, a, b);
+        bool open = false;
+        {
+            MutexLockGuard mutexLockGuard(OpenSegmentsLock);
+            auto iter = OpenSegments.find(groupName);
+            if (iter != OpenSegments.end()) {
+                iter->second->snapshot(group, tables);
+                open = true;
+            }
+        }
+        if (!open) {
+            group = GlobalCatalogPtr->getGroup(groupName);
+        }
+        for (const auto &part: group.parts) {
+            firstIndexes.push_back(containerCount);
+            containerCount += part.count;
+        }
+    }
+
+    ~SegmentReader() {
+        for (auto &file: files) {
+            delete file.second;
+        }
+    }
+
+    uint64_t count() const {
+        return containerCount;
+    }
+
+    uint64_t length(uint64_t index) {
+        return getEntry(index).length;
+    }
+
+    // Chunks in a container as the writer reported them, 0 if unknown.
+    uint32_t chunkCount(uint64_t index) const {
+        return index < group.chunkCounts.size() ? group.chunkCounts[index] : 0;
+    }
+
+    // Where a container is stored, for SegmentWriter::adopt().
+    void locateObject(uint64_t index, uint64_t &objectID, uint64_t &indexInObject) const {
+        uint64_t part = locate(index);
+        objectID = group.parts[part].objectID;
+        indexInObject = group.parts[part].first + index - firstIndexes[part];
+    }
+
+    // Reads the whole container, which has to fit into capacity.
+    uint64_t read(uint64_t index, uint8_t *buffer, uint64_t capacity) {
+        uint64_t length = getEntry(index).length;
+        assert(length <= capacity);
+        return pread(index, 0, buffer, length);
+    }
+
+    // Reads a range of a container.
+    uint64_t pread(uint64_t index, uint64_t offset, uint8_t *buffer, uint64_t length) {
+        uint64_t part = locate(index);
+        const SegmentEntry &entry = getEntry(index);
+        assert(offset + length <= entry.length);
+        return getFile(group.parts[part].objectID)->pread(buffer, entry.offset + offset, length);
+    }
+
+    static void remove(const std::string &groupTemplate, uint64_t a, uint64_t b) {
+        GlobalCatalogPtr->release(segmentGroupName(groupTemplate, a, b));
+    }
+
+    // Appends the containers of a group to another group.
+    static void move(const std::string &fromTemplate, uint64_t a, uint64_t b, const std::string &toTemplate,
+                     uint64_t c, uint64_t d) {
+        GlobalCatalogPtr->move(segmentGroupName(fromTemplate, a, b), segmentGroupName(toTemplate, c, d));
+    }
+
+private:
+    uint64_t locate(uint64_t index) const {
+        assert(index < containerCount);
+        return std::upper_bound(firstIndexes.begin(), firstIndexes.end(), index) - firstIndexes.begin() - 1;
+    }
+
+    const SegmentEntry &getEntry(uint64_t index) {
+        uint64_t part = locate(index);
+        uint64_t objectID = group.parts[part].objectID;
+        std::vector<SegmentEntry> &table = tables[objectID];
+        if (table.empty()) {
+            loadTable(objectID, table);
+        }
+        uint64_t indexInObject = group.parts[part].first + index - firstIndexes[part];
+        if (indexInObject >= table.size()) {
+            printf("[Segment] Segment%lu does not match the catalog\n", objectID);
+            assert(indexInObject < table.size());
+        }
+        return table[indexInObject];
+    }
+
+    void loadTable(uint64_t objectID, std::vector<SegmentEntry> &table) {
+        FileOperator *file = getFile(objectID);
+        uint64_t fileSize = FileOperator::size(Catalog::objectPath(objectID));
+        SegmentFooter footer;
+        int r = fileSize >= sizeof(SegmentFooter) &&
+                file->pread((uint8_t *) &footer, fileSize - sizeof(SegmentFooter), sizeof(SegmentFooter)) ==
+                sizeof(SegmentFooter) && footer.magic == SegmentFooterMagic;
+        if (!r) {
+            printf("[Segment] Segment%lu is damaged\n", objectID);
+            assert(r);
+        }
+        table.resize(footer.count);
+        file->pread((uint8_t *) table.data(), footer.tableOffset, footer.count * sizeof(SegmentEntry));
+    }
+
+    FileOperator *getFile(uint64_t objectID) {
+        FileOperator *&file = files[objectID];
+        if (!file) {
+            std::string path = Catalog::objectPath(objectID);
+            file = new FileOperator((char *) path.data(), FileOpenType::Read);
+        }
+        return file;
+    }
+
+    CatalogGroup group;
+    std::map<uint64_t, std::vector<SegmentEntry>> tables;
+    std::vector<uint64_t> firstIndexes;
+    std::map<uint64_t, FileOperator *> files;
+    uint64_t containerCount = 0;
+};
+
+#endif //MEGA_SEGMENTFILE_H
@@ -4,7 +4,9 @@
 #include "Lock.h"
 #include <list>
 #include <tuple>
+#include <vector>
 #include <cstring>
+#include <sys/mman.h>
 
 struct SHA1FP {
     //std::tuple<uint32_t, uint32_t, uint32_t, uint32_t, uint32_t> fp;
@@ -75,6 +77,7 @@ struct DedupTask {
     bool inCache = 0;
     LookupResult lookupResult;
     bool deltaReject = false;
+    bool baseSelected = false;
     BlockEntry availBase;
 };
 
@@ -96,6 +99,7 @@ struct WriteTask {
     bool deltaTag;
     uint64_t oriLength;
     SimilarityFeatures similarityFeatures;
+    uint64_t inputEnd;      // where the chunk ends in the input, see WriteFilePipeline::releaseInput()
 };
 
 struct ChunkTask {
@@ -109,14 +113,16 @@ struct ChunkTask {
 
 struct StorageTask {
     std::string path;
-    uint8_t *buffer = nullptr;
+    uint8_t *buffer = nullptr;      // the reservation the input is read into, see ReadFilePipeline
+    uint64_t reservedLength = 0;
     uint64_t length;
     uint64_t fileID;
     uint64_t end;
     CountdownLatch *countdownLatch = nullptr;
 
     void destruction() {
-        if (buffer) free(buffer);
+        if (buffer) munmap(buffer, reservedLength);
+        buffer = nullptr;
     }
 };
 
@@ -185,24 +191,36 @@ struct RestoreWriteTask {
     }
 };
 
+// Consecutive chunk records of a container which all stay active or all become archived.
+struct ChunkRun {
+    uint64_t offset;
+    uint64_t length;
+    bool isArchived;
+};
+
 struct ArrangementWriteTask{
     uint8_t* writeBuffer = nullptr;
     uint64_t length;
     uint64_t beforeClassId;
     uint64_t arrangementVersion = -1;
     bool isArchived = 0;
+    bool wholeContainer = false;    // writeBuffer holds a compressed container to be taken over as it is
+    bool relink = false;            // the container at objectID/objectIndex is taken over without reading it
+    uint64_t objectID, objectIndex;
+    uint32_t chunkCount;
+    uint64_t sourceCategory, sourceCID;
+    std::vector<ChunkRun> runs;     // writeBuffer holds a decompressed container to be split along them
     bool classEndFlag = false;
     bool finalEndFlag = false;
     bool startFlag = false;
     CountdownLatch* countdownLatch;
 
-    ArrangementWriteTask(uint8_t *buf, uint64_t len, uint64_t pcid, uint64_t version, bool isArch) {
-        writeBuffer = (uint8_t *) malloc(len);
-        memcpy(writeBuffer, buf, len);
+    // Takes over the buffer of a decompressed container.
+    ArrangementWriteTask(uint8_t *container, uint64_t len, uint64_t pcid, uint64_t version) {
+        writeBuffer = container;
         length = len;
         beforeClassId = pcid;
         arrangementVersion = version;
-        isArchived = isArch;
     }
 
     ArrangementWriteTask(bool flag, uint64_t pcid) {
@@ -242,6 +260,12 @@ struct ArrangementFilterTask{
     uint64_t length;
     uint64_t classId;
     uint64_t arrangementVersion;
+    bool compressed = false;    // readBuffer holds the container as stored, with its directory
+    bool relink = false;        // nothing is read, the liveness says where the container goes
+    bool relinkArchived;
+    uint64_t objectID, objectIndex;
+    uint32_t chunkCount;
+    uint64_t sourceCategory, sourceCID;
     bool classEndFlag = false;
     bool finalEndFlag = false;
     bool startFlag = false;
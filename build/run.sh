@@ -13,6 +13,7 @@ do
 
         echo "Deduplicating and Storing.."
         # deduplicating and storing a new backup
+        # (or --AdaptiveDeltaSelector=true --TargetThroughput=200 instead of a fixed threshold)
         ./MeGA --ConfigFile=config.toml --task=write --InputFile=/dev/shm/test --DeltaSelectorThreshold=30
 
         echo "Restore.."
@@ -7,14 +7,9 @@
  */
 
 #include <iostream>
+#include <fstream>
 
-#include "DedupPipeline/ReadFilePipeline.h"
-#include "RestorePipeline/RestoreReadPipeline.h"
-#include "DedupPipeline/Eliminator.h"
-#include "gflags/gflags.h"
-#include "Utility/Config.h"
-#include "Utility/Manifest.h"
-#include "ArrangementPipeline/ArrangementReadPipeline.h"
+#include "Store/Service.h"
 
 DEFINE_string(RestorePath,
               "", "restore path");
@@ -28,86 +23,46 @@ DEFINE_string(ConfigFile,
               "", "config path");
 DEFINE_string(InputFile,
               "", "input path");
-DEFINE_bool(ApplyArrangement,
-            true, "Whether apply arrangement");
-DEFINE_bool(delta, true, "whether delta compression");
-
-std::string LogicFilePath;
-std::string ClassFilePath;
-std::string VersionFilePath;
-std::string ManifestPath;
-std::string HomePath;
-std::string ClassFileAppendPath;
-uint64_t TotalVersion;
-uint64_t RetentionTime;
-std::string KVPath;
-bool DeltaSwitch;
-
-uint64_t  do_backup(const std::string& path){
-    StorageTask storageTask;
-    CountdownLatch countdownLatch(5); // there are 5 pipelines in the workflow of write.
-    storageTask.path = path;
-    storageTask.countdownLatch = &countdownLatch;
-    storageTask.fileID = TotalVersion;
-    GlobalReadPipelinePtr->addTask(&storageTask);
-    countdownLatch.wait();
-    return storageTask.length;
-}
-
-int do_restore(uint64_t version, uint64_t fallBehind) {
-  struct timeval t0, t1;
-
-  if (version == -1) version = TotalVersion;
-
-  char recipePath[256];
-  sprintf(recipePath, LogicFilePath.data(), version);
-  CountdownLatch countdownLatch(1);
-
-  RestoreTask restoreTask = {
-          TotalVersion,
-          version,
-          fallBehind
-  };
-
-    GlobalRestoreReadPipelinePtr = new RestoreReadPipeline();
-    GlobalRestoreDecomPipelinePtr = new RestoreDecomPipeline();
-    GlobalRestoreWritePipelinePtr = new RestoreWritePipeline(FLAGS_RestorePath, &countdownLatch);  // order is important.
-    GlobalRestoreParserPipelinePtr = new RestoreParserPipeline(version, recipePath);  // order is important.
-
-    gettimeofday(&t0, NULL);
-    GlobalRestoreReadPipelinePtr->addTask(&restoreTask);
-    countdownLatch.wait();
-    gettimeofday(&t1, NULL);
-    uint64_t duration = (t1.tv_sec-t0.tv_sec)*1000000 + (t1.tv_usec-t0.tv_usec);
-    printf("Total duration : %lu, speed : %f MB/s\n", duration, (float)GlobalRestoreWritePipelinePtr->getTotalSize() / duration);
-
-    delete GlobalRestoreReadPipelinePtr;
-    delete GlobalRestoreDecomPipelinePtr;
-    delete GlobalRestoreParserPipelinePtr;
-    delete GlobalRestoreWritePipelinePtr;
+DEFINE_bool(OverlapArrangement,
+            true, "in --task=batch, read, chunk and hash the next version while the last one is being arranged");
+DEFINE_uint64(CheckpointInterval,
+              16, "versions of --task=batch between two commits of the index, the catalog and the manifest, 0 for only at the end");
+
+// Backs up the inputs listed in the batch file, one per line, as consecutive versions. The index
+// and the pipelines stay in memory from one version to the next, the expired versions are deleted
+// and everything is persisted every CheckpointInterval versions and at the end. A failure between
+// two checkpoints loses the versions since the last one.
+int do_batch(Manifest &manifest) {
+    std::ifstream batchFile(FLAGS_BatchFilePath);
+    if (!batchFile.is_open()) {
+        printf("Can not open batch file %s\n", FLAGS_BatchFilePath.data());
+        return -1;
+    }
+    std::vector<std::string> inputs;
+    std::string line;
+    while (std::getline(batchFile, line)) {
+        if (!line.empty()) {
+            inputs.push_back(line);
+        }
+    }
 
+    OverlappedArrangement overlap;
+    uint64_t sinceCheckpoint = 0;
+    for (uint64_t i = 0; i < inputs.size(); i++) {
+        printf("Batch Task %lu/%lu: %s\n", i + 1, inputs.size(), inputs[i].data());
+        do_version(manifest, inputs[i], FLAGS_OverlapArrangement ? &overlap : nullptr);
+        sinceCheckpoint++;
+        if (sinceCheckpoint == FLAGS_CheckpointInterval || i + 1 == inputs.size()) {
+            overlap.wait();
+            printf("------------------------Retention----------------------\n");
+            do_retention(manifest);
+            do_commit(manifest, true);
+            sinceCheckpoint = 0;
+        }
+    }
     return 0;
 }
 
-int do_arrangement(){
-    printf("Arrangement Task: Version %lu\n", TotalVersion-1);
-    CountdownLatch arrangementLatch(1);
-    ArrangementTask arrangementTask = {
-            TotalVersion - 1, &arrangementLatch,
-    };
-    GlobalArrangementReadPipelinePtr->addTask(&arrangementTask);
-    arrangementLatch.wait();
-}
-
-int do_delete(){
-    printf("------------------------Deleting----------------------\n");
-    printf("%lu versions exist, delete the earliest version\n", TotalVersion);
-    printf("Delete Task..\n");
-    Eliminator eliminator;
-    eliminator.run(TotalVersion);
-    TotalVersion--;
-}
-
 int main(int argc, char **argv) {
     gflags::ParseCommandLineFlags(&argc, &argv, true);
     std::string statusStr("status");
@@ -115,93 +70,32 @@ int main(int argc, char **argv) {
     std::string writeStr("write");
     std::string batchStr("batch");
     std::string eliminateStr("delete");
-    DeltaSwitch = FLAGS_delta;
+    std::string arrangeStr("arrange");
+    std::string serveStr("serve");
 
     Manifest manifest;
-    {
-        ConfigReader configReader(FLAGS_ConfigFile);
-        ManifestReader manifestReader(&manifest);
-        TotalVersion = manifest.TotalVersion;
-    }
-
-    if (FLAGS_task == writeStr) {
+    open_storage(FLAGS_ConfigFile, manifest);
 
-        // pipelines init
-        //------------------------------------------------------
-        GlobalReadPipelinePtr = new ReadFilePipeline();
-        GlobalChunkingPipelinePtr = new ChunkingPipeline();
-        GlobalHashingPipelinePtr = new HashingPipeline();
-        GlobalDeduplicationPipelinePtr = new DeduplicationPipeline();
-        GlobalWriteFilePipelinePtr = new WriteFilePipeline();
-        GlobalMetadataManagerPtr = new MetadataManager();
-        GlobalArrangementReadPipelinePtr = new ArrangementReadPipeline();
-        GlobalArrangementFilterPipelinePtr = new ArrangementFilterPipeline();
-        GlobalArrangementWritePipelinePtr = new ArrangementWritePipeline();
-        //------------------------------------------------------
-
-        if(TotalVersion != 0)
-            GlobalMetadataManagerPtr->load();
-
-        uint64_t dedupDuration = 0, arrDuration = 0;
-        std::string workloadPath = FLAGS_InputFile;
-        uint64_t taskLength = 0;
-
-        {
-            TotalVersion++;
-            printf("-----------------------Backing up-----------------------\n");
-            printf("Dedup Task: %s\n", workloadPath.data());
-            struct timeval t0, t1;
-            gettimeofday(&t0, NULL);
-
-            taskLength = do_backup(workloadPath);
-
-            gettimeofday(&t1, NULL);
-            uint64_t singleDedup = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
-          printf("[CheckPoint:main] InitTime:%lu, EndTime:%lu\n", t0.tv_sec * 1000000 + t0.tv_usec,
-                 t1.tv_sec * 1000000 + t1.tv_usec);
-          dedupDuration += singleDedup;
-          printf("Backup duration:%lu us, Backup Size:%lu, Speed:%fMB/s\n", singleDedup, taskLength,
-                 (float) taskLength / singleDedup);
-          GlobalReadPipelinePtr->getStatistics();
-          GlobalChunkingPipelinePtr->getStatistics();
-          GlobalHashingPipelinePtr->getStatistics();
-          GlobalDeduplicationPipelinePtr->getStatistics();
-          GlobalWriteFilePipelinePtr->getStatistics();
-          printf("BackupSize:%lu, AfterDedup:%lu, AfterDelta:%lu, AfterCompression:%lu, Total Reduction Ratio:%f\n",
-                 GlobalMetadataManagerPtr->getTotalLength(),
-                 GlobalMetadataManagerPtr->getAfterDedup(),
-                 GlobalMetadataManagerPtr->getAfterDelta(),
-                 GlobalMetadataManagerPtr->getAfterCompression(),
-                 (float) (GlobalMetadataManagerPtr->getTotalLength()) /
-                 (GlobalMetadataManagerPtr->getAfterCompression()));
-
-          printf("----------------------Arrangement------------------------\n");
-          if (FLAGS_ApplyArrangement) {
-            gettimeofday(&t0, NULL);
-            do_arrangement();
-            gettimeofday(&t1, NULL);
-            uint64_t singleArr = (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec;
-            arrDuration += singleArr;
-            printf("Arrangement duration : %lu\n", singleArr);
-          } else {
-                printf("Arrangement is disabled by user.\n");
-                manifest.ArrangementFallBehind++;
-            }
+    if (FLAGS_task == writeStr || FLAGS_task == batchStr || FLAGS_task == serveStr) {
+        if (start_pipelines()) {
+            printf("The index of %lu versions can not be loaded, nothing is done.\n", TotalVersion);
+            stop_pipelines();
+            return 1;
+        }
 
+        if (FLAGS_task == batchStr) {
+            do_batch(manifest);
+        } else if (FLAGS_task == serveStr) {
+            do_serve(manifest);
+        } else {
+            printf("Dedup Task: %s\n", FLAGS_InputFile.data());
+            do_version(manifest, FLAGS_InputFile);
             printf("------------------------Retention----------------------\n");
-            if(TotalVersion > RetentionTime){
-                do_delete();
-            }else{
-              printf("Only %lu versions exist, and the retention is %lu, deletion is not required.\n", TotalVersion,
-                     RetentionTime);
-            }
-        }
+            do_retention(manifest);
 
-      {
-        manifest.TotalVersion = TotalVersion;
-        ManifestWriter manifestWriter(manifest);
-        GlobalMetadataManagerPtr->save();
-      }
+            // the manifest commits the version
+            do_commit(manifest, true);
+        }
 
 //        printf("==============================================\n");
 //        printf("Total deduplication duration:%lu us, Total Size:%lu, Speed:%fMB/s, arrange duration:%lu\n",
@@ -211,28 +105,42 @@ int main(int argc, char **argv) {
 //        printf("done\n");
 //        printf("==============================================\n");
 
-      // pipelines release
-      //------------------------------------------------------
-      delete GlobalArrangementReadPipelinePtr;
-      delete GlobalArrangementFilterPipelinePtr;
-      delete GlobalArrangementWritePipelinePtr;
-      delete GlobalReadPipelinePtr;
-      delete GlobalChunkingPipelinePtr;
-      delete GlobalHashingPipelinePtr;
-      delete GlobalDeduplicationPipelinePtr;
-        delete GlobalWriteFilePipelinePtr;
-        delete GlobalMetadataManagerPtr;
-        //------------------------------------------------------
+        stop_pipelines();
 
     }
     else if (FLAGS_task == restoreStr) {
-        do_restore(FLAGS_RestoreRecipe, manifest.ArrangementFallBehind);
+        do_restore(FLAGS_RestoreRecipe, manifest.ArrangementFallBehind, FLAGS_RestorePath);
+    }
+    else if (FLAGS_task == arrangeStr) {
+        // also for the unlinks of the deletions which follow
+        IOThrottle::enterIdleClass();
+        GlobalMetadataManagerPtr = new MetadataManager();
+        GlobalArrangementReadPipelinePtr = new ArrangementReadPipeline();
+        if (TotalVersion != 0 && GlobalMetadataManagerPtr->load()) {
+            printf("The index of %lu versions can not be loaded, nothing is done.\n", TotalVersion);
+            return 1;
+        }
+
+        printf("----------------------Arrangement------------------------\n");
+        printf("Arrangement falls %lu versions behind.\n", manifest.ArrangementFallBehind);
+        do_catch_up(manifest);
+        printf("------------------------Retention----------------------\n");
+        do_retention(manifest);
+        do_commit(manifest, true);
+
+        delete GlobalArrangementReadPipelinePtr;
+        delete GlobalMetadataManagerPtr;
+    }
+    else if (FLAGS_task == eliminateStr && manifest.ArrangementFallBehind) {
+        printf("Arrangement falls %lu versions behind, run --task=arrange first.\n", manifest.ArrangementFallBehind);
     }
     else if (FLAGS_task == eliminateStr) {
+        IOThrottle::enterIdleClass();
         Eliminator eliminator;
         eliminator.run(TotalVersion);
         TotalVersion--;
         {
+            GlobalCatalogPtr->save();
             manifest.TotalVersion = TotalVersion;
             ManifestWriter manifestWriter(manifest);
         }
@@ -240,6 +148,7 @@ int main(int argc, char **argv) {
     else if (FLAGS_task == statusStr) {
         printf("Totally %lu versions stored.\n", manifest.TotalVersion);
         printf("Arrangement fall  %lu versions behind.\n", manifest.ArrangementFallBehind);
+        printf("%lu segment files in the catalog.\n", GlobalCatalogPtr->getObjectCount());
     }
     else {
         printf("=================================================\n");
@@ -250,6 +159,13 @@ int main(int argc, char **argv) {
         printf("./MeGA --ConfigFile=config.toml --task=restore --RestorePath=[where the restored file is to locate] --RestoreRecipe=[which version to restore(1 ~ no. of the last retained version)]\n");
         printf("3. Check status of the system\n");
         printf("./MeGA --task=status\n");
+        printf("4. Catch up with the arrangement deferred by --ApplyArrangement=false\n");
+        printf("./MeGA --ConfigFile=config.toml --task=arrange\n");
+        printf("5. Write the versions listed in a file, one input per line, in one run\n");
+        printf("./MeGA --ConfigFile=config.toml --task=batch --BatchFilePath=[list of backup workloads] --CheckpointInterval=[versions between two commits]\n");
+        printf("6. Serve backup, restore, delete and status jobs on a UNIX socket, sent by MeGAClient\n");
+        printf("./MeGA --ConfigFile=config.toml --task=serve --SocketPath=[socket path]\n");
+        printf("./MeGAClient --SocketPath=[socket path] backup [backup workload] | restore [version] [path] | delete | status | stop\n");
         printf("--------------------------------------------------\n");
         printf("more information with --help\n");
         printf("=================================================\n");